@@ -899,6 +899,20 @@ int AUD_get_buffer_size_out(SWVoiceOut *sw)
     return sw->hw->samples * sw->hw->info.bytes_per_frame;
 }
 
+/*
+ * Nobody can hear a voice that is muted or that plays on the "none" backend
+ * without a capture attached.  Devices still have to write to it to keep
+ * their timing, but may skip producing real samples.
+ */
+bool AUD_is_silent_out(SWVoiceOut *sw)
+{
+    if (!sw || sw->vol.mute) {
+        return true;
+    }
+
+    return !strcmp(sw->s->drv->name, "none") && QLIST_EMPTY(&sw->hw->cap_head);
+}
+
 void AUD_set_active_out (SWVoiceOut *sw, int on)
 {
     HWVoiceOut *hw;
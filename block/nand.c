@@ -0,0 +1,747 @@
+/*
+ * Block driver for sparse NAND flash images
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The image stores the main and spare area of each programmed page together
+ * in one record. Erased pages have no record and read as 0xff without any
+ * I/O. Guests see the usual raw dump layout: the main area of all pages,
+ * followed by the spare area of all pages. See docs/interop/nand.txt.
+ *
+ * An image with a backing file only holds the pages written since it was
+ * created, which makes it a small per-instance overlay of a shared dump.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "block/qdict.h"
+#include "sysemu/block-backend.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qobject-input-visitor.h"
+#include "qapi/qapi-visit-block-core.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/coroutine.h"
+
+#define HEADER_MAGIC "QEMUNAND"
+#define HEADER_VERSION 1
+#define HEADER_SIZE 512
+
+#define NAND_MAX_AREA_SIZE 0x10000
+#define NAND_MAX_PAGES (1 << 24)
+#define NAND_MAX_BACKING_FILE_SIZE 1023
+
+/* Page table entry of a page that is erased even if the backing file is not */
+#define NAND_PAGE_ERASED 0xffffffff
+
+#define DEFAULT_PAGE_SIZE 4096
+#define DEFAULT_SPARE_SIZE 8
+
+#define NAND_OPT_PAGE_SIZE "page-size"
+#define NAND_OPT_SPARE_SIZE "spare-size"
+
+typedef struct NandHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t spare_size;
+    uint32_t reserved;
+    uint64_t num_pages;
+    uint64_t table_offset;
+    uint64_t data_offset;
+    uint64_t backing_file_offset;
+    uint32_t backing_file_size;
+    uint32_t reserved2;
+} QEMU_PACKED NandHeader;
+
+typedef struct BDRVNandState {
+    CoMutex lock;
+
+    uint32_t page_size;
+    uint32_t spare_size;
+    uint32_t num_pages;
+    uint64_t table_offset;
+    uint64_t data_offset;
+
+    /*
+     * Record number + 1 of each page, 0 for pages that are unchanged from the
+     * backing file (or erased without one), NAND_PAGE_ERASED for erased pages
+     */
+    uint32_t *table;
+    uint32_t num_records;
+} BDRVNandState;
+
+static QemuOptsList nand_create_opts = {
+    .name = "nand-create-opts",
+    .head = QTAILQ_HEAD_INITIALIZER(nand_create_opts.head),
+    .desc = {
+        {
+            .name = BLOCK_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Virtual disk size (pages * (page size + spare size))",
+        },
+        {
+            .name = NAND_OPT_PAGE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Main area bytes per page",
+            .def_value_str = stringify(DEFAULT_PAGE_SIZE),
+        },
+        {
+            .name = NAND_OPT_SPARE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Spare area bytes per page",
+            .def_value_str = stringify(DEFAULT_SPARE_SIZE),
+        },
+        {
+            .name = BLOCK_OPT_BACKING_FILE,
+            .type = QEMU_OPT_STRING,
+            .help = "File name of a base image",
+        },
+        {
+            .name = BLOCK_OPT_BACKING_FMT,
+            .type = QEMU_OPT_STRING,
+            .help = "Format of the backing image",
+        },
+        { /* end of list */ }
+    }
+};
+
+static uint32_t nand_record_size(BDRVNandState *s)
+{
+    return s->page_size + s->spare_size;
+}
+
+static uint64_t nand_record_offset(BDRVNandState *s, uint32_t page)
+{
+    return s->data_offset +
+           (uint64_t) (s->table[page] - 1) * nand_record_size(s);
+}
+
+/*
+ * Maps a guest offset to a page and a position in its record. Returns the
+ * number of bytes left in that area of the page.
+ */
+static uint32_t nand_locate(BDRVNandState *s, uint64_t offset,
+                            uint32_t *page, uint32_t *pos)
+{
+    uint64_t main_size = (uint64_t) s->num_pages * s->page_size;
+
+    if (offset < main_size) {
+        *page = offset / s->page_size;
+        *pos = offset % s->page_size;
+        return s->page_size - *pos;
+    }
+
+    offset -= main_size;
+    *page = offset / s->spare_size;
+    *pos = s->page_size + offset % s->spare_size;
+    return nand_record_size(s) - *pos;
+}
+
+/* True if the page has a record in this image */
+static bool nand_is_allocated(BDRVNandState *s, uint32_t page)
+{
+    return s->table[page] && s->table[page] != NAND_PAGE_ERASED;
+}
+
+static bool nand_is_erased(const uint8_t *buf, size_t len)
+{
+    return !len || (buf[0] == 0xff && !memcmp(buf, buf + 1, len - 1));
+}
+
+static int nand_check_area_sizes(uint64_t page_size, uint64_t spare_size,
+                                 Error **errp)
+{
+    if (!page_size || page_size > NAND_MAX_AREA_SIZE ||
+        spare_size > NAND_MAX_AREA_SIZE) {
+        error_setg(errp, "Page and spare size must be at most %d bytes, "
+                   "and the page size must not be 0", NAND_MAX_AREA_SIZE);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nand_check_geometry(uint64_t page_size, uint64_t spare_size,
+                               uint64_t num_pages, Error **errp)
+{
+    int ret;
+
+    ret = nand_check_area_sizes(page_size, spare_size, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!num_pages || num_pages > NAND_MAX_PAGES) {
+        error_setg(errp, "Number of pages must be between 1 and %d",
+                   NAND_MAX_PAGES);
+        return -EINVAL;
+    }
+    if (!QEMU_IS_ALIGNED(num_pages * (page_size + spare_size),
+                         BDRV_SECTOR_SIZE)) {
+        error_setg(errp, "Image size must be a multiple of 512 bytes");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int nand_probe(const uint8_t *buf, int buf_size, const char *filename)
+{
+    const NandHeader *header = (const void *)buf;
+
+    if (buf_size < (int) sizeof(*header)) {
+        return 0;
+    }
+
+    if (!memcmp(header->magic, HEADER_MAGIC, sizeof(header->magic)) &&
+        le32_to_cpu(header->version) == HEADER_VERSION) {
+        return 100;
+    }
+
+    return 0;
+}
+
+/*
+ * Reads the header and the page table. The state is only replaced once the
+ * whole image checks out, so a failed reload keeps the previous one.
+ */
+static int nand_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVNandState *s = bs->opaque;
+    NandHeader header;
+    uint64_t num_pages, table_offset, data_offset, backing_file_offset;
+    uint32_t page_size, spare_size, record_size, backing_file_size;
+    uint32_t i, entry, num_records;
+    uint32_t *table;
+    unsigned long *used;
+    int64_t file_size;
+    int ret;
+
+    file_size = bdrv_getlength(bs->file->bs);
+    if (file_size < 0) {
+        error_setg_errno(errp, -file_size, "Could not get NAND image size");
+        return file_size;
+    }
+
+    ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read NAND image header");
+        return ret;
+    }
+
+    if (memcmp(header.magic, HEADER_MAGIC, sizeof(header.magic)) ||
+        le32_to_cpu(header.version) != HEADER_VERSION) {
+        error_setg(errp, "Image not in NAND format");
+        return -EINVAL;
+    }
+
+    page_size = le32_to_cpu(header.page_size);
+    spare_size = le32_to_cpu(header.spare_size);
+    num_pages = le64_to_cpu(header.num_pages);
+    ret = nand_check_geometry(page_size, spare_size, num_pages, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    record_size = page_size + spare_size;
+
+    table_offset = le64_to_cpu(header.table_offset);
+    data_offset = le64_to_cpu(header.data_offset);
+    if (table_offset < sizeof(header) || table_offset > INT64_MAX ||
+        data_offset < table_offset + num_pages * 4 ||
+        data_offset > INT64_MAX - num_pages * record_size) {
+        error_setg(errp, "Invalid page table or data offset");
+        return -EINVAL;
+    }
+    if (table_offset + num_pages * 4 > file_size) {
+        error_setg(errp, "Image is truncated: the page table ends beyond "
+                   "the end of the file");
+        return -EINVAL;
+    }
+
+    backing_file_offset = le64_to_cpu(header.backing_file_offset);
+    backing_file_size = le32_to_cpu(header.backing_file_size);
+    if (backing_file_offset) {
+        if (backing_file_size > NAND_MAX_BACKING_FILE_SIZE ||
+            backing_file_size >= sizeof(bs->backing_file)) {
+            error_setg(errp, "Backing file name too long");
+            return -EINVAL;
+        }
+        if (backing_file_offset > file_size ||
+            backing_file_size > file_size - backing_file_offset) {
+            error_setg(errp, "Image is truncated: the backing file name ends "
+                       "beyond the end of the file");
+            return -EINVAL;
+        }
+        ret = bdrv_pread(bs->file, backing_file_offset, bs->auto_backing_file,
+                         backing_file_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read backing file name");
+            return ret;
+        }
+        bs->auto_backing_file[backing_file_size] = '\0';
+        pstrcpy(bs->backing_file, sizeof(bs->backing_file),
+                bs->auto_backing_file);
+    }
+
+    table = g_try_new(uint32_t, num_pages);
+    if (!table) {
+        error_setg(errp, "Could not allocate memory for page table");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, table_offset, table, num_pages * 4);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read page table");
+        g_free(table);
+        return ret;
+    }
+
+    /* Each record belongs to one page, writes to a shared one would leak */
+    used = bitmap_new(num_pages);
+    num_records = 0;
+    for (i = 0; i < num_pages; i++) {
+        entry = le32_to_cpu(table[i]);
+        table[i] = entry;
+        if (!entry || entry == NAND_PAGE_ERASED) {
+            continue;
+        }
+        if (entry > num_pages) {
+            error_setg(errp, "Invalid page table entry for page %" PRIu32, i);
+            ret = -EINVAL;
+            goto fail;
+        }
+        if (test_and_set_bit(entry - 1, used)) {
+            error_setg(errp, "Page %" PRIu32 " shares its record with another "
+                       "page", i);
+            ret = -EINVAL;
+            goto fail;
+        }
+        num_records = MAX(num_records, entry);
+    }
+
+    if (data_offset + (uint64_t) num_records * record_size > file_size) {
+        error_setg(errp, "Image is truncated: page records end beyond the end "
+                   "of the file");
+        ret = -EINVAL;
+        goto fail;
+    }
+    g_free(used);
+
+    g_free(s->table);
+    s->table = table;
+    s->page_size = page_size;
+    s->spare_size = spare_size;
+    s->num_pages = num_pages;
+    s->table_offset = table_offset;
+    s->data_offset = data_offset;
+    s->num_records = num_records;
+
+    bs->total_sectors = num_pages * record_size / BDRV_SECTOR_SIZE;
+    return 0;
+
+fail:
+    g_free(used);
+    g_free(table);
+    return ret;
+}
+
+static int nand_open(BlockDriverState *bs, QDict *options, int flags,
+                     Error **errp)
+{
+    BDRVNandState *s = bs->opaque;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_IMAGE, false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    qemu_co_mutex_init(&s->lock);
+    return nand_load(bs, errp);
+}
+
+static void coroutine_fn nand_co_invalidate_cache(BlockDriverState *bs,
+                                                  Error **errp)
+{
+    BDRVNandState *s = bs->opaque;
+
+    /* Another process may have programmed pages while we were inactive */
+    qemu_co_mutex_lock(&s->lock);
+    nand_load(bs, errp);
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+static int coroutine_fn
+nand_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+               QEMUIOVector *qiov, int flags)
+{
+    BDRVNandState *s = bs->opaque;
+    uint64_t done = 0;
+    uint32_t page, pos, len;
+    int ret;
+
+    while (done < bytes) {
+        len = MIN(nand_locate(s, offset + done, &page, &pos), bytes - done);
+
+        if (nand_is_allocated(s, page)) {
+            ret = bdrv_co_preadv_part(bs->file,
+                                      nand_record_offset(s, page) + pos, len,
+                                      qiov, done, 0);
+        } else if (!s->table[page] && bs->backing) {
+            ret = bdrv_co_preadv_part(bs->backing, offset + done, len,
+                                      qiov, done, 0);
+        } else {
+            qemu_iovec_memset(qiov, done, 0xff, len);
+            ret = 0;
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        done += len;
+    }
+
+    return 0;
+}
+
+/* Reads the record of a page that has none in this image */
+static int coroutine_fn nand_read_unallocated(BlockDriverState *bs,
+                                              uint32_t page, uint8_t *buf)
+{
+    BDRVNandState *s = bs->opaque;
+    uint64_t main_size = (uint64_t) s->num_pages * s->page_size;
+    int ret;
+
+    if (s->table[page] == NAND_PAGE_ERASED || !bs->backing) {
+        memset(buf, 0xff, nand_record_size(s));
+        return 0;
+    }
+
+    ret = bdrv_co_pread(bs->backing, (uint64_t) page * s->page_size,
+                        s->page_size, buf, 0);
+    if (ret < 0 || !s->spare_size) {
+        return ret;
+    }
+    return bdrv_co_pread(bs->backing,
+                         main_size + (uint64_t) page * s->spare_size,
+                         s->spare_size, buf + s->page_size, 0);
+}
+
+/*
+ * Gives a page without a record one that holds the written bytes. Writes that
+ * leave the page unchanged need no record, and neither do pages that end up
+ * erased: those only get NAND_PAGE_ERASED in the page table.
+ */
+static int coroutine_fn nand_allocate(BlockDriverState *bs, uint32_t page,
+                                      uint32_t pos, uint32_t len,
+                                      QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVNandState *s = bs->opaque;
+    uint32_t size = nand_record_size(s);
+    uint32_t entry, le_entry;
+    uint8_t *buf, *data;
+    int ret;
+
+    buf = qemu_try_blockalign(bs->file->bs, size + len);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    data = buf + size;
+
+    ret = nand_read_unallocated(bs, page, buf);
+    if (ret < 0) {
+        goto out;
+    }
+
+    qemu_iovec_to_buf(qiov, qiov_offset, data, len);
+    if (!memcmp(buf + pos, data, len)) {
+        ret = 0;
+        goto out;
+    }
+    memcpy(buf + pos, data, len);
+
+    if (nand_is_erased(buf, size)) {
+        entry = NAND_PAGE_ERASED;
+    } else if (s->num_records >= s->num_pages) {
+        /* Only an image that skips record numbers runs out of them */
+        ret = -ENOSPC;
+        goto out;
+    } else {
+        /* The record is written before the table entry that points to it */
+        ret = bdrv_co_pwrite(bs->file,
+                             s->data_offset + (uint64_t) s->num_records * size,
+                             size, buf, 0);
+        if (ret < 0) {
+            goto out;
+        }
+        entry = s->num_records + 1;
+    }
+
+    le_entry = cpu_to_le32(entry);
+    ret = bdrv_co_pwrite(bs->file, s->table_offset + (uint64_t) page * 4,
+                         sizeof(le_entry), &le_entry, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    s->table[page] = entry;
+    if (entry != NAND_PAGE_ERASED) {
+        s->num_records++;
+    }
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn
+nand_co_pwritev(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                QEMUIOVector *qiov, int flags)
+{
+    BDRVNandState *s = bs->opaque;
+    uint64_t done = 0;
+    uint32_t page, pos, len;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&s->lock);
+
+    while (done < bytes) {
+        len = MIN(nand_locate(s, offset + done, &page, &pos), bytes - done);
+
+        if (nand_is_allocated(s, page)) {
+            ret = bdrv_co_pwritev_part(bs->file,
+                                       nand_record_offset(s, page) + pos, len,
+                                       qiov, done, 0);
+        } else {
+            ret = nand_allocate(bs, page, pos, len, qiov, done);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        done += len;
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn nand_co_create(BlockdevCreateOptions *opts,
+                                       Error **errp)
+{
+    BlockdevCreateOptionsNand *nand_opts;
+    BlockDriverState *bs;
+    BlockBackend *blk;
+    uint64_t page_size, spare_size, num_pages, table_offset, table_size;
+    size_t backing_file_size = 0;
+    NandHeader header;
+    uint8_t buf[HEADER_SIZE];
+    int ret;
+
+    assert(opts->driver == BLOCKDEV_DRIVER_NAND);
+    nand_opts = &opts->u.nand;
+
+    page_size = nand_opts->has_page_size ? nand_opts->page_size
+                                         : DEFAULT_PAGE_SIZE;
+    spare_size = nand_opts->has_spare_size ? nand_opts->spare_size
+                                           : DEFAULT_SPARE_SIZE;
+
+    /* Bound the sizes first, their sum must neither wrap nor be 0 */
+    ret = nand_check_area_sizes(page_size, spare_size, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    if (nand_opts->size % (page_size + spare_size)) {
+        error_setg(errp, "Image size must be a multiple of the page size "
+                   "plus the spare size");
+        return -EINVAL;
+    }
+    num_pages = nand_opts->size / (page_size + spare_size);
+    ret = nand_check_geometry(page_size, spare_size, num_pages, errp);
+    if (ret < 0) {
+        return ret;
+    }
+    table_size = num_pages * 4;
+
+    if (nand_opts->has_backing_file) {
+        backing_file_size = strlen(nand_opts->backing_file);
+        if (backing_file_size > NAND_MAX_BACKING_FILE_SIZE) {
+            error_setg(errp, "Backing file name too long");
+            return -EINVAL;
+        }
+    }
+    table_offset = ROUND_UP(HEADER_SIZE + backing_file_size, BDRV_SECTOR_SIZE);
+
+    /* Create BlockBackend to write to the image */
+    bs = bdrv_open_blockdev_ref(nand_opts->file, errp);
+    if (bs == NULL) {
+        return -EIO;
+    }
+
+    blk = blk_new_with_bs(bs, BLK_PERM_WRITE | BLK_PERM_RESIZE, BLK_PERM_ALL,
+                          errp);
+    if (!blk) {
+        ret = -EPERM;
+        goto out;
+    }
+    blk_set_allow_write_beyond_eof(blk, true);
+
+    /* Records are appended at the end of the file, which must not be padded */
+    ret = blk_truncate(blk, 0, true, PREALLOC_MODE_OFF, 0, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HEADER_MAGIC, sizeof(header.magic));
+    header.version = cpu_to_le32(HEADER_VERSION);
+    header.page_size = cpu_to_le32(page_size);
+    header.spare_size = cpu_to_le32(spare_size);
+    header.num_pages = cpu_to_le64(num_pages);
+    header.table_offset = cpu_to_le64(table_offset);
+    header.data_offset = cpu_to_le64(ROUND_UP(table_offset + table_size,
+                                              BDRV_SECTOR_SIZE));
+    if (backing_file_size) {
+        header.backing_file_offset = cpu_to_le64(HEADER_SIZE);
+        header.backing_file_size = cpu_to_le32(backing_file_size);
+    }
+
+    /* All pages start out erased */
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, &header, sizeof(header));
+
+    ret = blk_pwrite(blk, 0, buf, sizeof(buf), 0);
+    if (ret < 0) {
+        goto exit;
+    }
+    if (backing_file_size) {
+        ret = blk_pwrite(blk, HEADER_SIZE, nand_opts->backing_file,
+                         backing_file_size, 0);
+        if (ret < 0) {
+            goto exit;
+        }
+    }
+    ret = blk_pwrite_zeroes(blk, table_offset,
+                            ROUND_UP(table_size, BDRV_SECTOR_SIZE), 0);
+    if (ret < 0) {
+        goto exit;
+    }
+
+    ret = 0;
+out:
+    blk_unref(blk);
+    bdrv_unref(bs);
+    return ret;
+
+exit:
+    error_setg_errno(errp, -ret, "Failed to create NAND image");
+    goto out;
+}
+
+static int coroutine_fn nand_co_create_opts(BlockDriver *drv,
+                                            const char *filename,
+                                            QemuOpts *opts,
+                                            Error **errp)
+{
+    BlockdevCreateOptions *create_options = NULL;
+    BlockDriverState *bs = NULL;
+    QDict *qdict = NULL;
+    Visitor *v;
+    char *backing_fmt;
+    int ret;
+
+    static const QDictRenames opt_renames[] = {
+        { BLOCK_OPT_BACKING_FILE,       "backing-file" },
+        { NULL, NULL },
+    };
+
+    /*
+     * The backing format is not stored and is probed on open, but the
+     * request is still checked.
+     */
+    backing_fmt = qemu_opt_get_del(opts, BLOCK_OPT_BACKING_FMT);
+    if (backing_fmt && !bdrv_find_format(backing_fmt)) {
+        error_setg(errp, "unrecognized backing format '%s'", backing_fmt);
+        ret = -EINVAL;
+        goto done;
+    }
+
+    qdict = qemu_opts_to_qdict_filtered(opts, NULL, &nand_create_opts, true);
+    if (!qdict_rename_keys(qdict, opt_renames, errp)) {
+        ret = -EINVAL;
+        goto done;
+    }
+
+    /* Create and open the file (protocol layer) */
+    ret = bdrv_create_file(filename, opts, errp);
+    if (ret < 0) {
+        goto done;
+    }
+
+    bs = bdrv_open(filename, NULL, NULL,
+                   BDRV_O_RDWR | BDRV_O_RESIZE | BDRV_O_PROTOCOL, errp);
+    if (bs == NULL) {
+        ret = -EIO;
+        goto done;
+    }
+
+    /* Now get the QAPI type BlockdevCreateOptions */
+    qdict_put_str(qdict, "driver", "nand");
+    qdict_put_str(qdict, "file", bs->node_name);
+
+    v = qobject_input_visitor_new_flat_confused(qdict, errp);
+    if (!v) {
+        ret = -EINVAL;
+        goto done;
+    }
+
+    visit_type_BlockdevCreateOptions(v, NULL, &create_options, errp);
+    visit_free(v);
+    if (!create_options) {
+        ret = -EINVAL;
+        goto done;
+    }
+
+    /* Create the NAND image (format layer) */
+    ret = nand_co_create(create_options, errp);
+
+done:
+    g_free(backing_fmt);
+    qobject_unref(qdict);
+    bdrv_unref(bs);
+    qapi_free_BlockdevCreateOptions(create_options);
+    return ret;
+}
+
+static void nand_close(BlockDriverState *bs)
+{
+    BDRVNandState *s = bs->opaque;
+
+    g_free(s->table);
+}
+
+static BlockDriver bdrv_nand = {
+    .format_name                = "nand",
+    .instance_size              = sizeof(BDRVNandState),
+    .bdrv_probe                 = nand_probe,
+    .bdrv_open                  = nand_open,
+    .bdrv_close                 = nand_close,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_co_invalidate_cache   = nand_co_invalidate_cache,
+    .bdrv_co_preadv             = nand_co_preadv,
+    .bdrv_co_pwritev            = nand_co_pwritev,
+    .is_format                  = true,
+    .supports_backing           = true,
+    .bdrv_co_create             = nand_co_create,
+    .bdrv_co_create_opts        = nand_co_create_opts,
+    .create_opts                = &nand_create_opts,
+};
+
+static void bdrv_nand_init(void)
+{
+    bdrv_register(&bdrv_nand);
+}
+
+block_init(bdrv_nand_init);
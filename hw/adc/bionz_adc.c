@@ -4,6 +4,7 @@
 #include "analog.h"
 #include "hw/irq.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
 
 #define NUM_CHANNELS 8
@@ -105,11 +106,24 @@ static void adc_realize(DeviceState *dev, Error **errp)
     s->analog = analog_bus_create(dev, "analog", adc_set, s);
 }
 
+static const VMStateDescription vmstate_adc = {
+    .name = TYPE_BIONZ_ADC,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(ctrl, AdcState),
+        VMSTATE_UINT16_ARRAY(inputs, AdcState, NUM_CHANNELS),
+        VMSTATE_UINT16_ARRAY(sampled, AdcState, NUM_CHANNELS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void adc_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = adc_realize;
     dc->reset = adc_reset;
+    dc->vmsd = &vmstate_adc;
 }
 
 static const TypeInfo adc_info = {
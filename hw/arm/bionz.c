@@ -3,6 +3,8 @@
 #include "qemu/osdep.h"
 #include "cpu.h"
 #include "hw/sysbus.h"
+#include "hw/arm/bionz.h"
+#include "hw/arm/bionz_error.h"
 #include "hw/block/flash.h"
 #include "hw/boards.h"
 #include "hw/char/pl011.h"
@@ -13,6 +15,9 @@
 #include "hw/loader.h"
 #include "hw/sd/sdhci.h"
 #include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/visitor.h"
+#include "qemu/error-report.h"
 #include "sysemu/block-backend.h"
 #include "sysemu/sysemu.h"
 #include "target/arm/arm-tcm.h"
@@ -82,6 +87,8 @@
 #define CXD4115_DDR_SIZE 0x10000000
 #define CXD4115_DMA_BASE 0x78008000
 #define CXD4115_DMA_NUM_CHANNEL 8
+#define CXD4115_DMA_REQ_LDEC_IN 6
+#define CXD4115_DMA_REQ_LDEC_OUT 7
 #define CXD4115_USB_BASE 0x78020000
 #define CXD4115_LDEC_BASE 0x78090000
 #define CXD4115_ONA_BASE 0x78098000
@@ -244,6 +251,9 @@
 
 #define NAND_SECTOR_SIZE 0x200
 #define NAND_PAGE_SIZE 0x1000
+#define NAND_SPARE_SIZE 0x8
+#define ONENAND_PAGE_SIZE 0x800
+#define ONENAND_SPARE_SIZE 0x40
 
 static hwaddr cxd_init_loader2(BlockBackend *drive)
 {
@@ -380,12 +390,57 @@ static void cxd_write_bootloader(hwaddr base, hwaddr target)
     rom_add_blob_fixed("bootloader", loader, sizeof(loader), base);
 }
 
+// Opens the NAND drive: either the legacy if=mtd drive or the nand-overlay image, which is created on top of nand-base if it does not exist yet
+static BlockBackend *cxd_nand_drive(MachineState *machine, uint32_t page_size, uint32_t spare_size)
+{
+    BionzMachineState *bms = BIONZ_MACHINE(machine);
+    DriveInfo *dinfo = drive_get(IF_MTD, 0, 0);
+    BlockBackend *blk;
+    QDict *options;
+    char *create_options;
+    const char *backing_file;
+
+    if (!bms->nand_base && !bms->nand_overlay) {
+        return dinfo ? blk_by_legacy_dinfo(dinfo) : NULL;
+    }
+    if (!bms->nand_base || !bms->nand_overlay) {
+        error_report("nand-base and nand-overlay must be used together");
+        exit(1);
+    }
+    if (dinfo) {
+        error_report("nand-overlay cannot be combined with an if=mtd drive");
+        exit(1);
+    }
+
+    if (access(bms->nand_overlay, F_OK) < 0) {
+        create_options = g_strdup_printf("page-size=%" PRIu32 ",spare-size=%" PRIu32, page_size, spare_size);
+        bdrv_img_create(bms->nand_overlay, "nand", bms->nand_base, NULL, create_options, -1, 0, true, &error_fatal);
+        g_free(create_options);
+    }
+
+    // The base is only opened read-only as the backing file, all instances share it through the host page cache
+    options = qdict_new();
+    qdict_put_str(options, "driver", "nand");
+    blk = blk_new_open(bms->nand_overlay, NULL, options, BDRV_O_RDWR, &error_fatal);
+
+    backing_file = blk_bs(blk)->backing_file;
+    if (strcmp(backing_file, bms->nand_base)) {
+        error_report("nand-overlay '%s' is based on '%s', not on '%s'", bms->nand_overlay, backing_file, bms->nand_base);
+        exit(1);
+    }
+
+    // Use the name of the legacy drive so that the monitor and bionz_meno find it
+    monitor_add_blk(blk, "mtd0", &error_fatal);
+    return blk;
+}
+
 static void cxd4108_init(MachineState *machine)
 {
+    BionzMachineState *bms = BIONZ_MACHINE(machine);
     DriveInfo *dinfo;
     BlockBackend *drive;
     MemoryRegion *mem, *ddr, *container;
-    DeviceState *dev;
+    DeviceState *dev, *vip, *cpus[2];
     Object *cpu;
     BusState *bus;
     qemu_irq irq[32][16];
@@ -393,8 +448,7 @@ static void cxd4108_init(MachineState *machine)
     qemu_irq vsync;
     int i, j, k;
 
-    dinfo = drive_get(IF_MTD, 0, 0);
-    drive = dinfo ? blk_by_legacy_dinfo(dinfo) : NULL;
+    drive = cxd_nand_drive(machine, ONENAND_PAGE_SIZE, ONENAND_SPARE_SIZE);
 
     for (i = 0; i < machine->smp.cpus; i++) {
         cpu = object_new(machine->cpu_type);
@@ -412,21 +466,22 @@ static void cxd4108_init(MachineState *machine)
             arm_tcm_init(ARM_CPU(cpu), g_new(arm_tcm_mem, 1));
         }
         qdev_realize(DEVICE(cpu), NULL, &error_fatal);
+        cpus[i] = DEVICE(cpu);
+    }
 
-        dev = qdev_new("bionz_intc");
-        qdev_prop_set_uint32(dev, "len-enabled-channels", 1);
-        qdev_prop_set_uint8(dev, "enabled-channels[0]", CXD4108_IRQ_CH_PL320);
-        sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
-        sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, CXD4108_INTC_BASE(i));
-        sysbus_connect_irq(SYS_BUS_DEVICE(dev), 0, qdev_get_gpio_in(DEVICE(cpu), ARM_CPU_IRQ));
-        for (j = 0; j < 32; j++) {
-            for (k = 0; k < 16; k++) {
-                if (i == 0) {
-                    irq[j][k] = qdev_get_gpio_in(dev, j * 16 + k);
-                } else {
-                    irq[j][k] = qemu_irq_split(irq[j][k], qdev_get_gpio_in(dev, j * 16 + k));
-                }
-            }
+    // Each core has its own register bank of one controller that sees all interrupt lines
+    dev = qdev_new("bionz_intc");
+    qdev_prop_set_uint32(dev, "num-targets", machine->smp.cpus);
+    qdev_prop_set_uint32(dev, "len-enabled-channels", 1);
+    qdev_prop_set_uint8(dev, "enabled-channels[0]", CXD4108_IRQ_CH_PL320);
+    sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
+    for (i = 0; i < machine->smp.cpus; i++) {
+        sysbus_mmio_map(SYS_BUS_DEVICE(dev), i, CXD4108_INTC_BASE(i));
+        sysbus_connect_irq(SYS_BUS_DEVICE(dev), 2 * i, qdev_get_gpio_in(cpus[i], ARM_CPU_IRQ));
+    }
+    for (j = 0; j < 32; j++) {
+        for (k = 0; k < 16; k++) {
+            irq[j][k] = qdev_get_gpio_in(dev, j * 16 + k);
         }
     }
 
@@ -577,14 +632,17 @@ static void cxd4108_init(MachineState *machine)
 
     dev = qdev_new("bionz_vip");
     object_property_set_link(OBJECT(dev), "memory", OBJECT(ddr), &error_fatal);
+    qdev_prop_set_bool(dev, "skip-vsync", bms->skip_vsync);
     sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
     sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, CXD4108_VIP_BASE);
     sysbus_mmio_map(SYS_BUS_DEVICE(dev), 1, CXD4108_VIP_BASE + 0x800);
     sysbus_connect_irq(SYS_BUS_DEVICE(dev), 0, irq[CXD4108_IRQ_CH_VIDEO][0]);
     sysbus_connect_irq(SYS_BUS_DEVICE(dev), 1, irq[CXD4108_IRQ_CH_VIDEO][1]);
     vsync = qdev_get_gpio_in(dev, 0);
+    vip = dev;
 
     dev = qdev_new("bionz_sysv");
+    qdev_prop_set_uint32(dev, "vsync-coalesce", bms->vsync_coalesce);
     sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
     sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, CXD4108_SYSV_BASE);
     for (i = 0; i < 10; i++) {
@@ -595,6 +653,7 @@ static void cxd4108_init(MachineState *machine)
         }
     }
     qdev_connect_gpio_out(dev, 0, vsync);
+    qdev_connect_gpio_out_named(vip, "vsync-irq-enabled", 0, qdev_get_gpio_in_named(dev, "vsync-irq-enabled", 0));
 
     dev = qdev_new("bionz_audio");
     qdev_prop_set_uint32(dev, "base", CXD4108_DDR_BASE);
@@ -620,17 +679,15 @@ static void cxd4108_init(MachineState *machine)
 
 static void cxd4115_init(MachineState *machine)
 {
-    DriveInfo *dinfo;
     BlockBackend *drive;
     MemoryRegion *mem;
-    DeviceState *dev;
+    DeviceState *dev, *ldec;
     Object *cpu;
     qemu_irq irq[CXD4115_NUM_IRQ - CXD4115_IRQ_OFFSET];
     qemu_irq gpio_irq[24];
     int i, j, k;
 
-    dinfo = drive_get(IF_MTD, 0, 0);
-    drive = dinfo ? blk_by_legacy_dinfo(dinfo) : NULL;
+    drive = cxd_nand_drive(machine, ONENAND_PAGE_SIZE, ONENAND_SPARE_SIZE);
 
     cpu = object_new(machine->cpu_type);
     object_property_set_bool(cpu, "reset-hivecs", true, &error_fatal);
@@ -687,14 +744,22 @@ static void cxd4115_init(MachineState *machine)
     sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, CXD4115_NAND_BASE);
     sysbus_connect_irq(SYS_BUS_DEVICE(dev), 0, gpio_irq[CXD4115_IRQ_GPIO_NAND]);
 
+    ldec = qdev_new("bionz_ldec");
+    sysbus_realize_and_unref(SYS_BUS_DEVICE(ldec), &error_fatal);
+    sysbus_mmio_map(SYS_BUS_DEVICE(ldec), 0, CXD4115_LDEC_BASE);
+
     dev = qdev_new("bionz_dma");
     qdev_prop_set_uint32(dev, "version", 1);
     qdev_prop_set_uint32(dev, "num-channel", CXD4115_DMA_NUM_CHANNEL);
+    object_property_set_link(OBJECT(dev), "peripheral" stringify(CXD4115_DMA_REQ_LDEC_IN), OBJECT(ldec), &error_fatal);
+    object_property_set_link(OBJECT(dev), "peripheral" stringify(CXD4115_DMA_REQ_LDEC_OUT), OBJECT(ldec), &error_fatal);
     sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
     sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, CXD4115_DMA_BASE);
     for (i = 0; i < CXD4115_DMA_NUM_CHANNEL; i++) {
         sysbus_connect_irq(SYS_BUS_DEVICE(dev), i, irq[CXD4115_IRQ_DMA(i) - CXD4115_IRQ_OFFSET]);
     }
+    qdev_connect_gpio_out_named(ldec, "dma-request", 0, qdev_get_gpio_in_named(dev, "request", CXD4115_DMA_REQ_LDEC_IN));
+    qdev_connect_gpio_out_named(ldec, "dma-request", 1, qdev_get_gpio_in_named(dev, "request", CXD4115_DMA_REQ_LDEC_OUT));
 
     dev = qdev_new("inventra_usb");
     sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
@@ -702,10 +767,6 @@ static void cxd4115_init(MachineState *machine)
     sysbus_connect_irq(SYS_BUS_DEVICE(dev), 0, irq[CXD4115_IRQ_USB0 - CXD4115_IRQ_OFFSET]);
     sysbus_connect_irq(SYS_BUS_DEVICE(dev), 1, irq[CXD4115_IRQ_USB1 - CXD4115_IRQ_OFFSET]);
 
-    dev = qdev_new("bionz_ldec");
-    sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
-    sysbus_mmio_map(SYS_BUS_DEVICE(dev), 0, CXD4115_LDEC_BASE);
-
     for (i = 0; i < CXD4115_NUM_HWTIMER; i++) {
         dev = qdev_new("bionz_hwtimer");
         sysbus_realize_and_unref(SYS_BUS_DEVICE(dev), &error_fatal);
@@ -748,7 +809,6 @@ static void cxd4115_init(MachineState *machine)
 
 static void cxd4132_init(MachineState *machine)
 {
-    DriveInfo *dinfo;
     BlockBackend *drive;
     MemoryRegion *mem;
     DeviceState *dev;
@@ -756,8 +816,7 @@ static void cxd4132_init(MachineState *machine)
     qemu_irq irq[CXD4132_NUM_IRQ - CXD4132_IRQ_OFFSET];
     int i;
 
-    dinfo = drive_get(IF_MTD, 0, 0);
-    drive = dinfo ? blk_by_legacy_dinfo(dinfo) : NULL;
+    drive = cxd_nand_drive(machine, ONENAND_PAGE_SIZE, ONENAND_SPARE_SIZE);
 
     cpu = object_new(machine->cpu_type);
     object_property_set_bool(cpu, "reset-hivecs", true, &error_fatal);
@@ -866,7 +925,6 @@ static void cxd4132_init(MachineState *machine)
 
 static void cxd90014_init(MachineState *machine)
 {
-    DriveInfo *dinfo;
     BlockBackend *drive;
     MemoryRegion *mem;
     DeviceState *dev;
@@ -875,8 +933,7 @@ static void cxd90014_init(MachineState *machine)
     qemu_irq boss_irq;
     int i;
 
-    dinfo = drive_get(IF_MTD, 0, 0);
-    drive = dinfo ? blk_by_legacy_dinfo(dinfo) : NULL;
+    drive = cxd_nand_drive(machine, NAND_PAGE_SIZE, NAND_SPARE_SIZE);
 
     cpu = object_new(machine->cpu_type);
     object_property_set_bool(cpu, "has_el3", false, &error_fatal);
@@ -1093,56 +1150,219 @@ static void cxd90045_init(MachineState *machine)
     cxd_add_const_reg("unknown1", 0xf290c008, 1);
 }
 
-static void cxd4108_machine_init(MachineClass *mc)
+// Machine options that are passed on to the display devices
+static bool cxd4108_get_skip_vsync(Object *obj, Error **errp)
+{
+    return BIONZ_MACHINE(obj)->skip_vsync;
+}
+
+static void cxd4108_set_skip_vsync(Object *obj, bool value, Error **errp)
+{
+    BIONZ_MACHINE(obj)->skip_vsync = value;
+}
+
+static void cxd4108_get_vsync_coalesce(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp)
+{
+    visit_type_uint32(v, name, &BIONZ_MACHINE(obj)->vsync_coalesce, errp);
+}
+
+static void cxd4108_set_vsync_coalesce(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp)
+{
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value) {
+        error_setg(errp, "%s must be at least 1", name);
+        return;
+    }
+    BIONZ_MACHINE(obj)->vsync_coalesce = value;
+}
+
+static bool cxd_get_stop_on_device_error(Object *obj, Error **errp)
+{
+    return BIONZ_MACHINE(obj)->stop_on_device_error;
+}
+
+static void cxd_set_stop_on_device_error(Object *obj, bool value, Error **errp)
+{
+    BIONZ_MACHINE(obj)->stop_on_device_error = value;
+}
+
+static bool cxd_get_warp_idle(Object *obj, Error **errp)
+{
+    return BIONZ_MACHINE(obj)->warp_idle;
+}
+
+static void cxd_set_warp_idle(Object *obj, bool value, Error **errp)
+{
+    BIONZ_MACHINE(obj)->warp_idle = value;
+}
+
+static bool cxd_idle_warp_allowed(MachineState *machine)
+{
+    return BIONZ_MACHINE(machine)->warp_idle;
+}
+
+static char *cxd_get_nand_base(Object *obj, Error **errp)
+{
+    return g_strdup(BIONZ_MACHINE(obj)->nand_base);
+}
+
+static void cxd_set_nand_base(Object *obj, const char *value, Error **errp)
+{
+    BionzMachineState *bms = BIONZ_MACHINE(obj);
+
+    g_free(bms->nand_base);
+    bms->nand_base = g_strdup(value);
+}
+
+static char *cxd_get_nand_overlay(Object *obj, Error **errp)
+{
+    return g_strdup(BIONZ_MACHINE(obj)->nand_overlay);
+}
+
+static void cxd_set_nand_overlay(Object *obj, const char *value, Error **errp)
+{
+    BionzMachineState *bms = BIONZ_MACHINE(obj);
+
+    g_free(bms->nand_overlay);
+    bms->nand_overlay = g_strdup(value);
+}
+
+// Options of the machines that boot from NAND
+static void cxd_nand_machine_class_props(ObjectClass *oc)
+{
+    object_class_property_add_str(oc, "nand-base", cxd_get_nand_base, cxd_set_nand_base);
+    object_class_property_set_description(oc, "nand-base", "Read-only NAND dump shared by all instances");
+    object_class_property_add_str(oc, "nand-overlay", cxd_get_nand_overlay, cxd_set_nand_overlay);
+    object_class_property_set_description(oc, "nand-overlay", "NAND image that holds the pages this instance writes, created on top of nand-base if missing");
+}
+
+static void cxd_machine_instance_init(Object *obj)
 {
+    BIONZ_MACHINE(obj)->vsync_coalesce = 1;
+}
+
+static void cxd_machine_instance_finalize(Object *obj)
+{
+    BionzMachineState *bms = BIONZ_MACHINE(obj);
+
+    g_free(bms->nand_base);
+    g_free(bms->nand_overlay);
+}
+
+// Options shared by all machines
+static void cxd_machine_class_init(ObjectClass *oc, void *data)
+{
+    MachineClass *mc = MACHINE_CLASS(oc);
+
+    mc->idle_warp_allowed = cxd_idle_warp_allowed;
+
+    object_class_property_add_bool(oc, "stop-on-device-error", cxd_get_stop_on_device_error, cxd_set_stop_on_device_error);
+    object_class_property_set_description(oc, "stop-on-device-error", "Pause the VM when a peripheral fails a command it cannot execute");
+    object_class_property_add_bool(oc, "warp-idle", cxd_get_warp_idle, cxd_set_warp_idle);
+    object_class_property_set_description(oc, "warp-idle", "Advance the virtual clock to the next timer while all CPUs are halted and no device work is in flight (ignored with -icount)");
+}
+
+static void cxd4108_machine_class_init(ObjectClass *oc, void *data)
+{
+    MachineClass *mc = MACHINE_CLASS(oc);
+
     mc->desc = "Sony BIONZ CXD4108";
     mc->init = cxd4108_init;
     mc->default_cpu_type = ARM_CPU_TYPE_NAME("arm926");
     mc->max_cpus = 2;
     mc->default_cpus = 2;
     mc->ignore_memory_transaction_failures = true;
-}
 
-DEFINE_MACHINE("cxd4108", cxd4108_machine_init)
+    object_class_property_add_bool(oc, "skip-vsync", cxd4108_get_skip_vsync, cxd4108_set_skip_vsync);
+    object_class_property_set_description(oc, "skip-vsync", "Only compose the display when a display listener refreshes it");
+    object_class_property_add(oc, "vsync-coalesce", "uint32", cxd4108_get_vsync_coalesce, cxd4108_set_vsync_coalesce, NULL, NULL);
+    object_class_property_set_description(oc, "vsync-coalesce", "Number of vsync periods merged into one while all CPUs are halted and no vsync interrupt is enabled");
+    cxd_nand_machine_class_props(oc);
+}
 
-static void cxd4115_machine_init(MachineClass *mc)
+static void cxd4115_machine_class_init(ObjectClass *oc, void *data)
 {
+    MachineClass *mc = MACHINE_CLASS(oc);
+
     mc->desc = "Sony BIONZ CXD4115";
     mc->init = cxd4115_init;
     mc->default_cpu_type = ARM_CPU_TYPE_NAME("arm11mpcore");
     mc->ignore_memory_transaction_failures = true;
-}
 
-DEFINE_MACHINE("cxd4115", cxd4115_machine_init)
+    cxd_nand_machine_class_props(oc);
+}
 
-static void cxd4132_machine_init(MachineClass *mc)
+static void cxd4132_machine_class_init(ObjectClass *oc, void *data)
 {
+    MachineClass *mc = MACHINE_CLASS(oc);
+
     mc->desc = "Sony BIONZ CXD4132";
     mc->init = cxd4132_init;
     mc->default_cpu_type = ARM_CPU_TYPE_NAME("arm11mpcore");
     mc->ignore_memory_transaction_failures = true;
-}
 
-DEFINE_MACHINE("cxd4132", cxd4132_machine_init)
+    cxd_nand_machine_class_props(oc);
+}
 
-static void cxd90014_machine_init(MachineClass *mc)
+static void cxd90014_machine_class_init(ObjectClass *oc, void *data)
 {
+    MachineClass *mc = MACHINE_CLASS(oc);
+
     mc->desc = "Sony BIONZ CXD90014";
     mc->init = cxd90014_init;
     mc->default_cpu_type = ARM_CPU_TYPE_NAME("cortex-a5");
+    mc->min_cpus = 2;// the boss has its own vCPU thread and TCG region under MTTCG
     mc->max_cpus = 2;
     mc->default_cpus = 2;// main + boss
     mc->ignore_memory_transaction_failures = true;
-}
 
-DEFINE_MACHINE("cxd90014", cxd90014_machine_init)
+    cxd_nand_machine_class_props(oc);
+}
 
-static void cxd90045_machine_init(MachineClass *mc)
+static void cxd90045_machine_class_init(ObjectClass *oc, void *data)
 {
+    MachineClass *mc = MACHINE_CLASS(oc);
+
     mc->desc = "Sony BIONZ CXD90045";
     mc->init = cxd90045_init;
     mc->default_cpu_type = ARM_CPU_TYPE_NAME("cortex-a5");
     mc->ignore_memory_transaction_failures = true;
 }
 
-DEFINE_MACHINE("cxd90045", cxd90045_machine_init)
+static const TypeInfo cxd_machine_types[] = {
+    {
+        .name          = TYPE_BIONZ_MACHINE,
+        .parent        = TYPE_MACHINE,
+        .instance_size = sizeof(BionzMachineState),
+        .instance_init = cxd_machine_instance_init,
+        .instance_finalize = cxd_machine_instance_finalize,
+        .class_init    = cxd_machine_class_init,
+        .abstract      = true,
+    }, {
+        .name          = MACHINE_TYPE_NAME("cxd4108"),
+        .parent        = TYPE_BIONZ_MACHINE,
+        .class_init    = cxd4108_machine_class_init,
+    }, {
+        .name          = MACHINE_TYPE_NAME("cxd4115"),
+        .parent        = TYPE_BIONZ_MACHINE,
+        .class_init    = cxd4115_machine_class_init,
+    }, {
+        .name          = MACHINE_TYPE_NAME("cxd4132"),
+        .parent        = TYPE_BIONZ_MACHINE,
+        .class_init    = cxd4132_machine_class_init,
+    }, {
+        .name          = MACHINE_TYPE_NAME("cxd90014"),
+        .parent        = TYPE_BIONZ_MACHINE,
+        .class_init    = cxd90014_machine_class_init,
+    }, {
+        .name          = MACHINE_TYPE_NAME("cxd90045"),
+        .parent        = TYPE_BIONZ_MACHINE,
+        .class_init    = cxd90045_machine_class_init,
+    }
+};
+
+DEFINE_TYPES(cxd_machine_types)
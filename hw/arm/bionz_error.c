@@ -0,0 +1,34 @@
+/* Error reporting for the Sony BIONZ peripherals */
+
+#include "qemu/osdep.h"
+#include "hw/arm/bionz.h"
+#include "hw/arm/bionz_error.h"
+#include "qapi/qapi-events-misc-target.h"
+#include "qemu/log.h"
+#include "qom/object.h"
+#include "sysemu/runstate.h"
+
+void bionz_error(Object *dev, const char *fmt, ...)
+{
+    Object *machine = object_dynamic_cast(qdev_get_machine(), TYPE_BIONZ_MACHINE);
+    bool stop = machine && BIONZ_MACHINE(machine)->stop_on_device_error;
+    va_list ap;
+    char *msg, *path;
+
+    va_start(ap, fmt);
+    msg = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+    path = object_get_canonical_path(dev);
+
+    qemu_log_mask(LOG_GUEST_ERROR, "%s: %s\n", path, msg);
+    qapi_event_send_bionz_device_error(path, object_get_typename(dev), msg, stop);
+
+    // Safe from vcpu context, the main loop stops the VM
+    if (stop) {
+        qemu_system_vmstop_request_prepare();
+        qemu_system_vmstop_request(RUN_STATE_PAUSED);
+    }
+
+    g_free(path);
+    g_free(msg);
+}
@@ -0,0 +1,39 @@
+/* Activity counters of the Sony BIONZ peripherals */
+
+#include "qemu/osdep.h"
+#include "hw/arm/bionz_stats.h"
+#include "qapi/qapi-commands-misc-target.h"
+#include "qom/object.h"
+
+static QTAILQ_HEAD(, BionzStats) bionz_stats = QTAILQ_HEAD_INITIALIZER(bionz_stats);
+
+void bionz_stats_register(BionzStats *st, Object *owner)
+{
+    st->owner = owner;
+    st->commands = 0;
+    st->bytes = 0;
+    st->time_ns = 0;
+    QTAILQ_INSERT_TAIL(&bionz_stats, st, next);
+}
+
+BionzDeviceStatsList *qmp_query_bionz_stats(Error **errp)
+{
+    BionzDeviceStatsList *head = NULL, **tail = &head;
+    BionzStats *st;
+
+    QTAILQ_FOREACH(st, &bionz_stats, next) {
+        BionzDeviceStatsList *item = g_new0(BionzDeviceStatsList, 1);
+
+        item->value = g_new0(BionzDeviceStats, 1);
+        item->value->path = object_get_canonical_path(st->owner);
+        item->value->type = g_strdup(object_get_typename(st->owner));
+        item->value->commands = st->commands;
+        item->value->bytes = st->bytes;
+        item->value->time_ns = st->time_ns;
+
+        *tail = item;
+        tail = &item->next;
+    }
+
+    return head;
+}
@@ -2,15 +2,24 @@
 
 #include "qemu/osdep.h"
 #include "audio/audio.h"
+#include "hw/arm/bionz_stats.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
 #include "qemu/log.h"
 #include "sysemu/sysemu.h"
+#include "trace.h"
 #include <mad.h>
 #include "sf_table.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #define DELAY_MS 100
 
 #define SAMPLE_RATE 32000
@@ -22,6 +31,9 @@
 #define SAMPLES_PER_FRAME (NUM_GR * NUM_SF * NUM_SB)
 #define BYTES_PER_FRAME (NUM_SF * NUM_SB + SAMPLES_PER_FRAME)
 
+// Frames decoded per batch at most, a batch never holds more than the backend accepts
+#define RING_FRAMES 8
+
 #define TYPE_BIONZ_AUDIO "bionz_audio"
 #define BIONZ_AUDIO(obj) OBJECT_CHECK(AudioState, (obj), TYPE_BIONZ_AUDIO)
 
@@ -45,6 +57,15 @@ typedef struct AudioState {
     uint32_t reg_ch_curr;
     uint32_t reg_ch_addr;
     uint32_t reg_ch_size;
+
+    // Decoded samples not yet taken by the backend, the guest position is already past them
+    int16_t ring[RING_FRAMES * SAMPLES_PER_FRAME];
+    uint32_t ring_pos;
+    uint32_t ring_len;
+    uint8_t input[RING_FRAMES * BYTES_PER_FRAME];
+    bool silent;
+
+    BionzStats stats;
 } AudioState;
 
 static void audio_update_irq(AudioState *s)
@@ -74,11 +95,33 @@ static void frame_read(void *data, struct mad_frame *frame)
 
 static void frame_write_samples(struct mad_pcm *pcm, int16_t *samples)
 {
-    unsigned int i;
+    unsigned int i = 0;
     mad_fixed_t sample;
 
     assert(pcm->length == SAMPLES_PER_FRAME);
-    for (i = 0; i < SAMPLES_PER_FRAME; i++) {
+
+    // Round and shift to 16 bits, the saturating narrow does the clamp of the scalar loop below
+#if defined(__SSE2__)
+    QEMU_BUILD_BUG_ON(sizeof(mad_fixed_t) != 4);
+    for (; i + 8 <= SAMPLES_PER_FRAME; i += 8) {
+        const __m128i round = _mm_set1_epi32(1L << (MAD_F_FRACBITS - 16));
+        __m128i lo = _mm_loadu_si128((const __m128i *) &pcm->samples[0][i]);
+        __m128i hi = _mm_loadu_si128((const __m128i *) &pcm->samples[0][i + 4]);
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, round), MAD_F_FRACBITS + 1 - 16);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, round), MAD_F_FRACBITS + 1 - 16);
+        _mm_storeu_si128((__m128i *) &samples[i], _mm_packs_epi32(lo, hi));
+    }
+#elif defined(__ARM_NEON)
+    QEMU_BUILD_BUG_ON(sizeof(mad_fixed_t) != 4);
+    for (; i + 8 <= SAMPLES_PER_FRAME; i += 8) {
+        const int32x4_t round = vdupq_n_s32(1L << (MAD_F_FRACBITS - 16));
+        int32x4_t lo = vaddq_s32(vld1q_s32((const int32_t *) &pcm->samples[0][i]), round);
+        int32x4_t hi = vaddq_s32(vld1q_s32((const int32_t *) &pcm->samples[0][i + 4]), round);
+        vst1q_s16(&samples[i], vcombine_s16(vqshrn_n_s32(lo, MAD_F_FRACBITS + 1 - 16), vqshrn_n_s32(hi, MAD_F_FRACBITS + 1 - 16)));
+    }
+#endif
+
+    for (; i < SAMPLES_PER_FRAME; i++) {
         sample = pcm->samples[0][i];
         sample += (1L << (MAD_F_FRACBITS - 16));
         if (sample >= MAD_F_ONE) {
@@ -97,43 +140,96 @@ static void frame_decode(AudioState *s, void *data, int16_t *samples)
     frame_write_samples(&s->synth.pcm, samples);
 }
 
-static void frame_decode_next(AudioState *s, int16_t *samples)
+/* Moves the guest position past one frame, returns true at the end of the buffer */
+static bool frame_advance(AudioState *s)
 {
-    uint8_t buffer[BYTES_PER_FRAME];
+    s->reg_ch_curr += BYTES_PER_FRAME;
+    if (s->reg_ch_curr < s->reg_ch_addr + s->reg_ch_size) {
+        return false;
+    }
 
-    cpu_physical_memory_read(s->mem_base + s->reg_ch_curr, buffer, BYTES_PER_FRAME);
-    frame_decode(s, buffer, samples);
+    trace_bionz_audio_buffer_end(s->reg_ch_addr, s->reg_ch_size, !(s->reg_ch_stat & 1));
+    s->reg_ch_curr = s->reg_ch_addr;
+    if (!(s->reg_ch_stat & 1)) {
+        s->reg_intsts |= 1;
+        audio_update_irq(s);
+    }
+    return true;
+}
 
-    s->reg_ch_curr += BYTES_PER_FRAME;
-    if (s->reg_ch_curr >= s->reg_ch_addr + s->reg_ch_size) {
-        s->reg_ch_curr = s->reg_ch_addr;
-        if (!(s->reg_ch_stat & 1)) {
-            s->reg_intsts |= 1;
-            audio_update_irq(s);
+/* Decodes up to frames frames into the empty ring, returns true if the batch ended the buffer */
+static bool frame_decode_batch(AudioState *s, unsigned int frames)
+{
+    uint32_t end = s->reg_ch_addr + s->reg_ch_size;
+    bool silent = AUD_is_silent_out(s->voice);
+    bool wrapped = false;
+    unsigned int i;
+    int64_t start = bionz_stats_start();
+
+    // The guest may switch buffers in the interrupt handler, a batch never continues past the end
+    frames = s->reg_ch_curr < end ? MIN(frames, DIV_ROUND_UP(end - s->reg_ch_curr, BYTES_PER_FRAME)) : 1;
+    trace_bionz_audio_frames(s->reg_ch_curr, frames, silent);
+
+    if (silent) {
+        // Nothing can be heard, keep the timing and interrupts but skip reading and synthesis
+        memset(s->ring, 0, frames * SAMPLES_PER_FRAME * sizeof(int16_t));
+    } else {
+        if (s->silent) {
+            // The filter bank still holds the frames before the skipped ones
+            mad_synth_mute(&s->synth);
+        }
+        cpu_physical_memory_read(s->mem_base + s->reg_ch_curr, s->input, frames * BYTES_PER_FRAME);
+    }
+
+    for (i = 0; i < frames; i++) {
+        if (!silent) {
+            frame_decode(s, s->input + i * BYTES_PER_FRAME, s->ring + i * SAMPLES_PER_FRAME);
         }
+        wrapped = frame_advance(s);
     }
+
+    s->silent = silent;
+    s->ring_pos = 0;
+    s->ring_len = frames * SAMPLES_PER_FRAME;
+    bionz_stats_add(&s->stats, frames, start, silent ? 0 : frames * BYTES_PER_FRAME);
+    return wrapped;
 }
 
 static void audio_callback(void *opaque, int free)
 {
     AudioState *s = BIONZ_AUDIO(opaque);
-    int16_t samples[SAMPLES_PER_FRAME];
+    unsigned int frames;
+    size_t n;
+    bool wrapped = false;
 
     if (!(s->reg_ctrl & 1)) {
         s->reg_intsts &= ~1;
         s->reg_ch_stat = 0;
         s->reg_ch_curr = 0;
+        s->ring_len = 0;
         AUD_set_active_out(s->voice, 0);
         audio_update_irq(s);
         return;
     }
 
-    if (free < sizeof(samples)) {
-        return;
-    }
+    // Hand over what is left of the last batch first, then decode as many frames as fit
+    while (free > 0) {
+        if (!s->ring_len) {
+            frames = MIN(free / (SAMPLES_PER_FRAME * sizeof(int16_t)), RING_FRAMES);
+            if (!frames || wrapped) {
+                break;
+            }
+            wrapped = frame_decode_batch(s, frames);
+        }
 
-    frame_decode_next(s, samples);
-    AUD_write(s->voice, samples, sizeof(samples));
+        n = AUD_write(s->voice, s->ring + s->ring_pos, MIN(s->ring_len * sizeof(int16_t), free));
+        if (!n) {
+            break;
+        }
+        s->ring_pos += n / sizeof(int16_t);
+        s->ring_len -= n / sizeof(int16_t);
+        free -= n;
+    }
 }
 
 static void audio_start(void *opaque)
@@ -141,6 +237,8 @@ static void audio_start(void *opaque)
     AudioState *s = BIONZ_AUDIO(opaque);
 
     mad_synth_init(&s->synth);
+    s->ring_len = 0;
+    s->silent = false;
     AUD_set_active_out(s->voice, 1);
 }
 
@@ -273,6 +371,7 @@ static void audio_reset(DeviceState *dev)
     s->reg_ch_curr = 0;
     s->reg_ch_addr = 0;
     s->reg_ch_size = 0;
+    s->ring_len = 0;
 }
 
 static void audio_realize(DeviceState *dev, Error **errp)
@@ -302,6 +401,8 @@ static void audio_realize(DeviceState *dev, Error **errp)
     sysbus_init_mmio(sbd, &s->mmio[1]);
 
     sysbus_init_irq(SYS_BUS_DEVICE(dev), &s->irq);
+
+    bionz_stats_register(&s->stats, OBJECT(dev));
 }
 
 static Property audio_properties[] = {
@@ -310,11 +411,43 @@ static Property audio_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static int audio_post_load(void *opaque, int version_id)
+{
+    AudioState *s = BIONZ_AUDIO(opaque);
+
+    // The synthesis filter bank is not migrated, restart playback with a clean one
+    if ((s->reg_ctrl & 1) && !timer_pending(s->timer)) {
+        audio_start(s);
+    }
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_audio = {
+    .name = TYPE_BIONZ_AUDIO,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = audio_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_TIMER_PTR(timer, AudioState),
+        VMSTATE_UINT16(reg_ctrl, AudioState),
+        VMSTATE_UINT32(reg_intsts, AudioState),
+        VMSTATE_UINT32(reg_inten, AudioState),
+        VMSTATE_UINT32(reg_ch_conf, AudioState),
+        VMSTATE_UINT32(reg_ch_stat, AudioState),
+        VMSTATE_UINT32(reg_ch_curr, AudioState),
+        VMSTATE_UINT32(reg_ch_addr, AudioState),
+        VMSTATE_UINT32(reg_ch_size, AudioState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void audio_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = audio_realize;
     dc->reset = audio_reset;
+    dc->vmsd = &vmstate_audio;
     device_class_set_props(dc, audio_properties);
 }
 
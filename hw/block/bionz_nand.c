@@ -1,16 +1,25 @@
 /* QEMU model of the Sony BIONZ nand controller (similar to denali flash controller, but with a custom dma interface) */
 
 #include "qemu/osdep.h"
+#include "exec/address-spaces.h"
+#include "hw/arm/bionz_error.h"
+#include "hw/arm/bionz_stats.h"
 #include "hw/hw.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
 #include "qemu/log.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/cpus.h"
+#include "sysemu/dma.h"
+#include "sysemu/runstate.h"
+#include "trace.h"
 
 #define NAND_PAGE_SIZE 0x1000
 #define NAND_SPARE_SIZE 8
+#define NAND_PAGES_PER_BLOCK 64
 
 #define COMMAND_IRQ_DELAY 100000
 
@@ -29,10 +38,16 @@
 #define DATA_CTRL 0x00
 #define DATA_DATA 0x10
 
+#define INTR_ECC_UNCOR_ERR (1 << 0)
+#define INTR_PROGRAM_FAIL  (1 << 4)
+#define INTR_ERASE_FAIL    (1 << 5)
 #define INTR_LOAD_COMP  (1 << 6)
 #define INTR_ERASE_COMP (1 << 8)
 #define INTR_RST_COMP   (1 << 13)
 
+#define DMA_RESULT_OK 0x8000
+#define DMA_RESULT_ERROR 0
+
 #define TYPE_BIONZ_NAND "bionz_nand"
 #define BIONZ_NAND(obj) OBJECT_CHECK(NandState, (obj), TYPE_BIONZ_NAND)
 
@@ -50,6 +65,12 @@ typedef struct NandDmaArgs {
     uint32_t unknown5[1];
 } NandDmaArgs;
 
+typedef enum NandDmaStage {
+    NAND_DMA_IDLE,
+    NAND_DMA_MAIN,
+    NAND_DMA_SPARE,
+} NandDmaStage;
+
 typedef struct NandState {
     SysBusDevice parent_obj;
     MemoryRegion reg_mmio;
@@ -76,7 +97,31 @@ typedef struct NandState {
     uint32_t reg_dma_intr_en;
 
     uint32_t dma_args[3];
-    unsigned int dma_arg_count;
+    uint32_t dma_arg_count;
+
+    uint32_t dma_stage;
+    bool dma_write;
+    uint32_t dma_cmd_addr;
+    uint32_t dma_main_buffer;
+    uint64_t dma_main_offset;
+    uint32_t dma_main_len;
+    uint32_t dma_spare_buffer;
+    uint64_t dma_spare_offset;
+    uint32_t dma_spare_len;
+
+    QEMUSGList dma_sg;
+    BlockAIOCB *dma_aiocb;
+
+    bool erase_busy;
+    BlockAIOCB *erase_aiocb;
+    QEMUIOVector erase_qiov;
+    void *erase_buf;
+    uint64_t erase_spare_offset;
+    uint32_t erase_spare_len;
+    VMChangeStateEntry *vmstate_change;
+
+    BionzStats stats;
+    int64_t dma_start;
 } NandState;
 
 static void nand_update_irq(NandState *s)
@@ -89,6 +134,12 @@ static void nand_update_irq_delayed(void *opaque)
     nand_update_irq(BIONZ_NAND(opaque));
 }
 
+// Command completions are signalled after a delay, the firmware does not expect them while it is still issuing the command
+static void nand_update_irq_command(NandState *s)
+{
+    timer_mod(s->update_irq_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + COMMAND_IRQ_DELAY);
+}
+
 static uint64_t nand_reg_read(void *opaque, hwaddr offset, unsigned size)
 {
     NandState *s = BIONZ_NAND(opaque);
@@ -203,70 +254,232 @@ static const struct MemoryRegionOps nand_reg_ops = {
     .valid.max_access_size = 4,
 };
 
+static void nand_dma_run(NandState *s);
+
+static void nand_dma_complete(NandState *s, uint32_t result)
+{
+    uint32_t bytes = result == DMA_RESULT_OK ? s->dma_main_len + s->dma_spare_len : 0;
+
+    s->dma_stage = NAND_DMA_IDLE;
+    cpu_physical_memory_write(s->dma_cmd_addr + offsetof(NandDmaArgs, result), &result, sizeof(result));
+
+    trace_bionz_nand_dma_complete(s->dma_write, bytes);
+    bionz_stats_end(&s->stats, s->dma_start, bytes);
+
+    s->reg_dma_intr |= (1 << 1);
+    nand_update_irq(s);
+}
+
+// Completes a command that cannot be executed with an error result and the matching failure interrupt
+static void nand_dma_fail(NandState *s)
+{
+    s->reg_intr_status0 |= s->dma_write ? INTR_PROGRAM_FAIL : INTR_ECC_UNCOR_ERR;
+    nand_dma_complete(s, DMA_RESULT_ERROR);
+}
+
+static void nand_dma_cb(void *opaque, int ret)
+{
+    NandState *s = BIONZ_NAND(opaque);
+
+    s->dma_aiocb = NULL;
+    qemu_sglist_destroy(&s->dma_sg);
+    qemu_device_work_end();
+
+    if (s->dma_stage == NAND_DMA_IDLE) {// cancelled
+        return;
+    }
+
+    if (ret < 0) {
+        bionz_error(OBJECT(s), "Cannot %s block device: %s", s->dma_write ? "write" : "read", strerror(-ret));
+        nand_dma_fail(s);
+        return;
+    }
+
+    if (s->dma_stage == NAND_DMA_MAIN) {
+        s->dma_stage = NAND_DMA_SPARE;
+        nand_dma_run(s);
+        return;
+    }
+
+    nand_dma_complete(s, DMA_RESULT_OK);
+}
+
+static void nand_dma_run(NandState *s)
+{
+    bool is_main = s->dma_stage == NAND_DMA_MAIN;
+    uint64_t offset = is_main ? s->dma_main_offset : s->dma_spare_offset;
+
+    if (!s->blk || (s->dma_write && blk_is_read_only(s->blk))) {
+        // Without a writable drive the data is dropped and the command succeeds
+        nand_dma_complete(s, DMA_RESULT_OK);
+        return;
+    }
+
+    qemu_sglist_init(&s->dma_sg, DEVICE(s), 1, &address_space_memory);
+    qemu_sglist_add(&s->dma_sg, is_main ? s->dma_main_buffer : s->dma_spare_buffer, is_main ? s->dma_main_len : s->dma_spare_len);
+
+    qemu_device_work_begin();
+    if (s->dma_write) {
+        s->dma_aiocb = dma_blk_write(s->blk, &s->dma_sg, offset, 1, nand_dma_cb, s);
+    } else {
+        s->dma_aiocb = dma_blk_read(s->blk, &s->dma_sg, offset, 1, nand_dma_cb, s);
+    }
+}
+
 static void nand_dma_command(NandState *s)
 {
     NandDmaArgs args;
-    uint32_t main_offset, main_len, spare_offset, spare_len;
-    void *buffer;
+    uint32_t mode;
+
+    if (s->dma_stage != NAND_DMA_IDLE) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: DMA command while busy\n", __func__);
+        return;
+    }
+
+    s->dma_cmd_addr = s->dma_args[1];
+    s->dma_write = false;
+    s->dma_main_len = 0;
+    s->dma_spare_len = 0;
+    s->dma_start = bionz_stats_start();
 
     if (s->dma_args[0] != 0x80 || s->dma_args[2] != 0) {
-        hw_error("%s: Invalid arguments: 0x%x, 0x%x, 0x%x\n", __func__, s->dma_args[0], s->dma_args[1], s->dma_args[2]);
+        bionz_error(OBJECT(s), "Invalid arguments: 0x%x, 0x%x, 0x%x", s->dma_args[0], s->dma_args[1], s->dma_args[2]);
+        nand_dma_fail(s);
+        return;
     }
 
     cpu_physical_memory_read(s->dma_args[1], &args, sizeof(args));
 
     if (((args.command >> 26) & 3) != 0b10) {// MAP10
-        hw_error("%s: Invalid command: 0x%x\n", __func__, args.command);
+        bionz_error(OBJECT(s), "Invalid command: 0x%x", args.command);
+        nand_dma_fail(s);
+        return;
     }
 
     switch ((args.data >> 8) & 0xff) {
         case 0x20:// read
-            main_offset = (args.command & 0xffffff) * NAND_PAGE_SIZE;
-            spare_offset = s->size + (args.command & 0xffffff) * NAND_SPARE_SIZE;
-
-            switch (args.data >> 16) {
-                case 0x3140:// 0x1000 byte pages
-                    main_len = (args.data & 0xff) * NAND_PAGE_SIZE;
-                    spare_len = (args.data & 0xff) * NAND_SPARE_SIZE;
-                    break;
+            s->dma_write = false;
+            break;
 
-                case 0x5140:// 0x200 byte sectors
-                    main_offset += NAND_PAGE_SIZE / 8 * ((args.data >> 4) & 7);
-                    main_len = NAND_PAGE_SIZE / 8 * (args.data & 7);
-                    spare_len = NAND_SPARE_SIZE;
-                    break;
+        case 0x21:// write
+            s->dma_write = true;
+            break;
 
-                default:
-                    hw_error("%s: Invalid read mode: 0x%x\n", __func__, args.data >> 16);
-            }
+        default:
+            bionz_error(OBJECT(s), "Invalid data: 0x%x", args.data);
+            nand_dma_fail(s);
+            return;
+    }
 
-            buffer = g_malloc(main_len);
-            if (s->blk && blk_pread(s->blk, main_offset, buffer, main_len) < 0) {
-                hw_error("%s: Cannot read block device\n", __func__);
-            }
-            cpu_physical_memory_write(args.main_buffer, buffer, main_len);
-            g_free(buffer);
+    s->dma_main_offset = (uint64_t) (args.command & 0xffffff) * NAND_PAGE_SIZE;
+    s->dma_spare_offset = s->size + (uint64_t) (args.command & 0xffffff) * NAND_SPARE_SIZE;
 
-            buffer = g_malloc(spare_len);
-            if (s->blk && blk_pread(s->blk, spare_offset, buffer, spare_len) < 0) {
-                hw_error("%s: Cannot read block device\n", __func__);
-            }
-            cpu_physical_memory_write(args.spare_buffer, buffer, spare_len);
-            g_free(buffer);
+    mode = args.data >> 16;
+    switch (mode) {
+        case 0x3140:// 0x1000 byte pages
+            s->dma_main_len = (args.data & 0xff) * NAND_PAGE_SIZE;
+            s->dma_spare_len = (args.data & 0xff) * NAND_SPARE_SIZE;
             break;
 
-        case 0x21:// write
+        case 0x5140:// 0x200 byte sectors
+            s->dma_main_offset += NAND_PAGE_SIZE / 8 * ((args.data >> 4) & 7);
+            s->dma_main_len = NAND_PAGE_SIZE / 8 * (args.data & 7);
+            s->dma_spare_len = NAND_SPARE_SIZE;
             break;
 
         default:
-            hw_error("%s: Invalid data: 0x%x\n", __func__, args.data);
+            bionz_error(OBJECT(s), "Invalid %s mode: 0x%x", s->dma_write ? "write" : "read", mode);
+            nand_dma_fail(s);
+            return;
     }
 
-    args.result = 0x8000;
-    cpu_physical_memory_write(s->dma_args[1], &args, sizeof(args));
+    s->dma_main_buffer = args.main_buffer;
+    s->dma_spare_buffer = args.spare_buffer;
 
-    s->reg_dma_intr |= (1 << 1);
-    nand_update_irq(s);
+    trace_bionz_nand_dma_command(s->dma_write, s->dma_main_offset, s->dma_main_len, s->dma_spare_len);
+
+    s->dma_stage = NAND_DMA_MAIN;
+    nand_dma_run(s);
+}
+
+static void nand_dma_restart(void *opaque, int running, RunState state)
+{
+    NandState *s = BIONZ_NAND(opaque);
+
+    // Requests are not migrated, restart the current stage on the destination
+    if (running && s->dma_stage != NAND_DMA_IDLE && !s->dma_aiocb) {
+        s->dma_start = bionz_stats_start();
+        nand_dma_run(s);
+    }
+}
+
+static void nand_erase_cb(void *opaque, int ret)
+{
+    NandState *s = BIONZ_NAND(opaque);
+    uint32_t len = s->erase_spare_len;
+
+    s->erase_aiocb = NULL;
+    qemu_device_work_end();
+
+    if (!s->erase_busy) {// cancelled
+        goto done;
+    }
+
+    if (ret >= 0 && len) {
+        // The main area is erased, continue with the spare area of the same pages
+        s->erase_spare_len = 0;
+        qemu_iovec_init_buf(&s->erase_qiov, s->erase_buf, len);
+        qemu_device_work_begin();
+        s->erase_aiocb = blk_aio_pwritev(s->blk, s->erase_spare_offset, &s->erase_qiov, 0, nand_erase_cb, s);
+        return;
+    }
+
+    s->erase_busy = false;
+    if (ret < 0) {
+        bionz_error(OBJECT(s), "Cannot erase block device: %s", strerror(-ret));
+        s->reg_intr_status0 |= INTR_ERASE_FAIL;
+    } else {
+        s->reg_intr_status0 |= INTR_ERASE_COMP;
+    }
+    nand_update_irq_command(s);
+
+done:
+    qemu_vfree(s->erase_buf);
+    s->erase_buf = NULL;
+}
+
+// Erases the block that contains the page by programming it with 0xff, which an overlay image stores without copying the base
+static void nand_erase(NandState *s, uint32_t page)
+{
+    uint32_t pages = s->reg_pages_per_block ? s->reg_pages_per_block : NAND_PAGES_PER_BLOCK;
+    uint32_t len = pages * NAND_PAGE_SIZE;
+
+    page -= page % pages;
+    trace_bionz_nand_erase(page, pages);
+
+    if (!s->blk || blk_is_read_only(s->blk)) {
+        // Without a writable drive the block is left as it is and the erase succeeds
+        s->reg_intr_status0 |= INTR_ERASE_COMP;
+        nand_update_irq_command(s);
+        return;
+    }
+
+    if (s->erase_busy || (uint64_t) (page + pages) * NAND_PAGE_SIZE > s->size) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: cannot erase page 0x%x\n", __func__, page);
+        s->reg_intr_status0 |= INTR_ERASE_FAIL;
+        nand_update_irq_command(s);
+        return;
+    }
+
+    s->erase_buf = blk_blockalign(s->blk, len);
+    memset(s->erase_buf, 0xff, len);
+    s->erase_spare_offset = s->size + (uint64_t) page * NAND_SPARE_SIZE;
+    s->erase_spare_len = pages * NAND_SPARE_SIZE;
+    s->erase_busy = true;
+
+    qemu_iovec_init_buf(&s->erase_qiov, s->erase_buf, len);
+    qemu_device_work_begin();
+    s->erase_aiocb = blk_aio_pwritev(s->blk, (uint64_t) page * NAND_PAGE_SIZE, &s->erase_qiov, 0, nand_erase_cb, s);
 }
 
 static uint64_t nand_data_read(void *opaque, hwaddr offset, unsigned size)
@@ -279,7 +492,10 @@ static uint64_t nand_data_read(void *opaque, hwaddr offset, unsigned size)
             switch ((s->ctrl >> 26) & 3) {
                 case 0b01:// MAP01
                     if (s->blk && blk_pread(s->blk, s->offset, &value, size) < 0) {
-                        hw_error("%s: Cannot read block device\n", __func__);
+                        bionz_error(OBJECT(s), "Cannot read block device");
+                        s->reg_intr_status0 |= INTR_ECC_UNCOR_ERR;
+                        nand_update_irq(s);
+                        value = 0;
                     }
                     s->offset += size;
                     return value;
@@ -317,13 +533,14 @@ static void nand_data_write(void *opaque, hwaddr offset, uint64_t value, unsigne
                 switch ((s->ctrl >> 26) & 3) {
                     case 0b10:// MAP10
                         if (value == 1) {// erase
-                            s->reg_intr_status0 |= INTR_ERASE_COMP;
+                            nand_erase(s, s->ctrl & 0xffffff);
+                            return;
                         } else if ((value >> 8) == 0x20) {// pipeline read-ahead
                             s->reg_intr_status0 |= INTR_LOAD_COMP;
                         } else {
                             break;
                         }
-                        timer_mod(s->update_irq_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + COMMAND_IRQ_DELAY);
+                        nand_update_irq_command(s);
                         return;
                 }
             }
@@ -366,6 +583,18 @@ static void nand_reset(DeviceState *dev)
     }
     s->dma_arg_count = 0;
 
+    if (s->dma_aiocb) {
+        s->dma_stage = NAND_DMA_IDLE;
+        blk_aio_cancel(s->dma_aiocb);
+    }
+    s->dma_stage = NAND_DMA_IDLE;
+
+    if (s->erase_aiocb) {
+        s->erase_busy = false;
+        blk_aio_cancel(s->erase_aiocb);
+    }
+    s->erase_busy = false;
+
     timer_del(s->update_irq_timer);
 }
 
@@ -375,6 +604,13 @@ static void nand_realize(DeviceState *dev, Error **errp)
     SysBusDevice *sbd = SYS_BUS_DEVICE(dev);
     NandState *s = BIONZ_NAND(dev);
 
+    if (s->blk) {
+        uint64_t perm = BLK_PERM_CONSISTENT_READ | (blk_is_read_only(s->blk) ? 0 : BLK_PERM_WRITE);
+        if (blk_set_perm(s->blk, perm, BLK_PERM_ALL, errp) < 0) {
+            return;
+        }
+    }
+
     if (!s->size && s->blk) {
         length = blk_getlength(s->blk);
         s->size = (length / (NAND_PAGE_SIZE + NAND_SPARE_SIZE)) * NAND_PAGE_SIZE;
@@ -393,6 +629,9 @@ static void nand_realize(DeviceState *dev, Error **errp)
     sysbus_init_irq(sbd, &s->intr);
 
     s->update_irq_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nand_update_irq_delayed, s);
+    s->vmstate_change = qemu_add_vm_change_state_handler(nand_dma_restart, s);
+
+    bionz_stats_register(&s->stats, OBJECT(dev));
 }
 
 static Property nand_properties[] = {
@@ -401,11 +640,46 @@ static Property nand_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_nand = {
+    .name = TYPE_BIONZ_NAND,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ctrl, NandState),
+        VMSTATE_UINT32(offset, NandState),
+        VMSTATE_UINT32(reg_global_int_enable, NandState),
+        VMSTATE_UINT32(reg_number_of_planes, NandState),
+        VMSTATE_UINT32(reg_pages_per_block, NandState),
+        VMSTATE_UINT32(reg_main_area_size, NandState),
+        VMSTATE_UINT32(reg_spare_area_size, NandState),
+        VMSTATE_UINT32(reg_first_block_of_next_pane, NandState),
+        VMSTATE_UINT32(reg_intr_status0, NandState),
+        VMSTATE_UINT32(reg_intr_en0, NandState),
+        VMSTATE_UINT32(reg_dma_enable, NandState),
+        VMSTATE_UINT32(reg_dma_intr, NandState),
+        VMSTATE_UINT32(reg_dma_intr_en, NandState),
+        VMSTATE_UINT32_ARRAY(dma_args, NandState, 3),
+        VMSTATE_UINT32(dma_arg_count, NandState),
+        VMSTATE_UINT32(dma_stage, NandState),
+        VMSTATE_BOOL(dma_write, NandState),
+        VMSTATE_UINT32(dma_cmd_addr, NandState),
+        VMSTATE_UINT32(dma_main_buffer, NandState),
+        VMSTATE_UINT64(dma_main_offset, NandState),
+        VMSTATE_UINT32(dma_main_len, NandState),
+        VMSTATE_UINT32(dma_spare_buffer, NandState),
+        VMSTATE_UINT64(dma_spare_offset, NandState),
+        VMSTATE_UINT32(dma_spare_len, NandState),
+        VMSTATE_TIMER_PTR(update_irq_timer, NandState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void nand_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = nand_realize;
     dc->reset = nand_reset;
+    dc->vmsd = &vmstate_nand;
     device_class_set_props(dc, nand_properties);
 }
 
@@ -2,11 +2,21 @@
 
 #include "qemu/osdep.h"
 #include "ui/console.h"
+#include "hw/arm/bionz_error.h"
+#include "hw/arm/bionz_stats.h"
 #include "hw/hw.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
+#include "trace.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define NUM_CHANNELS 3
 #define NUM_LAYERS 2
@@ -47,13 +57,16 @@ typedef struct VipState {
     SysBusDevice parent_obj;
     MemoryRegion mmio[2];
     qemu_irq irqs[2];
+    qemu_irq vsync_irq_enabled;
     QemuConsole *con;
 
     MemoryRegion *memory;
+    bool skip_vsync;
 
     VipChannel channels[NUM_CHANNELS];
     VipLayer layers[NUM_LAYERS];
     uint32_t background;
+    bool invalidate;
 
     uint32_t reg_ch_intsts;
     uint32_t reg_ch_inten;
@@ -62,83 +75,185 @@ typedef struct VipState {
     uint32_t reg_ctrl_intsts;
     uint32_t reg_ctrl_en;
     uint32_t reg_bg;
+
+    BionzStats stats;
 } VipState;
 
+/* Per channel YCbCr contributions, offsets into vip_clamp */
+static int16_t vip_cr_r[256];
+static int16_t vip_cb_b[256];
+static int32_t vip_cb_g[256];
+static int32_t vip_cr_g[256];
+static uint8_t vip_clamp[0x300];
+
+/* RGBA4444 expanded to ARGB8888, one table for each byte of the pixel */
+static uint32_t vip_4444_lo[256];
+static uint32_t vip_4444_hi[256];
+
+static void vip_init_tables(void)
+{
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        vip_cr_r[i] = (91881 * (i - 0x80) + 0x8000) >> 16;
+        vip_cb_b[i] = (116130 * (i - 0x80) + 0x8000) >> 16;
+        vip_cb_g[i] = 22554 * (i - 0x80);
+        vip_cr_g[i] = 46802 * (i - 0x80) + 0x8000;
+
+        vip_4444_lo[i] = ((uint32_t) (i & 0xf) * 0x11 << 24) | ((i >> 4) * 0x11);
+        vip_4444_hi[i] = ((i >> 4) * 0x11 << 16) | ((i & 0xf) * 0x11 << 8);
+    }
+
+    for (i = 0; i < 0x300; i++) {
+        vip_clamp[i] = MIN(MAX(i - 0x100, 0), 0xff);
+    }
+}
+
+static inline uint32_t vip_ycbcr(int y, int dr, int dg, int db)
+{
+    return (0xffu << 24) | (vip_clamp[0x100 + y + dr] << 16) | (vip_clamp[0x100 + y - dg] << 8) | vip_clamp[0x100 + y + db];
+}
+
 static uint32_t ycbcr_to_argb8888(uint8_t y, uint8_t cb, uint8_t cr)
 {
-    uint8_t r = MIN(MAX(y + ((                       91881 * (cr - 0x80) + 0x8000) >> 16), 0), 0xff);
-    uint8_t g = MIN(MAX(y - (( 22554 * (cb - 0x80) + 46802 * (cr - 0x80) + 0x8000) >> 16), 0), 0xff);
-    uint8_t b = MIN(MAX(y + ((116130 * (cb - 0x80)                       + 0x8000) >> 16), 0), 0xff);
-    return (0xff << 24) | (r << 16) | (g << 8) | b;
+    return vip_ycbcr(y, vip_cr_r[cr], (vip_cb_g[cb] + vip_cr_g[cr]) >> 16, vip_cb_b[cb]);
 }
 
-static uint32_t ycbcr422_to_argb8888(uint32_t pix, bool off)
+/* Convert one row of pixel pairs laid out as Cb Y0 Cr Y1, downsize only keeps Y0 */
+static void vip_convert_ycbcr422(uint32_t *dst, const uint8_t *src, bool downsize)
 {
-    uint8_t y1 = (pix >> 24) & 0xff;
-    uint8_t cr = (pix >> 16) & 0xff;
-    uint8_t y0 = (pix >>  8) & 0xff;
-    uint8_t cb =  pix        & 0xff;
-    return ycbcr_to_argb8888(off ? y1 : y0, cb, cr);
+    unsigned int x;
+    int dr, dg, db;
+
+    for (x = 0; x < WIDTH; src += 4) {
+        dr = vip_cr_r[src[2]];
+        dg = (vip_cb_g[src[0]] + vip_cr_g[src[2]]) >> 16;
+        db = vip_cb_b[src[0]];
+        dst[x++] = vip_ycbcr(src[1], dr, dg, db);
+        if (!downsize) {
+            dst[x++] = vip_ycbcr(src[3], dr, dg, db);
+        }
+    }
 }
 
-static uint32_t rgba4444_to_argb8888(uint16_t pix)
+static void vip_convert_rgba4444(uint32_t *dst, const uint8_t *src)
 {
-    uint8_t r = (pix >> 12) & 0xf;
-    uint8_t g = (pix >>  8) & 0xf;
-    uint8_t b = (pix >>  4) & 0xf;
-    uint8_t a =  pix        & 0xf;
-    return (a << 28) | (a << 24) | (r << 20) | (r << 16) | (g << 12) | (g << 8) | (b << 4) | b;
+    unsigned int x;
+
+    for (x = 0; x < WIDTH; x++, src += 2) {
+        dst[x] = vip_4444_lo[src[0]] | vip_4444_hi[src[1]];
+    }
 }
 
-static uint32_t get_pixel(const void *src, VipFormat format, unsigned int x)
+static void vip_convert_row(uint32_t *dst, const uint8_t *src, VipFormat format)
 {
     switch (format) {
         case FORMAT_RGBA4444:
-            return rgba4444_to_argb8888(*(uint16_t *) (src + x * 2));
+            vip_convert_rgba4444(dst, src);
+            break;
 
+        case FORMAT_YCBCR422:
         case FORMAT_YCBCR422_DOWNSIZE:
-            x *= 2;
-            // fall-through
+            vip_convert_ycbcr422(dst, src, format == FORMAT_YCBCR422_DOWNSIZE);
+            break;
+    }
+}
 
-        case FORMAT_YCBCR422:
-            return ycbcr422_to_argb8888(*(uint32_t *) (src + (x >> 1) * 4), x & 1);
+/* (s * a + d * (0xff - a)) / 0xff for each color channel, the division is exact for all products of two bytes */
+static uint32_t blend_pixel(uint32_t dst, uint32_t src)
+{
+    uint32_t a = src >> 24, out = 0xffu << 24;
+    uint32_t t;
+    int shift;
 
-        default:
-            return 0;
+    for (shift = 0; shift < 24; shift += 8) {
+        t = ((src >> shift) & 0xff) * a + ((dst >> shift) & 0xff) * (0xff - a);
+        out |= ((t + 1 + (t >> 8)) >> 8) << shift;
     }
+    return out;
 }
 
-static uint32_t blend_pixel(uint32_t dst, uint32_t src)
+/* Blend a row over dst, groups of pixels that are fully transparent or fully opaque are skipped or copied */
+static void vip_blend_row(uint32_t *dst, const uint32_t *src, unsigned int n)
 {
-    uint8_t rd = (dst >> 16) & 0xff;
-    uint8_t gd = (dst >>  8) & 0xff;
-    uint8_t bd =  dst        & 0xff;
+    unsigned int x = 0;
 
-    uint8_t rs = (src >> 16) & 0xff;
-    uint8_t gs = (src >>  8) & 0xff;
-    uint8_t bs =  src        & 0xff;
+    for (; x + 4 <= n; x += 4) {
+        uint32_t all = src[x] & src[x+1] & src[x+2] & src[x+3];
+        uint32_t any = src[x] | src[x+1] | src[x+2] | src[x+3];
 
-    uint8_t sc = (src >> 24) & 0xff;
+        if ((any >> 24) == 0) {
+            continue;
+        } else if ((all >> 24) == 0xff) {
+            memcpy(&dst[x], &src[x], 4 * sizeof(uint32_t));
+            continue;
+        }
 
-    uint8_t ro = (rs * sc + rd * (0xff - sc)) / 0xff;
-    uint8_t go = (gs * sc + gd * (0xff - sc)) / 0xff;
-    uint8_t bo = (bs * sc + bd * (0xff - sc)) / 0xff;
+#if defined(__SSE2__)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i one = _mm_set1_epi16(1);
+            const __m128i ff = _mm_set1_epi16(0xff);
+            __m128i s = _mm_loadu_si128((const __m128i *) &src[x]);
+            __m128i d = _mm_loadu_si128((const __m128i *) &dst[x]);
+            __m128i res[2];
+            int i;
+
+            for (i = 0; i < 2; i++) {
+                __m128i s16 = i ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+                __m128i d16 = i ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+                __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, 0xff), 0xff);
+                __m128i t = _mm_add_epi16(_mm_mullo_epi16(s16, a), _mm_mullo_epi16(d16, _mm_sub_epi16(ff, a)));
+                res[i] = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, one), _mm_srli_epi16(t, 8)), 8);
+            }
 
-    return (0xff << 24) | (ro << 16) | (go << 8) |  bo;
+            _mm_storeu_si128((__m128i *) &dst[x], _mm_or_si128(_mm_packus_epi16(res[0], res[1]), _mm_set1_epi32(0xff000000)));
+        }
+#elif defined(__ARM_NEON)
+        {
+            uint8x16_t s = vreinterpretq_u8_u32(vld1q_u32(&src[x]));
+            uint8x16_t d = vreinterpretq_u8_u32(vld1q_u32(&dst[x]));
+            uint8x16_t a = vreinterpretq_u8_u32(vmulq_n_u32(vshrq_n_u32(vreinterpretq_u32_u8(s), 24), 0x01010101));
+            uint8x16_t ia = vmvnq_u8(a);
+            uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(s), vget_low_u8(a)), vget_low_u8(d), vget_low_u8(ia));
+            uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(s), vget_high_u8(a)), vget_high_u8(d), vget_high_u8(ia));
+            uint8x16_t out;
+
+            lo = vaddq_u16(vsraq_n_u16(lo, lo, 8), vdupq_n_u16(1));
+            hi = vaddq_u16(vsraq_n_u16(hi, hi, 8), vdupq_n_u16(1));
+            out = vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8));
+            vst1q_u32(&dst[x], vorrq_u32(vreinterpretq_u32_u8(out), vdupq_n_u32(0xff000000)));
+        }
+#else
+        dst[x] = blend_pixel(dst[x], src[x]);
+        dst[x+1] = blend_pixel(dst[x+1], src[x+1]);
+        dst[x+2] = blend_pixel(dst[x+2], src[x+2]);
+        dst[x+3] = blend_pixel(dst[x+3], src[x+3]);
+#endif
+    }
+
+    for (; x < n; x++) {
+        dst[x] = blend_pixel(dst[x], src[x]);
+    }
 }
 
 static void vip_update_irq(VipState *s)
 {
     qemu_set_irq(s->irqs[0], !!(s->reg_ctrl_intsts & 0x100));
     qemu_set_irq(s->irqs[1], !!(s->reg_ch_inten & s->reg_ch_intsts));
+
+    // Tells the vsync source whether the guest waits for the next vsync
+    qemu_set_irq(s->vsync_irq_enabled, (s->reg_ctrl_en & 0x100) || s->reg_ch_inten);
 }
 
-static void vip_draw(VipState *s, bool invalidate)
+/* Returns the number of rows that were redrawn */
+static unsigned int vip_draw(VipState *s, bool invalidate)
 {
     unsigned int x, y;
     VipLayer *l;
     DisplaySurface *surface = qemu_console_surface(s->con);
-    void *src = memory_region_get_ram_ptr(s->memory);
+    const uint8_t *src = memory_region_get_ram_ptr(s->memory);
+    uint32_t row[WIDTH];
     uint32_t *dst = surface_data(surface);
     int first = -1, last = -1;
 
@@ -158,12 +273,19 @@ static void vip_draw(VipState *s, bool invalidate)
             }
         }
         if (update) {
-            for (x = 0; x < WIDTH; x++) {
-                dst[x] = s->background;
-                for (l = &s->layers[0]; l < &s->layers[NUM_LAYERS]; l++) {
-                    if (l->enable) {
-                        dst[x] = blend_pixel(dst[x], get_pixel(src + l->addr + y * vip_strides[l->format], l->format, x));
-                    }
+            // Layer 0 is always YCbCr and thus opaque, it replaces the background
+            l = &s->layers[0];
+            if (l->enable) {
+                vip_convert_row(dst, src + l->addr + y * vip_strides[l->format], l->format);
+            } else {
+                for (x = 0; x < WIDTH; x++) {
+                    dst[x] = s->background;
+                }
+            }
+            for (l = &s->layers[1]; l < &s->layers[NUM_LAYERS]; l++) {
+                if (l->enable) {
+                    vip_convert_row(row, src + l->addr + y * vip_strides[l->format], l->format);
+                    vip_blend_row(dst, row, WIDTH);
                 }
             }
             if (first < 0) {
@@ -181,18 +303,20 @@ static void vip_draw(VipState *s, bool invalidate)
 
     if (first >= 0) {
         dpy_gfx_update(s->con, 0, first, WIDTH, last - first + 1);
+        return last - first + 1;
     }
+    return 0;
 }
 
-static void vip_update_display(VipState *s)
+// Latch the layer configuration, the channels only hold it until the next vsync
+static void vip_update_layers(VipState *s)
 {
     unsigned int i;
-    bool invalidate = false;
 
     uint32_t bg = (s->reg_bg >> 24) == 0x80 ? ycbcr_to_argb8888((s->reg_bg >> 16) & 0xff, (s->reg_bg >> 8) & 0xff, s->reg_bg & 0xff) : 0;
     if (bg != s->background) {
         s->background = bg;
-        invalidate = true;
+        s->invalidate = true;
     }
 
     for (i = 0; i < NUM_LAYERS; i++) {
@@ -206,23 +330,37 @@ static void vip_update_display(VipState *s)
             } else if (!i && channel->num_cpy == WIDTH * 4 && channel->num_repeat == HEIGHT - 1) {
                 layer.format = FORMAT_YCBCR422_DOWNSIZE;
             } else {
-                hw_error("%s: Unsupported image format\n", __func__);
+                // The layer stays off, the channel completes at this vsync with the (model specific) error bit set
+                bionz_error(OBJECT(s), "Unsupported image format on layer %u: 0x%x bytes x %u rows", i, channel->num_cpy, channel->num_repeat + 1);
+                s->reg_ch_intsts |= 2 << (4 * 2 * i);
+                layer.enable = false;
             }
 
             layer.addr = channel->addr;
 
-            if (layer.addr + vip_strides[layer.format] * HEIGHT > memory_region_size(s->memory)) {
+            if (!layer.enable || layer.addr + vip_strides[layer.format] * HEIGHT > memory_region_size(s->memory)) {
                 layer = (VipLayer) {0};
             }
         }
 
         if (memcmp(&layer, &s->layers[i], sizeof(layer))) {
             s->layers[i] = layer;
-            invalidate = true;
+            s->invalidate = true;
         }
     }
+}
 
-    vip_draw(s, invalidate);
+static void vip_update_display(VipState *s)
+{
+    bool invalidate = s->invalidate;
+    int64_t start = bionz_stats_start();
+    unsigned int rows;
+
+    s->invalidate = false;
+    rows = vip_draw(s, invalidate);
+
+    trace_bionz_vip_draw(invalidate, rows);
+    bionz_stats_end(&s->stats, start, (uint64_t) rows * WIDTH * sizeof(uint32_t));
 }
 
 static void vip_vsync(void *opaque, int irq, int level)
@@ -231,7 +369,10 @@ static void vip_vsync(void *opaque, int irq, int level)
     VipState *s = BIONZ_VIP(opaque);
 
     if (level) {
-        vip_update_display(s);
+        vip_update_layers(s);
+        if (!s->skip_vsync) {
+            vip_update_display(s);
+        }
     }
 
     s->field = level;
@@ -379,6 +520,7 @@ static void vip_ctrl_write(void *opaque, hwaddr offset, uint64_t value, unsigned
 
         case 0x1fc:
             s->reg_ctrl_en = value;
+            vip_update_irq(s);
             break;
 
         case 0x310:
@@ -406,7 +548,26 @@ static const struct MemoryRegionOps vip_mmio1_ops = {
     .valid.max_access_size = 4,
 };
 
-static const GraphicHwOps vip_gfx_ops = {};
+static void vip_invalidate_display(void *opaque)
+{
+    VipState *s = BIONZ_VIP(opaque);
+    s->invalidate = true;
+}
+
+// Only called while a display listener refreshes the console
+static void vip_gfx_update(void *opaque)
+{
+    VipState *s = BIONZ_VIP(opaque);
+
+    if (s->skip_vsync) {
+        vip_update_display(s);
+    }
+}
+
+static const GraphicHwOps vip_gfx_ops = {
+    .invalidate = vip_invalidate_display,
+    .gfx_update = vip_gfx_update,
+};
 
 static void vip_reset(DeviceState *dev)
 {
@@ -428,6 +589,9 @@ static void vip_reset(DeviceState *dev)
         s->layers[i] = (VipLayer) {0};
     }
     s->background = 0;
+    s->invalidate = true;
+
+    vip_update_irq(s);
 }
 
 static void vip_realize(DeviceState *dev, Error **errp)
@@ -444,24 +608,68 @@ static void vip_realize(DeviceState *dev, Error **errp)
     sysbus_init_irq(sbd, &s->irqs[0]);
     sysbus_init_irq(sbd, &s->irqs[1]);
     qdev_init_gpio_in(dev, vip_vsync, 1);
+    qdev_init_gpio_out_named(dev, &s->vsync_irq_enabled, "vsync-irq-enabled", 1);
 
     s->con = graphic_console_init(dev, 0, &vip_gfx_ops, s);
     qemu_console_resize(s->con, WIDTH, HEIGHT);
 
     assert(s->memory && memory_region_is_ram(s->memory));
     memory_region_set_log(s->memory, true, DIRTY_MEMORY_VGA);
+
+    bionz_stats_register(&s->stats, OBJECT(dev));
 }
 
 static Property vip_properties[] = {
     DEFINE_PROP_LINK("memory", VipState, memory, TYPE_MEMORY_REGION, MemoryRegion *),
+    DEFINE_PROP_BOOL("skip-vsync", VipState, skip_vsync, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_vip_channel = {
+    .name = TYPE_BIONZ_VIP ".channel",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ctrl, VipChannel),
+        VMSTATE_UINT32(addr, VipChannel),
+        VMSTATE_UINT32(num_cpy, VipChannel),
+        VMSTATE_UINT32(num_repeat, VipChannel),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int vip_post_load(void *opaque, int version_id)
+{
+    VipState *s = BIONZ_VIP(opaque);
+    s->invalidate = true;
+    vip_update_irq(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_vip = {
+    .name = TYPE_BIONZ_VIP,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = vip_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(channels, VipState, NUM_CHANNELS, 1, vmstate_vip_channel, VipChannel),
+        VMSTATE_UINT32(reg_ch_intsts, VipState),
+        VMSTATE_UINT32(reg_ch_inten, VipState),
+        VMSTATE_UINT32(field, VipState),
+        VMSTATE_UINT32(reg_ctrl_intsts, VipState),
+        VMSTATE_UINT32(reg_ctrl_en, VipState),
+        VMSTATE_UINT32(reg_bg, VipState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void vip_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
+    vip_init_tables();
     dc->realize = vip_realize;
     dc->reset = vip_reset;
+    dc->vmsd = &vmstate_vip;
     device_class_set_props(dc, vip_properties);
 }
 
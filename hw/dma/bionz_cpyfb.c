@@ -1,14 +1,34 @@
 /* QEMU model of the Sony CXD4108 blit engine */
 
 #include "qemu/osdep.h"
+#include "exec/address-spaces.h"
+#include "hw/arm/bionz_error.h"
+#include "hw/arm/bionz_stats.h"
 #include "hw/hw.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
+#include "qemu/bswap.h"
 #include "qemu/log.h"
+#include "sysemu/dma.h"
+#include "trace.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #define NUM_CHANNELS 3
 
+// The modes the firmware uses, other ctrl values are not understood
+#define CTRL_BLIT 0x11100001
+#define CTRL_ALPHA_BLIT 0x10010101 // src alpha
+#define CTRL_ALPHA_BLEND 0x10000301 // src alpha scaled by a global alpha
+
+#define CH_CTRL_FILL 0x21
+
 #define TYPE_BIONZ_CPYFB "bionz_cpyfb"
 #define BIONZ_CPYFB(obj) OBJECT_CHECK(CpyfbState, (obj), TYPE_BIONZ_CPYFB)
 
@@ -35,93 +55,236 @@ typedef struct CpyfbState {
     uint32_t reg_ctrl;
     uint32_t reg_alpha_low;
     uint32_t reg_alpha_high;
+
+    BionzStats stats;
 } CpyfbState;
 
-static uint16_t blend_pixel(uint16_t dst, uint16_t src, uint8_t alpha)
+// A rectangle of RGBA4444 pixels, either mapped directly or copied one row at a time through a buffer
+typedef struct CpyfbRect {
+    hwaddr addr;
+    int64_t stride;
+    bool is_write;
+
+    uint8_t *ptr;
+    ptrdiff_t pitch;
+    void *map;
+    dma_addr_t map_len;
+} CpyfbRect;
+
+static void cpyfb_map(CpyfbRect *r, hwaddr addr, int64_t stride, unsigned int width, unsigned int height, bool is_write)
+{
+    hwaddr start = stride < 0 ? addr + stride * (height - 1) : addr;
+    dma_addr_t len;
+
+    r->addr = addr;
+    r->stride = stride;
+    r->is_write = is_write;
+    r->map_len = (height - 1) * ABS(stride) + width * 2;
+
+    len = r->map_len;
+    r->map = dma_memory_map(&address_space_memory, start, &len, is_write ? DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE);
+    if (r->map && len != r->map_len) {
+        dma_memory_unmap(&address_space_memory, r->map, len, is_write ? DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE, 0);
+        r->map = NULL;
+    }
+
+    if (r->map) {
+        r->ptr = r->map + (addr - start);
+        r->pitch = stride;
+    } else {
+        // Not all in RAM, all rows share one buffer that is loaded and stored around each row
+        r->ptr = g_malloc(width * 2);
+        r->pitch = 0;
+    }
+}
+
+static void cpyfb_load_row(CpyfbRect *r, unsigned int i, unsigned int width)
+{
+    if (!r->map) {
+        cpu_physical_memory_read(r->addr + i * r->stride, r->ptr, width * 2);
+    }
+}
+
+static void cpyfb_store_row(CpyfbRect *r, unsigned int i, unsigned int width)
 {
-    uint8_t rd = (dst >> 12) & 0xf;
-    uint8_t gd = (dst >>  8) & 0xf;
-    uint8_t bd = (dst >>  4) & 0xf;
-    uint8_t ad =  dst        & 0xf;
+    if (!r->map) {
+        cpu_physical_memory_write(r->addr + i * r->stride, r->ptr, width * 2);
+    }
+}
 
-    uint8_t rs = (src >> 12) & 0xf;
-    uint8_t gs = (src >>  8) & 0xf;
-    uint8_t bs = (src >>  4) & 0xf;
-    uint8_t as =  src        & 0xf;
+static void cpyfb_unmap(CpyfbRect *r)
+{
+    if (r->map) {
+        dma_memory_unmap(&address_space_memory, r->map, r->map_len, r->is_write ? DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE, r->is_write ? r->map_len : 0);
+    } else {
+        g_free(r->ptr);
+    }
+}
 
-    uint8_t sc = alpha * as / 0xf;
+static inline unsigned int div15(unsigned int x)
+{
+    // Exact for x <= 0xe1, the largest product of two nibbles
+    return (x * 137) >> 11;
+}
 
-    uint8_t ro = (rs * sc + rd * (0xf - sc)) / 0xf;
-    uint8_t go = (gs * sc + gd * (0xf - sc)) / 0xf;
-    uint8_t bo = (bs * sc + bd * (0xf - sc)) / 0xf;
-    uint8_t ao = (0xf * sc + ad * (0xf - sc)) / 0xf;
+static uint16_t blend_pixel(uint16_t dst, uint16_t src, unsigned int alpha)
+{
+    unsigned int sc = div15(alpha * (src & 0xf));
+    unsigned int out = div15(0xf * sc + (dst & 0xf) * (0xf - sc));
+    int shift;
 
-    return (ro << 12) | (go << 8) | (bo << 4) | ao;
+    for (shift = 4; shift < 16; shift += 4) {
+        out |= div15(((src >> shift) & 0xf) * sc + ((dst >> shift) & 0xf) * (0xf - sc)) << shift;
+    }
+    return out;
 }
 
-static void cpyfb_fill_rect(int dst_stride, hwaddr dst, unsigned int width, unsigned int height, uint16_t rgba)
+/*
+ * Blend a row of src over bg into dst, with src alpha scaled by a global alpha.
+ * dst may be the same as bg.
+ */
+static void cpyfb_blend_row(uint8_t *dst, const uint8_t *bg, const uint8_t *src, unsigned int n, unsigned int alpha)
 {
-    int i;
-    uint16_t *buffer;
+    unsigned int x = 0, i, any, all;
+    uint16_t p;
+
+    for (; x + 8 <= n; x += 8) {
+        any = 0;
+        all = 0xf;
+        for (i = 0; i < 8; i++) {
+            p = lduw_le_p(&src[(x + i) * 2]);
+            any |= p;
+            all &= p;
+        }
+        if (!(any & 0xf)) {
+            if (dst != bg) {
+                memcpy(&dst[x * 2], &bg[x * 2], 16);
+            }
+            continue;
+        } else if ((all & 0xf) == 0xf && alpha == 0xf) {
+            memcpy(&dst[x * 2], &src[x * 2], 16);
+            continue;
+        }
+
+#if defined(__SSE2__)
+        {
+            const __m128i nib = _mm_set1_epi16(0xf);
+            const __m128i div = _mm_set1_epi16(137);
+            __m128i s = _mm_loadu_si128((const __m128i *) &src[x * 2]);
+            __m128i d = _mm_loadu_si128((const __m128i *) &bg[x * 2]);
+            __m128i as = _mm_and_si128(s, nib);
+            __m128i sc = _mm_srli_epi16(_mm_mullo_epi16(_mm_mullo_epi16(as, _mm_set1_epi16(alpha)), div), 11);
+            __m128i isc = _mm_sub_epi16(nib, sc);
+            __m128i out = _mm_setzero_si128();
+            int shift;
+
+            for (shift = 0; shift < 16; shift += 4) {
+                __m128i cs = shift ? _mm_and_si128(_mm_srli_epi16(s, shift), nib) : nib;
+                __m128i cd = _mm_and_si128(_mm_srli_epi16(d, shift), nib);
+                __m128i t = _mm_add_epi16(_mm_mullo_epi16(cs, sc), _mm_mullo_epi16(cd, isc));
+                out = _mm_or_si128(out, _mm_slli_epi16(_mm_srli_epi16(_mm_mullo_epi16(t, div), 11), shift));
+            }
+
+            _mm_storeu_si128((__m128i *) &dst[x * 2], out);
+        }
+#elif defined(__ARM_NEON)
+        {
+            const uint16x8_t nib = vdupq_n_u16(0xf);
+            uint16x8_t s = vreinterpretq_u16_u8(vld1q_u8(&src[x * 2]));
+            uint16x8_t d = vreinterpretq_u16_u8(vld1q_u8(&bg[x * 2]));
+            uint16x8_t as = vandq_u16(s, nib);
+            uint16x8_t sc = vshrq_n_u16(vmulq_n_u16(vmulq_n_u16(as, alpha), 137), 11);
+            uint16x8_t isc = vsubq_u16(nib, sc);
+            uint16x8_t out;
+
+            out = vshrq_n_u16(vmulq_n_u16(vmlaq_u16(vmulq_u16(nib, sc), vandq_u16(d, nib), isc), 137), 11);
+            out = vorrq_u16(out, vshlq_n_u16(vshrq_n_u16(vmulq_n_u16(vmlaq_u16(vmulq_u16(vandq_u16(vshrq_n_u16(s, 4), nib), sc), vandq_u16(vshrq_n_u16(d, 4), nib), isc), 137), 11), 4));
+            out = vorrq_u16(out, vshlq_n_u16(vshrq_n_u16(vmulq_n_u16(vmlaq_u16(vmulq_u16(vandq_u16(vshrq_n_u16(s, 8), nib), sc), vandq_u16(vshrq_n_u16(d, 8), nib), isc), 137), 11), 8));
+            out = vorrq_u16(out, vshlq_n_u16(vshrq_n_u16(vmulq_n_u16(vmlaq_u16(vmulq_u16(vshrq_n_u16(s, 12), sc), vshrq_n_u16(d, 12), isc), 137), 11), 12));
+            vst1q_u8(&dst[x * 2], vreinterpretq_u8_u16(out));
+        }
+#else
+        for (i = 0; i < 8; i++) {
+            stw_le_p(&dst[(x + i) * 2], blend_pixel(lduw_le_p(&bg[(x + i) * 2]), lduw_le_p(&src[(x + i) * 2]), alpha));
+        }
+#endif
+    }
+
+    for (; x < n; x++) {
+        stw_le_p(&dst[x * 2], blend_pixel(lduw_le_p(&bg[x * 2]), lduw_le_p(&src[x * 2]), alpha));
+    }
+}
+
+// Fill with a 32-bit pattern, the low half goes to even pixels
+static void cpyfb_fill_rect(int64_t dst_stride, hwaddr dst, unsigned int width, unsigned int height, uint32_t data)
+{
+    CpyfbRect d;
+    unsigned int i;
 
     if (width && height) {
-        buffer = g_new(uint16_t, width);
+        cpyfb_map(&d, dst, dst_stride, width, height, true);
         for (i = 0; i < width; i++) {
-            buffer[i] = rgba;
+            stw_le_p(&d.ptr[i * 2], (i & 1) ? data >> 16 : data);
         }
-
         for (i = 0; i < height; i++) {
-            cpu_physical_memory_write(dst, buffer, width * sizeof(uint16_t));
-            dst += dst_stride;
+            if (i && d.pitch) {
+                memmove(d.ptr + i * d.pitch, d.ptr, width * 2);
+            }
+            cpyfb_store_row(&d, i, width);
         }
-
-        g_free(buffer);
+        cpyfb_unmap(&d);
     }
 }
 
-static void cpyfb_bit_blit(int src_stride, hwaddr src, int dst_stride, hwaddr dst, unsigned int width, unsigned int height)
+static void cpyfb_bit_blit(int64_t src_stride, hwaddr src, int64_t dst_stride, hwaddr dst, unsigned int width, unsigned int height)
 {
-    int i;
-    uint16_t *buffer;
+    CpyfbRect s, d;
+    unsigned int i;
 
     if (width && height) {
-        buffer = g_new(uint16_t, width);
+        cpyfb_map(&s, src, src_stride, width, height, false);
+        cpyfb_map(&d, dst, dst_stride, width, height, true);
         for (i = 0; i < height; i++) {
-            cpu_physical_memory_read(src, buffer, width * sizeof(uint16_t));
-            cpu_physical_memory_write(dst, buffer, width * sizeof(uint16_t));
-            src += src_stride;
-            dst += dst_stride;
+            cpyfb_load_row(&s, i, width);
+            memmove(d.ptr + i * d.pitch, s.ptr + i * s.pitch, width * 2);
+            cpyfb_store_row(&d, i, width);
         }
-        g_free(buffer);
+        cpyfb_unmap(&d);
+        cpyfb_unmap(&s);
     }
 }
 
-static void cpyfb_alpha_blend_blit_rgba(int src_stride, hwaddr src, int dst_stride, hwaddr dst, unsigned int width, unsigned int height, uint8_t alpha)
+static void cpyfb_alpha_blend_blit_rgba(int64_t bg_stride, hwaddr bg, int64_t src_stride, hwaddr src, int64_t dst_stride, hwaddr dst,
+                                        unsigned int width, unsigned int height, unsigned int alpha)
 {
-    int i, j;
-    uint16_t *src_buffer, *dst_buffer;
+    CpyfbRect b, s, d;
+    unsigned int i;
 
     if (width && height) {
-        src_buffer = g_new(uint16_t, width);
-        dst_buffer = g_new(uint16_t, width);
+        cpyfb_map(&s, src, src_stride, width, height, false);
+        cpyfb_map(&d, dst, dst_stride, width, height, true);
+        if (bg != dst || bg_stride != dst_stride) {
+            cpyfb_map(&b, bg, bg_stride, width, height, false);
+        } else {
+            b = d;
+        }
         for (i = 0; i < height; i++) {
-            cpu_physical_memory_read(src, src_buffer, width * sizeof(uint16_t));
-            cpu_physical_memory_read(dst, dst_buffer, width * sizeof(uint16_t));
-            for (j = 0; j < width; j++) {
-                dst_buffer[j] = blend_pixel(dst_buffer[j], src_buffer[j], alpha);
-            }
-            cpu_physical_memory_write(dst, dst_buffer, width * sizeof(uint16_t));
-            src += src_stride;
-            dst += dst_stride;
+            cpyfb_load_row(&s, i, width);
+            cpyfb_load_row(&b, i, width);
+            cpyfb_blend_row(d.ptr + i * d.pitch, b.ptr + i * b.pitch, s.ptr + i * s.pitch, width, alpha);
+            cpyfb_store_row(&d, i, width);
+        }
+        if (b.ptr != d.ptr) {
+            cpyfb_unmap(&b);
         }
-        g_free(src_buffer);
-        g_free(dst_buffer);
+        cpyfb_unmap(&d);
+        cpyfb_unmap(&s);
     }
 }
 
-static void cpyfb_alpha_blit_rgba(int src_stride, hwaddr src, int dst_stride, hwaddr dst, unsigned int width, unsigned int height)
+static int32_t cpyfb_stride(CpyfbChannel *ch)
 {
-    cpyfb_alpha_blend_blit_rgba(src_stride, src, dst_stride, dst, width, height, 0xf);
+    return ch->num_cpy + ch->num_skip;
 }
 
 static void cpyfb_update_irq(CpyfbState *s)
@@ -132,64 +295,73 @@ static void cpyfb_update_irq(CpyfbState *s)
 static void cpyfb_command(CpyfbState *s)
 {
     unsigned int i;
-    CpyfbChannel *tmp, *src, *dst;
+    CpyfbChannel *bg, *src, *dst;
+    uint64_t bytes = 0;
+    int64_t start = bionz_stats_start();
+    bool error = false;
     int ch_en = 0;
     for (i = 0; i < NUM_CHANNELS; i++) {
         if (s->channels[i].ctrl & 1) {
             ch_en |= (1 << i);
         }
     }
+    trace_bionz_cpyfb_command(ch_en, s->reg_ctrl);
 
-    if (ch_en == 2 && s->channels[1].ctrl == 0x21) {
+    if (ch_en == 2 && s->channels[1].ctrl == CH_CTRL_FILL) {
         dst = &s->channels[1];
-        if ((dst->data >> 16) != (dst->data & 0xffff)) {
-            hw_error("%s: invalid data: 0x%x\n", __func__, dst->data);
-        }
-        cpyfb_fill_rect(dst->num_cpy + dst->num_skip, s->mem_base + dst->addr,
+        cpyfb_fill_rect(cpyfb_stride(dst), s->mem_base + dst->addr,
                         dst->num_cpy / 2, dst->num_repeat + 1,
-                        dst->data & 0xffff);
-    } else if (ch_en == 3 && s->reg_ctrl == 0x11100001) {
-        src = &s->channels[0];
+                        dst->data);
+        bytes = (uint64_t) dst->num_cpy * (dst->num_repeat + 1);
+    } else if (ch_en == 3 || ch_en == 7) {
+        // Channel 1 is the destination, the source is channel 0 or 2 with channel 0 as background
         dst = &s->channels[1];
-        if (src->num_cpy != dst->num_cpy || src->num_repeat != dst->num_repeat) {
-            hw_error("%s: src size != dst size\n", __func__);
-        }
-        cpyfb_bit_blit(src->num_cpy + src->num_skip, s->mem_base + src->addr,
-                       dst->num_cpy + dst->num_skip, s->mem_base + dst->addr,
-                       dst->num_cpy / 2, dst->num_repeat + 1);
-    } else if (ch_en == 7) {
-        tmp = &s->channels[0];
-        dst = &s->channels[1];
-        src = &s->channels[2];
-        if (tmp->addr != dst->addr || tmp->num_cpy != dst->num_cpy || tmp->num_skip != dst->num_skip || tmp->num_repeat != dst->num_repeat) {
-            hw_error("%s: tmp != dst\n", __func__);
-        }
-        if (src->num_cpy != dst->num_cpy || src->num_repeat != dst->num_repeat) {
-            hw_error("%s: src size != dst size\n", __func__);
-        }
-        if (s->reg_ctrl == 0x10010101) {
-            cpyfb_alpha_blit_rgba(src->num_cpy + src->num_skip, s->mem_base + src->addr,
-                                  dst->num_cpy + dst->num_skip, s->mem_base + dst->addr,
-                                  dst->num_cpy / 2, dst->num_repeat + 1);
-        } else if (s->reg_ctrl == 0x10000301) {
-            cpyfb_alpha_blend_blit_rgba(src->num_cpy + src->num_skip, s->mem_base + src->addr,
-                                        dst->num_cpy + dst->num_skip, s->mem_base + dst->addr,
-                                        dst->num_cpy / 2, dst->num_repeat + 1,
-                                        s->reg_alpha_high >> 28);
+        src = &s->channels[ch_en == 7 ? 2 : 0];
+        bg = ch_en == 7 ? &s->channels[0] : dst;
+        if (src->num_cpy != dst->num_cpy || src->num_repeat != dst->num_repeat ||
+            bg->num_cpy != dst->num_cpy || bg->num_repeat != dst->num_repeat) {
+            bionz_error(OBJECT(s), "Channel sizes differ: channels 0x%x", ch_en);
+            error = true;
         } else {
-            hw_error("%s: Unsupported command\n", __func__);
+            switch (s->reg_ctrl) {
+                case CTRL_BLIT:
+                    cpyfb_bit_blit(cpyfb_stride(src), s->mem_base + src->addr,
+                                   cpyfb_stride(dst), s->mem_base + dst->addr,
+                                   dst->num_cpy / 2, dst->num_repeat + 1);
+                    bytes = (uint64_t) dst->num_cpy * (dst->num_repeat + 1) * 2;
+                    break;
+
+                case CTRL_ALPHA_BLIT:
+                case CTRL_ALPHA_BLEND:
+                    cpyfb_alpha_blend_blit_rgba(cpyfb_stride(bg), s->mem_base + bg->addr,
+                                                cpyfb_stride(src), s->mem_base + src->addr,
+                                                cpyfb_stride(dst), s->mem_base + dst->addr,
+                                                dst->num_cpy / 2, dst->num_repeat + 1,
+                                                s->reg_ctrl == CTRL_ALPHA_BLEND ? s->reg_alpha_high >> 28 : 0xf);
+                    bytes = (uint64_t) dst->num_cpy * (dst->num_repeat + 1) * 3;
+                    break;
+
+                default:
+                    bionz_error(OBJECT(s), "Unsupported blit mode: channels 0x%x, ctrl 0x%x", ch_en, s->reg_ctrl);
+                    error = true;
+            }
         }
     } else {
-        hw_error("%s: Unsupported command\n", __func__);
+        bionz_error(OBJECT(s), "Unsupported command: channels 0x%x, ctrl 0x%x", ch_en, s->reg_ctrl);
+        error = true;
     }
 
+    // Failed commands also set the (model specific) error bit next to the done bit
     for (i = 0; i < NUM_CHANNELS; i++) {
         if (s->channels[i].ctrl & 1) {
-            s->reg_intsts |= 1 << (i * 4);
+            s->reg_intsts |= (error ? 3 : 1) << (i * 4);
             s->channels[i].ctrl &= ~1;
         }
     }
     cpyfb_update_irq(s);
+
+    trace_bionz_cpyfb_complete(ch_en, bytes);
+    bionz_stats_end(&s->stats, start, bytes);
 }
 
 static uint64_t cpyfb_ch_read(CpyfbState *s, unsigned int ch, hwaddr offset, unsigned size)
@@ -394,6 +566,8 @@ static void cpyfb_realize(DeviceState *dev, Error **errp)
     sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->mmio[1]);
 
     sysbus_init_irq(SYS_BUS_DEVICE(dev), &s->irq);
+
+    bionz_stats_register(&s->stats, OBJECT(dev));
 }
 
 static Property cpyfb_properties[] = {
@@ -401,11 +575,42 @@ static Property cpyfb_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_cpyfb_channel = {
+    .name = TYPE_BIONZ_CPYFB ".channel",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ctrl, CpyfbChannel),
+        VMSTATE_UINT32(data, CpyfbChannel),
+        VMSTATE_UINT32(addr, CpyfbChannel),
+        VMSTATE_UINT32(num_cpy, CpyfbChannel),
+        VMSTATE_INT32(num_skip, CpyfbChannel),
+        VMSTATE_UINT32(num_repeat, CpyfbChannel),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_cpyfb = {
+    .name = TYPE_BIONZ_CPYFB,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(channels, CpyfbState, NUM_CHANNELS, 1, vmstate_cpyfb_channel, CpyfbChannel),
+        VMSTATE_UINT32(reg_intsts, CpyfbState),
+        VMSTATE_UINT32(reg_inten, CpyfbState),
+        VMSTATE_UINT32(reg_ctrl, CpyfbState),
+        VMSTATE_UINT32(reg_alpha_low, CpyfbState),
+        VMSTATE_UINT32(reg_alpha_high, CpyfbState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void cpyfb_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = cpyfb_realize;
     dc->reset = cpyfb_reset;
+    dc->vmsd = &vmstate_cpyfb;
     device_class_set_props(dc, cpyfb_properties);
 }
 
@@ -1,13 +1,28 @@
 /* QEMU model of the Sony BIONZ dma controller peripheral (similar to PL080) */
 
 #include "qemu/osdep.h"
+#include "exec/address-spaces.h"
+#include "hw/arm/bionz_error.h"
+#include "hw/arm/bionz_stats.h"
 #include "hw/hw.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "hw/dma/bionz_dma.h"
+#include "migration/vmstate.h"
+#include "qapi/error.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "sysemu/cpus.h"
+#include "sysemu/dma.h"
+#include "trace.h"
 
 #define MAX_CHANNEL 8
+#define NUM_REQUEST 16
+
+// Bytes moved per channel before the bottom half yields, and the size of the bounce buffer
+#define DMA_BATCH_SIZE 0x10000
+#define DMA_CHUNK_SIZE 0x1000
 
 #define TYPE_BIONZ_DMA "bionz_dma"
 #define BIONZ_DMA(obj) OBJECT_CHECK(DmaState, (obj), TYPE_BIONZ_DMA)
@@ -19,176 +34,267 @@ typedef struct LinkedListItem {
     uint32_t ctrl;
 } LinkedListItem;
 
+typedef struct DmaTransfer {
+    uint32_t size;
+    unsigned int sshift, dshift;
+    bool sinc, dinc, intr;
+    bool speriph, dperiph;
+    unsigned int srcdev, dstdev;
+} DmaTransfer;
+
 typedef struct DmaState {
     SysBusDevice parent_obj;
     MemoryRegion mmio;
     qemu_irq intr[MAX_CHANNEL + 1];
+    QEMUBH *bh;
+    bool bh_scheduled;
+    Object *peripherals[NUM_REQUEST];
 
     uint32_t version;
     uint32_t num_channel;
 
     uint32_t int_reg;
+    uint32_t err_reg;
     LinkedListItem regs[MAX_CHANNEL];
     uint32_t conf_reg[MAX_CHANNEL];
     uint32_t lli_reg[MAX_CHANNEL];
+
+    // Bytes of the current item already transferred
+    uint32_t done[MAX_CHANNEL];
+
+    BionzStats stats;
 } DmaState;
 
 static void dma_update_irq(DmaState *s)
 {
     int i;
     for (i = 0; i < s->num_channel; i++) {
-        qemu_set_irq(s->intr[i], s->int_reg & (1 << i));
+        qemu_set_irq(s->intr[i], (s->int_reg | s->err_reg) & (1 << i));
     }
-    qemu_set_irq(s->intr[s->num_channel], s->int_reg);
+    qemu_set_irq(s->intr[s->num_channel], s->int_reg | s->err_reg);
 }
 
-static void dma_transfer_mem2mem(DmaState *s, uint32_t src, uint32_t dst, uint32_t size)
+static void dma_decode(DmaState *s, uint32_t conf, uint32_t ctrl, DmaTransfer *t)
 {
-    void *buffer;
+    unsigned int flow = (conf >> 11) & 7;
 
-    buffer = g_malloc(size);
-    cpu_physical_memory_read(src, buffer, size);
-    cpu_physical_memory_write(dst, buffer, size);
-    g_free(buffer);
+    switch (s->version) {
+        case 1:
+            t->size = ctrl & 0xfff;
+            if (t->size == 0) {
+                t->size = 0x1000;
+            }
+            t->sshift = (ctrl >> 18) & 7;
+            t->dshift = (ctrl >> 21) & 7;
+            t->sinc = (ctrl >> 26) & 1;
+            t->dinc = (ctrl >> 27) & 1;
+            t->intr = (ctrl >> 31) & 1;
+            break;
+
+        case 2:
+            t->size = ctrl & 0x7ffff;
+            if (t->size == 0) {
+                t->size = 0x80000;
+            }
+            t->sshift = (ctrl >> 23) & 7;
+            t->dshift = (ctrl >> 26) & 7;
+            t->sinc = (ctrl >> 29) & 1;
+            t->dinc = (ctrl >> 30) & 1;
+            t->intr = (ctrl >> 31) & 1;
+            break;
+
+        default:
+            g_assert_not_reached();
+    }
+
+    // Flows 4 to 7 let the peripheral end the transfer, they are run for the programmed size
+    t->speriph = flow == 2 || flow == 3 || flow == 4 || flow == 6 || flow == 7;
+    t->dperiph = flow == 1 || flow == 3 || flow == 4 || flow == 5 || flow == 7;
+    t->srcdev = (conf >> 1) & 0xf;
+    t->dstdev = (conf >> 6) & 0xf;
 }
 
-static void dma_transfer_mem2peripheral(DmaState *s, uint32_t src, uint32_t dst, uint32_t size)
+static void dma_clear_size(DmaState *s, LinkedListItem *lli)
 {
-    unsigned char *buffer;
-    size_t i, sz;
-
-    buffer = g_malloc(size);
-    cpu_physical_memory_read(src, buffer, size);
-    for (i = 0; i < size; i += 4) {
-        sz = MIN(size - i, 4);
-        cpu_physical_memory_write(dst, buffer + i, sz);
+    switch (s->version) {
+        case 1:
+            lli->ctrl &= ~0xfff;
+            break;
+
+        case 2:
+            lli->ctrl &= ~0x7ffff;
+            break;
+
+        default:
+            g_assert_not_reached();
     }
-    g_free(buffer);
 }
 
-static void dma_transfer_peripheral2mem(DmaState *s, uint32_t src, uint32_t dst, uint32_t size)
+static void dma_transfer_mem2mem(DmaState *s, hwaddr src, hwaddr dst, uint32_t size)
 {
-    unsigned char *buffer;
-    size_t i, sz;
+    uint8_t buffer[DMA_CHUNK_SIZE];
+    dma_addr_t src_len = size, dst_len = size;
+    void *src_ptr, *dst_ptr;
+    uint32_t i, n;
+    bool mapped;
+
+    src_ptr = dma_memory_map(&address_space_memory, src, &src_len, DMA_DIRECTION_TO_DEVICE);
+    dst_ptr = dma_memory_map(&address_space_memory, dst, &dst_len, DMA_DIRECTION_FROM_DEVICE);
+    mapped = src_ptr && dst_ptr && src_len == size && dst_len == size;
+
+    if (mapped) {
+        memmove(dst_ptr, src_ptr, size);
+    }
+    if (dst_ptr) {
+        dma_memory_unmap(&address_space_memory, dst_ptr, dst_len, DMA_DIRECTION_FROM_DEVICE, mapped ? dst_len : 0);
+    }
+    if (src_ptr) {
+        dma_memory_unmap(&address_space_memory, src_ptr, src_len, DMA_DIRECTION_TO_DEVICE, 0);
+    }
 
-    buffer = g_malloc(size);
-    for (i = 0; i < size; i += 4) {
-        sz = MIN(size - i, 4);
-        cpu_physical_memory_read(src, buffer + i, sz);
+    if (!mapped) {
+        for (i = 0; i < size; i += n) {
+            n = MIN(size - i, sizeof(buffer));
+            cpu_physical_memory_read(src + i, buffer, n);
+            cpu_physical_memory_write(dst + i, buffer, n);
+        }
     }
-    cpu_physical_memory_write(dst, buffer, size);
-    g_free(buffer);
 }
 
-static void dma_run(DmaState *s, unsigned ch)
+// Fixed addresses are peripheral fifos, they are accessed one beat of the given width at a time
+static void dma_read_fifo(hwaddr addr, uint8_t *buf, uint32_t size, unsigned int width)
 {
-    int enable, flow, srcdev, dstdev, sshift, dshift, sinc, dinc, intr;
-    uint32_t ldec_ctrl, size;
+    uint32_t i;
 
-    while (1) {
-        enable = s->conf_reg[ch] & 1;
-        flow = (s->conf_reg[ch] >> 11) & 7;
-        srcdev = (s->conf_reg[ch] >> 1) & 0xf;
-        dstdev = (s->conf_reg[ch] >> 6) & 0xf;
-
-        if (!enable) {
-            return;
-        }
+    for (i = 0; i < size; i += width) {
+        cpu_physical_memory_read(addr, buf + i, MIN(size - i, width));
+    }
+}
 
-        LinkedListItem *lli = &s->regs[ch];
+static void dma_write_fifo(hwaddr addr, const uint8_t *buf, uint32_t size, unsigned int width)
+{
+    uint32_t i;
 
-        if (s->conf_reg[ch] & 0x2000000) {
-            cpu_physical_memory_read(s->lli_reg[ch] & ~3, lli, sizeof(*lli));
-            s->conf_reg[ch] &= ~0x2000000;
-        }
+    for (i = 0; i < size; i += width) {
+        cpu_physical_memory_write(addr, buf + i, MIN(size - i, width));
+    }
+}
 
-        switch (s->version) {
-            case 1:
-                size = lli->ctrl & 0xfff;
-                if (size == 0) {
-                    size = 0x1000;
-                }
-                sshift = (lli->ctrl >> 18) & 7;
-                dshift = (lli->ctrl >> 21) & 7;
-                sinc = (lli->ctrl >> 26) & 1;
-                dinc = (lli->ctrl >> 27) & 1;
-                intr = (lli->ctrl >> 31) & 1;
-                break;
+/* Moves up to size bytes of the current item of a channel, returns the number of bytes moved */
+static uint32_t dma_transfer(DmaState *s, unsigned ch, const DmaTransfer *t, uint32_t size)
+{
+    uint8_t buffer[DMA_CHUNK_SIZE];
+    LinkedListItem *lli = &s->regs[ch];
+    hwaddr src = lli->src + (t->sinc ? s->done[ch] : 0);
+    hwaddr dst = lli->dst + (t->dinc ? s->done[ch] : 0);
+    BionzDmaPeripheral *sp = t->speriph ? BIONZ_DMA_PERIPHERAL(s->peripherals[t->srcdev]) : NULL;
+    BionzDmaPeripheral *dp = t->dperiph ? BIONZ_DMA_PERIPHERAL(s->peripherals[t->dstdev]) : NULL;
+    uint32_t n, written;
+
+    if (!t->speriph && !t->dperiph && t->sinc && t->dinc) {
+        dma_transfer_mem2mem(s, src, dst, size);
+        return size;
+    }
 
-            case 2:
-                size = lli->ctrl & 0x7ffff;
-                if (size == 0) {
-                    size = 0x80000;
-                }
-                sshift = (lli->ctrl >> 23) & 7;
-                dshift = (lli->ctrl >> 26) & 7;
-                sinc = (lli->ctrl >> 29) & 1;
-                dinc = (lli->ctrl >> 30) & 1;
-                intr = (lli->ctrl >> 31) & 1;
-                break;
+    size = MIN(size, sizeof(buffer));
 
-            default:
-                hw_error("%s: unknown version\n", __func__);
-        }
+    if (sp) {
+        n = BIONZ_DMA_PERIPHERAL_GET_CLASS(sp)->read(sp, buffer, size);
+    } else if (t->sinc) {
+        cpu_physical_memory_read(src, buffer, size);
+        n = size;
+    } else {
+        dma_read_fifo(src, buffer, size, 1 << t->sshift);
+        n = size;
+    }
 
-        if (sshift != dshift || sinc != 1 || dinc != 1) {
-            hw_error("%s: unimplemented parameters\n", __func__);
+    if (dp) {
+        written = BIONZ_DMA_PERIPHERAL_GET_CLASS(dp)->write(dp, buffer, n);
+        if (written < n && sp) {
+            qemu_log_mask(LOG_GUEST_ERROR, "%s: channel %u dropped %u bytes\n", __func__, ch, n - written);
+        } else {
+            n = written;
         }
+    } else if (t->dinc) {
+        cpu_physical_memory_write(dst, buffer, n);
+    } else {
+        dma_write_fifo(dst, buffer, n, 1 << t->dshift);
+    }
 
-        size <<= sshift;
-
-        switch (flow) {
-            case 0:
-                dma_transfer_mem2mem(s, lli->src, lli->dst, size);
-                break;
+    return n;
+}
 
-            case 1:
-                switch (dstdev) {
-                    case 6: // ldec
-                        break;
+// Stops a channel that cannot run its current item with an error interrupt
+static void dma_abort(DmaState *s, unsigned ch)
+{
+    s->done[ch] = 0;
+    s->conf_reg[ch] &= ~1;
+    s->err_reg |= 1 << ch;
+    dma_update_irq(s);
+}
 
-                    default:
-                        hw_error("%s: unsupported dma peripheral\n", __func__);
-                }
+/* Runs a channel for up to budget bytes, returns true if it has more to do */
+static bool dma_run(DmaState *s, unsigned ch, uint32_t budget)
+{
+    LinkedListItem *lli = &s->regs[ch];
+    DmaTransfer t;
+    uint32_t total, n;
+    unsigned int items = 0;
+    uint64_t bytes = 0;
+    int64_t start = bionz_stats_start();
+    bool pending = false;
+
+    while (s->conf_reg[ch] & 1) {
+        if (!budget) {
+            pending = true;
+            break;
+        }
 
-                dma_transfer_mem2peripheral(s, lli->src, lli->dst, size);
-                break;
+        if (s->conf_reg[ch] & 0x2000000) {
+            cpu_physical_memory_read(s->lli_reg[ch] & ~3, lli, sizeof(*lli));
+            s->conf_reg[ch] &= ~0x2000000;
+        }
 
-            case 2:
-                switch (srcdev) {
-                    case 7: // ldec
-                        cpu_physical_memory_read(lli->src & ~0x7fff, &ldec_ctrl, sizeof(ldec_ctrl));
-                        if (!(ldec_ctrl & 2)) {
-                            // not enabled
-                            return;
-                        }
-                        break;
-
-                    default:
-                        hw_error("%s: unsupported dma peripheral\n", __func__);
-                }
-
-                dma_transfer_peripheral2mem(s, lli->src, lli->dst, size);
-                break;
+        dma_decode(s, s->conf_reg[ch], lli->ctrl, &t);
+        total = t.size << t.sshift;
 
-            default:
-                hw_error("%s: unsupported dma flow\n", __func__);
+        // Widths above 32 bits are reserved
+        if (t.sshift > 2 || t.dshift > 2) {
+            bionz_error(OBJECT(s), "Channel %u: invalid transfer width (ctrl 0x%x)", ch, lli->ctrl);
+            dma_abort(s, ch);
+            break;
         }
 
-        switch (s->version) {
-            case 1:
-                lli->ctrl &= ~0xfff;
-                break;
+        if ((t.speriph && !s->peripherals[t.srcdev]) || (t.dperiph && !s->peripherals[t.dstdev])) {
+            bionz_error(OBJECT(s), "Channel %u: no peripheral on request line %u", ch, t.speriph && !s->peripherals[t.srcdev] ? t.srcdev : t.dstdev);
+            dma_abort(s, ch);
+            break;
+        }
 
-            case 2:
-                lli->ctrl &= ~0x7ffff;
+        if (s->done[ch] < total) {
+            if (!s->done[ch]) {
+                trace_bionz_dma_item(ch, lli->src, lli->dst, total, (s->conf_reg[ch] >> 11) & 7);
+            }
+            n = dma_transfer(s, ch, &t, MIN(total - s->done[ch], budget));
+            s->done[ch] += n;
+            bytes += n;
+            budget -= n;
+            if (!n) {
+                // Stalled, the peripheral raises its request line when it can continue
+                trace_bionz_dma_stall(ch, s->done[ch]);
                 break;
-
-            default:
-                hw_error("%s: unknown version\n", __func__);
+            }
+            if (s->done[ch] < total) {
+                continue;
+            }
         }
 
-        if (intr) {
+        s->done[ch] = 0;
+        dma_clear_size(s, lli);
+        items++;
+        trace_bionz_dma_item_complete(ch, t.intr);
+
+        if (t.intr) {
             s->int_reg |= 1 << ch;
             dma_update_irq(s);
         }
@@ -199,14 +305,48 @@ static void dma_run(DmaState *s, unsigned ch)
             s->conf_reg[ch] &= ~1;
         }
     }
+
+    if (bytes || items) {
+        bionz_stats_add(&s->stats, items, start, bytes);
+    }
+    return pending;
 }
 
-static void dma_run_all(DmaState *s)
+// Counts as device work until the bottom half has run
+static void dma_schedule(DmaState *s)
 {
+    if (!s->bh_scheduled) {
+        s->bh_scheduled = true;
+        qemu_device_work_begin();
+    }
+    qemu_bh_schedule(s->bh);
+}
+
+static void dma_run_bh(void *opaque)
+{
+    DmaState *s = BIONZ_DMA(opaque);
     unsigned ch;
+    bool pending = false;
+
+    s->bh_scheduled = false;
+    qemu_device_work_end();
+
+    for (ch = 0; ch < s->num_channel; ch++) {
+        pending |= dma_run(s, ch, DMA_BATCH_SIZE);
+    }
+
+    // Give the vcpus a chance to run between batches of long chains
+    if (pending) {
+        dma_schedule(s);
+    }
+}
 
-    for (ch = 0; ch < MAX_CHANNEL; ch++) {
-        dma_run(s, ch);
+static void dma_request(void *opaque, int req, int level)
+{
+    DmaState *s = BIONZ_DMA(opaque);
+
+    if (level) {
+        dma_schedule(s);
     }
 }
 
@@ -264,7 +404,9 @@ static void dma_ch_write(void *opaque, unsigned ch, hwaddr offset, uint64_t valu
             // channel configuration register
             s->conf_reg[ch] = value;
             if (value & 1) {
-                dma_run_all(s);
+                dma_schedule(s);
+            } else {
+                s->done[ch] = 0;
             }
             break;
 
@@ -287,13 +429,16 @@ static uint64_t dma_read(void *opaque, hwaddr offset, unsigned size)
     } else {
         switch (offset) {
             case 0x00:
+                // combined interrupt status register
+                return s->int_reg | s->err_reg;
+
             case 0x04:
                 // interrupt status register
                 return s->int_reg;
 
             case 0x0c:
                 // error status register
-                return 0;
+                return s->err_reg;
 
             default:
                 qemu_log_mask(LOG_UNIMP, "%s: unimplemented read @ 0x%" HWADDR_PRIx "\n", __func__, offset);
@@ -318,6 +463,8 @@ static void dma_write(void *opaque, hwaddr offset, uint64_t value, unsigned size
 
             case 0x10:
                 // error clear register
+                s->err_reg &= ~value;
+                dma_update_irq(s);
                 break;
 
             default:
@@ -339,11 +486,33 @@ static void dma_reset(DeviceState *dev)
     int i;
     DmaState *s = BIONZ_DMA(dev);
 
+    if (s->bh_scheduled) {
+        qemu_bh_cancel(s->bh);
+        s->bh_scheduled = false;
+        qemu_device_work_end();
+    }
+
     s->int_reg = 0;
+    s->err_reg = 0;
     for (i = 0; i < s->num_channel; i++) {
         memset(&s->regs[i], 0, sizeof(s->regs[i]));
         s->conf_reg[i] = 0;
         s->lli_reg[i] = 0;
+        s->done[i] = 0;
+    }
+}
+
+static void dma_init(Object *obj)
+{
+    int i;
+    DmaState *s = BIONZ_DMA(obj);
+    char *name;
+
+    for (i = 0; i < NUM_REQUEST; i++) {
+        name = g_strdup_printf("peripheral%d", i);
+        object_property_add_link(obj, name, TYPE_BIONZ_DMA_PERIPHERAL, &s->peripherals[i],
+                                 qdev_prop_allow_set_link_before_realize, OBJ_PROP_LINK_STRONG);
+        g_free(name);
     }
 }
 
@@ -353,12 +522,25 @@ static void dma_realize(DeviceState *dev, Error **errp)
     SysBusDevice *sbd = SYS_BUS_DEVICE(dev);
     DmaState *s = BIONZ_DMA(dev);
 
+    if (s->version != 1 && s->version != 2) {
+        error_setg(errp, "Unsupported version %u", s->version);
+        return;
+    }
+    if (s->num_channel > MAX_CHANNEL) {
+        error_setg(errp, "Too many channels: %u", s->num_channel);
+        return;
+    }
+
     memory_region_init_io(&s->mmio, OBJECT(dev), &dma_ops, s, TYPE_BIONZ_DMA, 0x1000);
     sysbus_init_mmio(sbd, &s->mmio);
 
     for (i = 0; i < s->num_channel + 1; i++) {
         sysbus_init_irq(sbd, &s->intr[i]);
     }
+    qdev_init_gpio_in_named(dev, dma_request, "request", NUM_REQUEST);
+
+    s->bh = qemu_bh_new(dma_run_bh, s);
+    bionz_stats_register(&s->stats, OBJECT(dev));
 }
 
 static Property dma_properties[] = {
@@ -367,24 +549,80 @@ static Property dma_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_dma_lli = {
+    .name = TYPE_BIONZ_DMA ".lli",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(src, LinkedListItem),
+        VMSTATE_UINT32(dst, LinkedListItem),
+        VMSTATE_UINT32(next_lli, LinkedListItem),
+        VMSTATE_UINT32(ctrl, LinkedListItem),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int dma_post_load(void *opaque, int version_id)
+{
+    DmaState *s = BIONZ_DMA(opaque);
+    DmaTransfer t;
+    unsigned ch;
+
+    for (ch = 0; ch < s->num_channel; ch++) {
+        dma_decode(s, s->conf_reg[ch], s->regs[ch].ctrl, &t);
+        if (s->done[ch] > t.size << t.sshift) {
+            return -EINVAL;
+        }
+    }
+
+    // Resume the channels that were running
+    dma_schedule(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_dma = {
+    .name = TYPE_BIONZ_DMA,
+    .version_id = 2,
+    .minimum_version_id = 1,
+    .post_load = dma_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(int_reg, DmaState),
+        VMSTATE_STRUCT_ARRAY(regs, DmaState, MAX_CHANNEL, 1, vmstate_dma_lli, LinkedListItem),
+        VMSTATE_UINT32_ARRAY(conf_reg, DmaState, MAX_CHANNEL),
+        VMSTATE_UINT32_ARRAY(lli_reg, DmaState, MAX_CHANNEL),
+        VMSTATE_UINT32_ARRAY_V(done, DmaState, MAX_CHANNEL, 2),
+        VMSTATE_UINT32_V(err_reg, DmaState, 2),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void dma_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = dma_realize;
     device_class_set_props(dc, dma_properties);
     dc->reset = dma_reset;
+    dc->vmsd = &vmstate_dma;
 }
 
 static const TypeInfo dma_info = {
     .name          = TYPE_BIONZ_DMA,
     .parent        = TYPE_SYS_BUS_DEVICE,
     .instance_size = sizeof(DmaState),
+    .instance_init = dma_init,
     .class_init    = dma_class_init,
 };
 
+static const TypeInfo dma_peripheral_info = {
+    .name          = TYPE_BIONZ_DMA_PERIPHERAL,
+    .parent        = TYPE_INTERFACE,
+    .class_size    = sizeof(BionzDmaPeripheralClass),
+};
+
 static void dma_register_type(void)
 {
     type_register_static(&dma_info);
+    type_register_static(&dma_peripheral_info);
 }
 
 type_init(dma_register_type)
@@ -1,15 +1,41 @@
 /* QEMU model of the Sony CXD4108 JPEG decoder */
 
 #include "qemu/osdep.h"
+#include "block/aio.h"
+#include "block/aio-wait.h"
+#include "block/thread-pool.h"
+#include "exec/address-spaces.h"
+#include "hw/arm/bionz_error.h"
+#include "hw/arm/bionz_stats.h"
 #include "hw/hw.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "qemu/ycbcr422.h"
+#include "sysemu/cpus.h"
+#include "sysemu/dma.h"
+#include "sysemu/runstate.h"
+#include "trace.h"
 #include <jpeglib.h>
 
 #define NUM_CHANNELS 3
 
+// Largest destination a decode writes, rows times the larger of the stride and the row size
+#define MAX_OUT_SIZE (256 * MiB)
+
+#if JPEG_LIB_VERSION >= 70
+#define JPEG_DCT_H(comp) ((comp)->DCT_h_scaled_size)
+#define JPEG_DCT_V(comp) ((comp)->DCT_v_scaled_size)
+#else
+#define JPEG_DCT_H(comp) ((comp)->DCT_scaled_size)
+#define JPEG_DCT_V(comp) ((comp)->DCT_scaled_size)
+#endif
+
 #define TYPE_BIONZ_JPEG "bionz_jpeg"
 #define BIONZ_JPEG(obj) OBJECT_CHECK(JpegState, (obj), TYPE_BIONZ_JPEG)
 
@@ -22,6 +48,25 @@ typedef struct JpegChannel {
     uint32_t num_repeat;
 } JpegChannel;
 
+enum JpegMode {
+    JPEG_MODE_NORMAL,
+    JPEG_MODE_SCALED,
+    JPEG_MODE_WIDTH,
+    JPEG_MODE_ZOOM,
+    JPEG_MODE_MPEG,
+    JPEG_MODE_MAX,
+};
+
+static const char *const jpeg_mode_names[JPEG_MODE_MAX] = {
+    [JPEG_MODE_NORMAL] = "normal",
+    [JPEG_MODE_SCALED] = "scaled",
+    [JPEG_MODE_WIDTH] = "width",
+    [JPEG_MODE_ZOOM] = "zoom",
+    [JPEG_MODE_MPEG] = "mpeg",
+};
+
+typedef struct JpegDecode JpegDecode;
+
 typedef struct JpegState {
     SysBusDevice parent_obj;
     MemoryRegion mmio[2];
@@ -40,8 +85,49 @@ typedef struct JpegState {
     uint32_t reg_size_ctrl;
     uint32_t reg_scale_ctrl;
     uint32_t qts[2][0x10];
+
+    JpegDecode *decode;
+    VMChangeStateEntry *vmstate_change;
+    uint64_t decode_frames[JPEG_MODE_MAX];
+    uint64_t decode_ns[JPEG_MODE_MAX];
+    BionzStats stats;
 } JpegState;
 
+struct JpegDecode {
+    JpegState *s;
+    unsigned int mode;
+
+    void *src;
+    unsigned long src_size;
+    unsigned int scale;
+    hwaddr dst;
+    int dst_stride;
+
+    // Decoded size in pixel pairs and rows, including the padding of the last iMCU row
+    unsigned int dec_width;
+    unsigned int dec_height;
+
+    // Size written to the destination, rows are cropped in width mode and resampled when zooming
+    unsigned int out_width;
+    unsigned int out_height;
+    bool resample;
+
+    // Either the mapped destination or a bounce buffer that is copied on completion
+    uint8_t *out;
+    size_t out_stride;
+    void *map;
+    dma_addr_t map_len;
+
+    int64_t start;
+    int64_t time;
+    char error[JMSG_LENGTH_MAX];
+};
+
+typedef struct JpegErrorMgr {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+} JpegErrorMgr;
+
 typedef struct JpegHeader {
     uint8_t soi_marker[2];
     struct {
@@ -84,140 +170,419 @@ QEMU_BUILD_BUG_ON(sizeof(JpegHeader) != 0xa9);
 
 static void jpeg_error(j_common_ptr cinfo)
 {
-    char buffer[JMSG_LENGTH_MAX];
-    (*cinfo->err->format_message)(cinfo, buffer);
-    hw_error("%s: %s", __func__, buffer);
+    JpegDecode *req = cinfo->client_data;
+    JpegErrorMgr *err = container_of(cinfo->err, JpegErrorMgr, pub);
+
+    (*cinfo->err->format_message)(cinfo, req->error);
+    longjmp(err->jmp, 1);
 }
 
-static void jpeg_decompress422(void *src, unsigned long src_size, hwaddr dst, int dst_stride, unsigned int scale)
+static void jpeg_create(struct jpeg_decompress_struct *cinfo, JpegErrorMgr *jerr, JpegDecode *req)
 {
-    unsigned int comp, row, x, y;
-    const unsigned int dctsize = DCTSIZE / scale;
+    cinfo->err = jpeg_std_error(&jerr->pub);
+    cinfo->err->error_exit = jpeg_error;
+    cinfo->client_data = req;
+    jpeg_create_decompress(cinfo);
+    jpeg_mem_src(cinfo, req->src, req->src_size);
+}
 
-    struct jpeg_decompress_struct cinfo;
-    struct jpeg_error_mgr jerr;
-    JSAMPARRAY *data;
-    uint32_t *buffer;
+static bool jpeg_check_sampling(struct jpeg_decompress_struct *cinfo, JpegDecode *req)
+{
+    if (cinfo->num_components != 3 ||
+        cinfo->comp_info[0].h_samp_factor != 2 ||
+        (cinfo->comp_info[0].v_samp_factor != 1 && cinfo->comp_info[0].v_samp_factor != 2) ||
+        cinfo->comp_info[1].h_samp_factor != 1 || cinfo->comp_info[1].v_samp_factor != 1 ||
+        cinfo->comp_info[2].h_samp_factor != 1 || cinfo->comp_info[2].v_samp_factor != 1) {
+        snprintf(req->error, sizeof(req->error), "unsupported sampling factors");
+        return false;
+    }
+    return true;
+}
 
-    cinfo.err = jpeg_std_error(&jerr);
-    cinfo.err->error_exit = jpeg_error;
-    jpeg_create_decompress(&cinfo);
-    jpeg_mem_src(&cinfo, src, src_size);
-    jpeg_read_header(&cinfo, true);
+/* Nearest neighbour resize of packed pixel pairs, widths are in pairs, chroma follows the even pixel */
+static void jpeg_resample(uint8_t *dst, size_t dst_stride, unsigned int dst_width, unsigned int dst_height,
+                          const uint8_t *src, size_t src_stride, unsigned int src_width, unsigned int src_height)
+{
+    unsigned int x, y, x0, x1;
+    const uint8_t *row, *p0, *p1;
+
+    for (y = 0; y < dst_height; y++) {
+        row = src + (uint64_t) y * src_height / dst_height * src_stride;
+        for (x = 0; x < dst_width; x++) {
+            x0 = (uint64_t) (x * 2) * src_width / dst_width;
+            x1 = (uint64_t) (x * 2 + 1) * src_width / dst_width;
+            p0 = row + (x0 / 2) * 4;
+            p1 = row + (x1 / 2) * 4;
+            dst[x*4] = p0[0];
+            dst[x*4+1] = p0[1 + (x0 & 1) * 2];
+            dst[x*4+2] = p0[2];
+            dst[x*4+3] = p1[1 + (x1 & 1) * 2];
+        }
+        dst += dst_stride;
+    }
+}
 
-    assert(cinfo.num_components == 3);
-    assert(cinfo.comp_info[0].h_samp_factor == 2);
-    assert(cinfo.comp_info[0].v_samp_factor == 1 || cinfo.comp_info[0].v_samp_factor == 2);
-    assert(cinfo.comp_info[1].h_samp_factor == 1);
-    assert(cinfo.comp_info[1].v_samp_factor == 1);
-    assert(cinfo.comp_info[2].h_samp_factor == 1);
-    assert(cinfo.comp_info[2].v_samp_factor == 1);
+/* Runs in a worker thread, decodes into req->out */
+static int jpeg_decompress422(void *opaque)
+{
+    JpegDecode *req = opaque;
+    unsigned int comp, row, x, y, rows, crows, cstep, width;
+    int64_t start = get_clock();
 
-    if (cinfo.comp_info[0].v_samp_factor == 2 && scale != 1) {
-        hw_error("%s: scaling of 4:2:0 JPEGs not supported\n", __func__);
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorMgr jerr;
+    jpeg_component_info *luma, *chroma;
+    JSAMPARRAY data[3];
+    JSAMPROW cb, cr, cb_row = NULL, cr_row = NULL;
+    uint8_t *out;
+    size_t out_stride;
+
+    jpeg_create(&cinfo, &jerr, req);
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        return -EIO;
+    }
+
+    jpeg_read_header(&cinfo, true);
+    if (!jpeg_check_sampling(&cinfo, req)) {
+        jpeg_destroy_decompress(&cinfo);
+        return -ENOTSUP;
     }
 
     cinfo.out_color_space = JCS_YCbCr;
     cinfo.scale_num = 1;
-    cinfo.scale_denom = scale;
+    cinfo.scale_denom = req->scale;
     cinfo.raw_data_out = true;
     jpeg_start_decompress(&cinfo);
 
-    data = g_new(JSAMPARRAY, cinfo.num_components);
+    luma = &cinfo.comp_info[0];
+    chroma = &cinfo.comp_info[1];
+    rows = JPEG_DCT_V(luma) * cinfo.max_v_samp_factor;
+    if (cinfo.output_width / 2 != req->dec_width || DIV_ROUND_UP(cinfo.output_height, rows) * rows != req->dec_height) {
+        snprintf(req->error, sizeof(req->error), "unexpected output size %ux%u", cinfo.output_width, cinfo.output_height);
+        jpeg_destroy_decompress(&cinfo);
+        return -EINVAL;
+    }
+
+    // The sample rows live in the decompressor's image pool and are released with it
     for (comp = 0; comp < cinfo.num_components; comp++) {
-        data[comp] = g_new(JSAMPROW, dctsize * cinfo.comp_info[comp].v_samp_factor);
-        for (row = 0; row < dctsize * cinfo.comp_info[comp].v_samp_factor; row++) {
-            data[comp][row] = g_new(JSAMPLE, dctsize * cinfo.comp_info[comp].width_in_blocks);
-        }
+        data[comp] = (*cinfo.mem->alloc_sarray)((j_common_ptr) &cinfo, JPOOL_IMAGE,
+                                                JPEG_DCT_H(&cinfo.comp_info[comp]) * cinfo.comp_info[comp].width_in_blocks,
+                                                JPEG_DCT_V(&cinfo.comp_info[comp]) * cinfo.comp_info[comp].v_samp_factor);
     }
-    buffer = g_new(uint32_t, cinfo.output_width / 2);
 
-    for (y = 0; y < cinfo.output_height; y += dctsize * cinfo.max_v_samp_factor) {
-        jpeg_read_raw_data(&cinfo, data, dctsize * cinfo.max_v_samp_factor);
-        for (row = 0; row < dctsize * cinfo.max_v_samp_factor; row++) {
-            for (x = 0; x < cinfo.output_width / 2; x++) {
-                buffer[x] = (data[0][row][x*2+1] << 24) | (data[2][row/cinfo.max_v_samp_factor][x] << 16) | (data[0][row][x*2] << 8) | data[1][row/cinfo.max_v_samp_factor][x];
+    /*
+     * When scaling 4:2:0 images, libjpeg decodes chroma with a larger DCT size
+     * and returns it at full resolution, every other sample is used then.
+     */
+    crows = JPEG_DCT_V(chroma);
+    cstep = JPEG_DCT_H(chroma) / JPEG_DCT_H(luma);
+
+    // Zoomed images are decoded in full first and then resampled into the destination
+    if (req->resample) {
+        out_stride = req->dec_width * 4;
+        out = (*cinfo.mem->alloc_large)((j_common_ptr) &cinfo, JPOOL_IMAGE, out_stride * req->dec_height);
+        width = req->dec_width;
+    } else {
+        out_stride = req->out_stride;
+        out = req->out;
+        width = req->out_width;
+    }
+    if (cstep > 1) {
+        cb_row = (*cinfo.mem->alloc_small)((j_common_ptr) &cinfo, JPOOL_IMAGE, width);
+        cr_row = (*cinfo.mem->alloc_small)((j_common_ptr) &cinfo, JPOOL_IMAGE, width);
+    }
+
+    for (y = 0; y < cinfo.output_height; y += rows) {
+        jpeg_read_raw_data(&cinfo, data, rows);
+        for (row = 0; row < rows; row++) {
+            // Zooming to the decoded size skips the resampler but not the window height
+            if (!req->resample && y + row >= req->out_height) {
+                break;
+            }
+            cb = data[1][row * crows / rows];
+            cr = data[2][row * crows / rows];
+            if (cstep > 1) {
+                for (x = 0; x < width; x++) {
+                    cb_row[x] = cb[x * cstep];
+                    cr_row[x] = cr[x * cstep];
+                }
+                cb = cb_row;
+                cr = cr_row;
             }
-            cpu_physical_memory_write(dst, buffer, cinfo.output_width / 2 * sizeof(uint32_t));
-            dst += dst_stride;
+            ycbcr422_pack(out + (y + row) * out_stride, data[0][row], cb, cr, width);
         }
     }
 
-    g_free(buffer);
-    for (comp = 0; comp < cinfo.num_components; comp++) {
-        for (row = 0; row < dctsize * cinfo.comp_info[comp].v_samp_factor; row++) {
-            g_free(data[comp][row]);
-        }
-        g_free(data[comp]);
+    if (req->resample) {
+        jpeg_resample(req->out, req->out_stride, req->out_width, req->out_height,
+                      out, out_stride, req->dec_width, cinfo.output_height);
     }
-    g_free(data);
 
     jpeg_finish_decompress(&cinfo);
     jpeg_destroy_decompress(&cinfo);
+
+    req->time = get_clock() - start;
+    return 0;
+}
+
+static void jpeg_update_irq(JpegState *s)
+{
+    qemu_set_irq(s->irq, !!(s->reg_inten & s->reg_intsts));
+}
+
+// Completes the enabled channels, failed commands also set the (model specific) error bit next to the done bit
+static void jpeg_finish(JpegState *s, bool error)
+{
+    unsigned int i;
+
+    for (i = 0; i < NUM_CHANNELS; i++) {
+        if (s->channels[i].ctrl & 1) {
+            s->reg_intsts |= (error ? 3 : 1) << (i * 4);
+            s->channels[i].ctrl &= ~1;
+        }
+    }
+    jpeg_update_irq(s);
+}
+
+static void jpeg_decode_free(JpegDecode *req)
+{
+    if (req->map) {
+        dma_memory_unmap(&address_space_memory, req->map, req->map_len, DMA_DIRECTION_FROM_DEVICE, req->map_len);
+    } else {
+        g_free(req->out);
+    }
+    g_free(req->src);
+    g_free(req);
+}
+
+/* Called from the thread pool's completion bottom half with the BQL held */
+static void jpeg_decompress_done(void *opaque, int ret)
+{
+    JpegDecode *req = opaque;
+    JpegState *s = req->s;
+    unsigned int y;
+
+    qemu_device_work_end();
+
+    if (ret < 0) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: %s\n", __func__, req->error);
+    } else {
+        if (!req->map) {
+            for (y = 0; y < req->out_height; y++) {
+                cpu_physical_memory_write(req->dst + (int64_t) y * req->dst_stride, req->out + y * req->out_stride, req->out_stride);
+            }
+        }
+        s->decode_frames[req->mode]++;
+        s->decode_ns[req->mode] += req->time;
+    }
+
+    trace_bionz_jpeg_decode_complete(jpeg_mode_names[req->mode], ret, req->time);
+    bionz_stats_end(&s->stats, req->start, req->src_size + (uint64_t) req->out_height * req->out_width * 4);
+
+    s->decode = NULL;
+    jpeg_finish(s, ret < 0);
+
+    jpeg_decode_free(req);
+}
+
+/*
+ * The worker writes into mapped guest memory, it has to be done before the
+ * memory is reset or restored. Completing the request also keeps a snapshot
+ * from saving a half written destination.
+ */
+static void jpeg_drain(JpegState *s)
+{
+    AIO_WAIT_WHILE(NULL, s->decode);
+}
+
+/* Reads the stream header and works out the scale and the decoded and written sizes */
+static bool jpeg_setup(JpegDecode *req, unsigned int scale, bool zoom, bool crop, JpegChannel *dst)
+{
+    unsigned int image_width, image_height, rows, vsamp;
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorMgr jerr;
+
+    jpeg_create(&cinfo, &jerr, req);
+    if (setjmp(jerr.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    jpeg_read_header(&cinfo, true);
+    if (!jpeg_check_sampling(&cinfo, req)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    image_width = cinfo.image_width;
+    image_height = cinfo.image_height;
+    vsamp = cinfo.max_v_samp_factor;
+    jpeg_destroy_decompress(&cinfo);
+
+    if (zoom) {
+        // The window comes from the guest and may only shrink the image
+        if (dst->num_repeat >= image_height || dst->num_cpy / 4 > image_width / 2) {
+            snprintf(req->error, sizeof(req->error), "zoom window of %u pairs x %" PRIu64 " rows exceeds the %ux%u image",
+                     dst->num_cpy / 4, (uint64_t) dst->num_repeat + 1, image_width, image_height);
+            return false;
+        }
+        req->out_width = dst->num_cpy / 4;
+        req->out_height = dst->num_repeat + 1;
+
+        // Let libjpeg do as much of the downscaling as possible in the DCT
+        for (scale = DCTSIZE; scale > 1; scale >>= 1) {
+            if (DIV_ROUND_UP(image_width, scale) >= req->out_width * 2 && DIV_ROUND_UP(image_height, scale) >= req->out_height) {
+                break;
+            }
+        }
+    }
+
+    rows = (DCTSIZE / scale) * vsamp;
+    req->scale = scale;
+    req->dec_width = DIV_ROUND_UP(image_width, scale) / 2;
+    req->dec_height = DIV_ROUND_UP(DIV_ROUND_UP(image_height, scale), rows) * rows;
+
+    if (zoom) {
+        req->resample = req->out_width != req->dec_width || req->out_height != DIV_ROUND_UP(image_height, scale);
+    } else {
+        req->out_width = crop ? MIN(req->dec_width, dst->num_cpy / 4) : req->dec_width;
+        req->out_height = req->dec_height;
+    }
+
+    if (!req->dec_width || !req->out_width) {
+        snprintf(req->error, sizeof(req->error), "empty image");
+        return false;
+    }
+
+    return true;
 }
 
 static void jpeg_decompress(JpegState *s, JpegChannel *src, JpegChannel *dst)
 {
     unsigned int i, j;
+    bool mpeg = s->reg_ctrl & (1 << 16);
+    bool zoom = s->reg_size_ctrl & 1;
+    bool crop = s->reg_size_ctrl & 2;
     bool is420 = s->reg_ctrl & (1 << 18);
     uint8_t scale = 1 << (((s->reg_scale_ctrl >> 16) & 0xf) >> 1);
     uint16_t width = ((s->reg_jpeg_width & 0x1ff) << 4) * scale;
-    uint16_t height = (((s->reg_jpeg_size & 0xffffff) / (is420 ? 6 : 4)) << (is420 ? 8 : 7)) / width;
+    uint16_t height = width ? (((s->reg_jpeg_size & 0xffffff) / (is420 ? 6 : 4)) << (is420 ? 8 : 7)) / width : 0;
     uint8_t offset = s->reg_jpeg_offset & 0x7f;
-    size_t buffer_size = sizeof(JpegHeader) + src->num_cpy - offset;
+    size_t header_size = mpeg ? 0 : sizeof(JpegHeader);
+    size_t buffer_size = header_size + src->num_cpy - offset;
 
     void *buffer = g_malloc(buffer_size);
     JpegHeader *header = buffer;
-
-    if (s->reg_ctrl & (1 << 16)) {
-        hw_error("%s: mpeg not supported\n", __func__);
-    }
-    if (s->reg_size_ctrl & 1) {
-        hw_error("%s: zoom not supported\n", __func__);
-    }
-    if (s->reg_size_ctrl & 2) {
-        hw_error("%s: width not supported\n", __func__);
-    }
-
-    *header = (JpegHeader) {
-        .soi_marker = {0xFF, 0xD8},
-        .dqt = {
-            JPEG_SEG(dqt, 0xDB),
-            .qts = {{0}, {1}},
-        },
-        .sof = {
-            JPEG_SEG(sof, 0xC0),
-            .precision = 8,
-            .height = cpu_to_be16(height),
-            .width = cpu_to_be16(width),
-            .num_components = 3,
-            .components = {
-                {1, is420 ? 0x22 : 0x21, 0},
-                {2, 0x11, 1},
-                {3, 0x11, 1},
+    JpegDecode *req;
+    size_t row_size;
+    dma_addr_t len;
+
+    // In MPEG mode the stream is a complete motion JPEG frame with its own headers
+    if (!mpeg) {
+        *header = (JpegHeader) {
+            .soi_marker = {0xFF, 0xD8},
+            .dqt = {
+                JPEG_SEG(dqt, 0xDB),
+                .qts = {{0}, {1}},
             },
-        },
-        .sos = {
-            JPEG_SEG(sos, 0xDA),
-            .num_components = 3,
-            .components = {
-                {1, 0},
-                {2, 0x11},
-                {3, 0x11},
+            .sof = {
+                JPEG_SEG(sof, 0xC0),
+                .precision = 8,
+                .height = cpu_to_be16(height),
+                .width = cpu_to_be16(width),
+                .num_components = 3,
+                .components = {
+                    {1, is420 ? 0x22 : 0x21, 0},
+                    {2, 0x11, 1},
+                    {3, 0x11, 1},
+                },
             },
-            .spectral_end = 0x3f,
-        },
-    };
-    for (i = 0; i < 2; i++) {
-        for (j = 0; j < 0x10; j++) {
-            stl_he_p(&header->dqt.qts[i].data[4 * j], bswap32(s->qts[i][j]));
+            .sos = {
+                JPEG_SEG(sos, 0xDA),
+                .num_components = 3,
+                .components = {
+                    {1, 0},
+                    {2, 0x11},
+                    {3, 0x11},
+                },
+                .spectral_end = 0x3f,
+            },
+        };
+        for (i = 0; i < 2; i++) {
+            for (j = 0; j < 0x10; j++) {
+                stl_he_p(&header->dqt.qts[i].data[4 * j], bswap32(s->qts[i][j]));
+            }
         }
     }
 
-    cpu_physical_memory_read(s->mem_base + src->addr + offset, buffer + sizeof(JpegHeader), buffer_size - sizeof(JpegHeader));
-    jpeg_decompress422(buffer, buffer_size, s->mem_base + dst->addr, dst->num_cpy + dst->num_skip, scale);
+    cpu_physical_memory_read(s->mem_base + src->addr + offset, buffer + header_size, buffer_size - header_size);
+
+    req = g_new0(JpegDecode, 1);
+    req->start = bionz_stats_start();
+    req->s = s;
+    req->mode = mpeg ? JPEG_MODE_MPEG : zoom ? JPEG_MODE_ZOOM : crop ? JPEG_MODE_WIDTH : scale != 1 ? JPEG_MODE_SCALED : JPEG_MODE_NORMAL;
+    req->src = buffer;
+    req->src_size = buffer_size;
+    req->dst = s->mem_base + dst->addr;
+    req->dst_stride = dst->num_cpy + dst->num_skip;
+
+    trace_bionz_jpeg_decode(jpeg_mode_names[req->mode], req->src_size, req->dst);
+    if (!jpeg_setup(req, scale, zoom, crop, dst)) {
+        bionz_error(OBJECT(s), "Cannot decode: %s", req->error);
+        jpeg_decode_free(req);
+        jpeg_finish(s, true);
+        return;
+    }
+    row_size = (size_t) req->out_width * 4;
+
+    // The geometry comes from the guest, bound it before mapping or allocating the destination
+    if (!req->out_height || (uint64_t) req->out_height * MAX(row_size, ABS((int64_t) req->dst_stride)) > MAX_OUT_SIZE) {
+        bionz_error(OBJECT(s), "Invalid destination: %u rows of %zu bytes, stride %d", req->out_height, row_size, req->dst_stride);
+        jpeg_decode_free(req);
+        jpeg_finish(s, true);
+        return;
+    }
 
-    g_free(buffer);
+    // Decode straight into guest RAM if all destination rows can be mapped in one piece
+    if (req->dst_stride >= (int64_t) row_size) {
+        req->map_len = (dma_addr_t) (req->out_height - 1) * req->dst_stride + row_size;
+        len = req->map_len;
+        req->map = dma_memory_map(&address_space_memory, req->dst, &len, DMA_DIRECTION_FROM_DEVICE);
+        if (req->map && len != req->map_len) {
+            dma_memory_unmap(&address_space_memory, req->map, len, DMA_DIRECTION_FROM_DEVICE, 0);
+            req->map = NULL;
+        }
+    }
+    if (req->map) {
+        req->out = req->map;
+        req->out_stride = req->dst_stride;
+    } else {
+        req->out = g_try_malloc((uint64_t) req->out_height * row_size);
+        req->out_stride = row_size;
+        if (!req->out) {
+            bionz_error(OBJECT(s), "Cannot allocate %" PRIu64 " bytes for the decoded rows", (uint64_t) req->out_height * row_size);
+            jpeg_decode_free(req);
+            jpeg_finish(s, true);
+            return;
+        }
+    }
+
+    s->decode = req;
+    qemu_device_work_begin();
+    thread_pool_submit_aio(aio_get_thread_pool(qemu_get_aio_context()), jpeg_decompress422, req, jpeg_decompress_done, req);
+}
+
+// Decodes only run while the VM does, a stopped VM can be reset, saved or loaded
+static void jpeg_vm_state_change(void *opaque, int running, RunState state)
+{
+    JpegState *s = BIONZ_JPEG(opaque);
+
+    if (!running) {
+        jpeg_drain(s);
+    } else if (!s->decode && (s->channels[0].ctrl & 1) && (s->channels[1].ctrl & 1)) {
+        // Restart a decode that was still running when the state was saved
+        jpeg_decompress(s, &s->channels[0], &s->channels[1]);
+    }
 }
 
 static void jpeg_fill(JpegState *s, JpegChannel *ch)
@@ -241,15 +606,16 @@ static void jpeg_fill(JpegState *s, JpegChannel *ch)
     g_free(buffer);
 }
 
-static void jpeg_update_irq(JpegState *s)
-{
-    qemu_set_irq(s->irq, !!(s->reg_inten & s->reg_intsts));
-}
-
 static void jpeg_command(JpegState *s)
 {
     unsigned int i;
     int ch_en = 0;
+
+    if (s->decode) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: command issued while decoding\n", __func__);
+        return;
+    }
+
     for (i = 0; i < NUM_CHANNELS; i++) {
         if (s->channels[i].ctrl & 1) {
             ch_en |= (1 << i);
@@ -257,20 +623,18 @@ static void jpeg_command(JpegState *s)
     }
 
     if (ch_en == 2 && s->channels[1].ctrl == 0x21) {
+        int64_t start = bionz_stats_start();
+        trace_bionz_jpeg_fill(s->channels[1].addr, s->channels[1].num_cpy, s->channels[1].num_repeat + 1);
         jpeg_fill(s, &s->channels[1]);
+        bionz_stats_end(&s->stats, start, (uint64_t) s->channels[1].num_cpy * (s->channels[1].num_repeat + 1));
+        jpeg_finish(s, false);
     } else if (ch_en == 3) {
+        // The channels stay busy until jpeg_decompress_done
         jpeg_decompress(s, &s->channels[0], &s->channels[1]);
     } else {
-        hw_error("%s: Unsupported command\n", __func__);
+        bionz_error(OBJECT(s), "Unsupported command: channels 0x%x, ctrl 0x%x", ch_en, s->channels[1].ctrl);
+        jpeg_finish(s, true);
     }
-
-    for (i = 0; i < NUM_CHANNELS; i++) {
-        if (s->channels[i].ctrl & 1) {
-            s->reg_intsts |= 1 << (i * 4);
-            s->channels[i].ctrl &= ~1;
-        }
-    }
-    jpeg_update_irq(s);
 }
 
 static uint64_t jpeg_ch_read(JpegState *s, unsigned int ch, hwaddr offset, unsigned size)
@@ -480,6 +844,8 @@ static void jpeg_reset(DeviceState *dev)
     int i, j;
     JpegState *s = BIONZ_JPEG(dev);
 
+    jpeg_drain(s);
+
     s->reg_intsts = 0;
     s->reg_inten = 0;
 
@@ -509,6 +875,8 @@ static void jpeg_reset(DeviceState *dev)
 static void jpeg_realize(DeviceState *dev, Error **errp)
 {
     JpegState *s = BIONZ_JPEG(dev);
+    unsigned int i;
+    char *name;
 
     memory_region_init_io(&s->mmio[0], OBJECT(dev), &jpeg_mmio0_ops, s, TYPE_BIONZ_JPEG ".mmio0", 0x800);
     sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->mmio[0]);
@@ -517,6 +885,18 @@ static void jpeg_realize(DeviceState *dev, Error **errp)
     sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->mmio[1]);
 
     sysbus_init_irq(SYS_BUS_DEVICE(dev), &s->irq);
+
+    for (i = 0; i < JPEG_MODE_MAX; i++) {
+        name = g_strdup_printf("decode_frames_%s", jpeg_mode_names[i]);
+        object_property_add_uint64_ptr(OBJECT(dev), name, &s->decode_frames[i], OBJ_PROP_FLAG_READ);
+        g_free(name);
+        name = g_strdup_printf("decode_ns_%s", jpeg_mode_names[i]);
+        object_property_add_uint64_ptr(OBJECT(dev), name, &s->decode_ns[i], OBJ_PROP_FLAG_READ);
+        g_free(name);
+    }
+
+    s->vmstate_change = qemu_add_vm_change_state_handler(jpeg_vm_state_change, s);
+    bionz_stats_register(&s->stats, OBJECT(dev));
 }
 
 static Property jpeg_properties[] = {
@@ -524,11 +904,46 @@ static Property jpeg_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_jpeg_channel = {
+    .name = TYPE_BIONZ_JPEG ".channel",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ctrl, JpegChannel),
+        VMSTATE_UINT32(data, JpegChannel),
+        VMSTATE_UINT32(addr, JpegChannel),
+        VMSTATE_UINT32(num_cpy, JpegChannel),
+        VMSTATE_INT32(num_skip, JpegChannel),
+        VMSTATE_UINT32(num_repeat, JpegChannel),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_jpeg = {
+    .name = TYPE_BIONZ_JPEG,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(channels, JpegState, NUM_CHANNELS, 1, vmstate_jpeg_channel, JpegChannel),
+        VMSTATE_UINT32(reg_intsts, JpegState),
+        VMSTATE_UINT32(reg_inten, JpegState),
+        VMSTATE_UINT32(reg_ctrl, JpegState),
+        VMSTATE_UINT32(reg_jpeg_offset, JpegState),
+        VMSTATE_UINT32(reg_jpeg_size, JpegState),
+        VMSTATE_UINT32(reg_jpeg_width, JpegState),
+        VMSTATE_UINT32(reg_size_ctrl, JpegState),
+        VMSTATE_UINT32(reg_scale_ctrl, JpegState),
+        VMSTATE_UINT32_2DARRAY(qts, JpegState, 2, 0x10),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void jpeg_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = jpeg_realize;
     dc->reset = jpeg_reset;
+    dc->vmsd = &vmstate_jpeg;
     device_class_set_props(dc, jpeg_properties);
 }
 
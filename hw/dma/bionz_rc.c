@@ -1,14 +1,26 @@
 /* QEMU model of the Sony CXD4108 image resize engine */
 
 #include "qemu/osdep.h"
+#include "exec/address-spaces.h"
+#include "hw/arm/bionz_error.h"
+#include "hw/arm/bionz_stats.h"
 #include "hw/hw.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
+#include "qemu/bswap.h"
 #include "qemu/log.h"
+#include "qemu/units.h"
+#include "qemu/ycbcr422.h"
+#include "sysemu/dma.h"
+#include "trace.h"
 
 #define NUM_CHANNELS 4
 
+// Largest rectangle a fill writes, rows times the larger of the stride and the row size
+#define MAX_FILL_SIZE (256 * MiB)
+
 #define TYPE_BIONZ_RC "bionz_rc"
 #define BIONZ_RC(obj) OBJECT_CHECK(RcState, (obj), TYPE_BIONZ_RC)
 
@@ -36,64 +48,188 @@ typedef struct RcState {
     uint32_t reg_offset[2];
     uint32_t reg_src_dim;
     uint32_t reg_dst_dim;
+
+    BionzStats stats;
 } RcState;
 
-static void rc_fill(RcState *s, RcChannel *ch)
+// A rectangle of guest memory, either mapped directly or copied through a bounce buffer
+typedef struct RcRect {
+    hwaddr addr;
+    int64_t stride;
+    bool is_write;
+
+    uint8_t *ptr;
+    ptrdiff_t pitch;
+    void *map;
+    dma_addr_t map_len;
+} RcRect;
+
+/* Maps all rows of the rectangle in one piece, height must not be 0 */
+static bool rc_map_direct(RcRect *r, hwaddr addr, int64_t stride, size_t row_size, uint64_t height, bool is_write)
+{
+    hwaddr start = stride < 0 ? addr + stride * (int64_t) (height - 1) : addr;
+    DMADirection dir = is_write ? DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE;
+    dma_addr_t len;
+
+    r->addr = addr;
+    r->stride = stride;
+    r->is_write = is_write;
+    r->map_len = (height - 1) * ABS(stride) + row_size;
+
+    len = r->map_len;
+    r->map = dma_memory_map(&address_space_memory, start, &len, dir);
+    if (r->map && len != r->map_len) {
+        dma_memory_unmap(&address_space_memory, r->map, len, dir, 0);
+        r->map = NULL;
+    }
+    if (!r->map) {
+        return false;
+    }
+
+    r->ptr = r->map + (addr - start);
+    r->pitch = stride;
+    return true;
+}
+
+/* Maps the rectangle or copies it through a bounce buffer, returns false if that cannot be allocated */
+static bool rc_map(RcRect *r, hwaddr addr, int64_t stride, size_t row_size, unsigned int height, bool is_write)
 {
     unsigned int i;
-    uint32_t *buffer;
 
-    unsigned int count = ch->num_cpy / sizeof(uint32_t);
-    hwaddr dst = s->mem_base + ch->addr;
+    if (rc_map_direct(r, addr, stride, row_size, height, is_write)) {
+        return true;
+    }
 
-    buffer = g_new(uint32_t, count);
-    for (i = 0; i < count; i++) {
-        buffer[i] = ch->data;
+    r->pitch = row_size;
+    r->ptr = g_try_malloc((uint64_t) row_size * height);
+    if (!r->ptr) {
+        return false;
+    }
+    if (!is_write) {
+        for (i = 0; i < height; i++) {
+            cpu_physical_memory_read(addr + i * stride, r->ptr + i * r->pitch, row_size);
+        }
     }
+    return true;
+}
+
+static void rc_unmap(RcRect *r, size_t row_size, unsigned int height)
+{
+    DMADirection dir = r->is_write ? DMA_DIRECTION_FROM_DEVICE : DMA_DIRECTION_TO_DEVICE;
+    unsigned int i;
 
-    for (i = 0; i <= ch->num_repeat; i++) {
-        cpu_physical_memory_write(dst, buffer, count * sizeof(uint32_t));
-        dst += ch->num_cpy + ch->num_skip;
+    if (r->map) {
+        dma_memory_unmap(&address_space_memory, r->map, r->map_len, dir, r->is_write ? r->map_len : 0);
+    } else {
+        if (r->is_write) {
+            for (i = 0; i < height; i++) {
+                cpu_physical_memory_write(r->addr + i * r->stride, r->ptr + i * r->pitch, row_size);
+            }
+        }
+        g_free(r->ptr);
     }
+}
 
-    g_free(buffer);
+static int32_t rc_stride(RcChannel *ch)
+{
+    return ch->num_cpy + ch->num_skip;
 }
 
-static void rc_resize(RcState *s, RcChannel *src, RcChannel *dst)
+/* Returns the number of bytes written, sets error if the rectangle is too large */
+static uint64_t rc_fill(RcState *s, RcChannel *ch, bool *error)
 {
-    unsigned int x, y, dst_off, src_off;
-    uint32_t *dst_buffer, *src_buffer;
+    hwaddr addr = s->mem_base + ch->addr;
+    int64_t stride = rc_stride(ch);
+    size_t row_size = ch->num_cpy & ~(sizeof(uint32_t) - 1);
+    uint64_t height = (uint64_t) ch->num_repeat + 1;
+    uint64_t i;
+    uint8_t *row;
+    RcRect d;
+
+    if (!row_size) {
+        return 0;
+    }
+    if (height * MAX(row_size, ABS(stride)) > MAX_FILL_SIZE) {
+        bionz_error(OBJECT(s), "Invalid fill: %" PRIu64 " rows of %zu bytes, stride %" PRId64, height, row_size, stride);
+        *error = true;
+        return 0;
+    }
+
+    if (rc_map_direct(&d, addr, stride, row_size, height, true)) {
+        for (i = 0; i < row_size; i += sizeof(uint32_t)) {
+            stl_le_p(d.ptr + i, ch->data);
+        }
+        for (i = 1; i < height; i++) {
+            memmove(d.ptr + (int64_t) i * d.pitch, d.ptr, row_size);
+        }
+        dma_memory_unmap(&address_space_memory, d.map, d.map_len, DMA_DIRECTION_FROM_DEVICE, d.map_len);
+    } else {
+        // Not all in RAM, write one row after the other
+        row = g_malloc(row_size);
+        for (i = 0; i < row_size; i += sizeof(uint32_t)) {
+            stl_le_p(row + i, ch->data);
+        }
+        for (i = 0; i < height; i++) {
+            cpu_physical_memory_write(addr + i * stride, row, row_size);
+        }
+        g_free(row);
+    }
+    return height * row_size;
+}
+
+/* Returns the number of bytes read and written, sets error if the source rectangle is out of bounds */
+static uint64_t rc_resize(RcState *s, RcChannel *src, RcChannel *dst, bool *error)
+{
+    RcRect sr, dr;
+    YCbCr422Scaler sc;
 
     uint16_t dst_width = (s->reg_dst_dim >> 16) & 0x1fff;
     uint16_t dst_height = s->reg_dst_dim & 0x1fff;
     uint16_t src_width = (s->reg_src_dim >> 16) & 0x1fff;
     uint16_t src_height = s->reg_src_dim & 0x1fff;
-    int32_t src_offset_x = (sextract32(s->reg_offset[0], 0, 26) + 0x800) >> 12;
-    int32_t src_offset_y = (sextract32(s->reg_offset[1], 0, 26) + 0x800) >> 12;
+    int32_t offset_x = sextract32(s->reg_offset[0], 0, 26);
+    int32_t offset_y = sextract32(s->reg_offset[1], 0, 26);
+    int32_t src_offset_x = (offset_x + 0x800) >> 12;
+    int32_t src_offset_y = (offset_y + 0x800) >> 12;
 
     if (src_offset_y + (((dst_height - 1) * s->reg_scale[1]) >> 12) >= src_height) {
-        hw_error("%s: Invalid height\n", __func__);
+        bionz_error(OBJECT(s), "Invalid height: %u -> %u, offset 0x%x, scale 0x%x", src_height, dst_height, offset_y, s->reg_scale[1]);
+        *error = true;
+        return 0;
     }
     if ((src_offset_x / 2 + (((dst_width / 2 - 1) * s->reg_scale[0]) >> 12)) * 2 + 1 >= src_width) {
-        hw_error("%s: Invalid width\n", __func__);
+        bionz_error(OBJECT(s), "Invalid width: %u -> %u, offset 0x%x, scale 0x%x", src_width, dst_width, offset_x, s->reg_scale[0]);
+        *error = true;
+        return 0;
     }
 
-    dst_buffer = g_new(uint32_t, dst_width / 2);
-    src_buffer = g_new(uint32_t, src_width / 2);
-
-    for (y = 0; y < dst_height; y++) {
-        dst_off = y * (dst->num_cpy + dst->num_skip);
-        src_off = (src_offset_y + ((y * s->reg_scale[1]) >> 12)) * (src->num_cpy + src->num_skip);
+    dst_width &= ~1;
+    src_width &= ~1;
+    if (!dst_width || !dst_height || !src_width || !src_height) {
+        return 0;
+    }
+    trace_bionz_rc_resize(src_width, src_height, dst_width, dst_height, s->reg_scale[0], s->reg_scale[1]);
 
-        cpu_physical_memory_read(s->mem_base + src->addr + src_off, src_buffer, src_width / 2 * sizeof(uint32_t));
-        for (x = 0; x < dst_width / 2; x++) {
-            dst_buffer[x] = src_buffer[src_offset_x / 2 + ((x * s->reg_scale[0]) >> 12)];
-        }
-        cpu_physical_memory_write(s->mem_base + dst->addr + dst_off, dst_buffer, dst_width / 2 * sizeof(uint32_t));
+    // The filter taps can reach any source row, map the whole source image once
+    if (!rc_map(&sr, s->mem_base + src->addr, rc_stride(src), src_width * 2, src_height, false)) {
+        bionz_error(OBJECT(s), "Cannot allocate the source rectangle: %ux%u", src_width, src_height);
+        *error = true;
+        return 0;
+    }
+    if (!rc_map(&dr, s->mem_base + dst->addr, rc_stride(dst), dst_width * 2, dst_height, true)) {
+        bionz_error(OBJECT(s), "Cannot allocate the destination rectangle: %ux%u", dst_width, dst_height);
+        rc_unmap(&sr, src_width * 2, src_height);
+        *error = true;
+        return 0;
     }
 
-    g_free(dst_buffer);
-    g_free(src_buffer);
+    ycbcr422_scaler_init(&sc, src_width, src_height, dst_width, dst_height, offset_x, offset_y, s->reg_scale[0], s->reg_scale[1]);
+    ycbcr422_scale(&sc, dr.ptr, dr.pitch, sr.ptr, sr.pitch);
+    ycbcr422_scaler_destroy(&sc);
+
+    rc_unmap(&dr, dst_width * 2, dst_height);
+    rc_unmap(&sr, src_width * 2, src_height);
+    return (uint64_t) src_width * src_height * 2 + (uint64_t) dst_width * dst_height * 2;
 }
 
 static void rc_update_irq(RcState *s)
@@ -104,34 +240,53 @@ static void rc_update_irq(RcState *s)
 static void rc_command(RcState *s)
 {
     unsigned int i;
+    RcChannel *src;
+    uint64_t bytes = 0;
+    int64_t start = bionz_stats_start();
+    bool error = false;
     int ch_en = 0;
     for (i = 0; i < NUM_CHANNELS; i++) {
         if (s->channels[i].ctrl & 1) {
             ch_en |= (1 << i);
         }
     }
-
-    if (ch_en == 0b0010 && s->channels[1].ctrl == 0x21) {
-        rc_fill(s, &s->channels[1]);
-    } else if (ch_en == 0b1000 && s->channels[3].ctrl == 0x21) {
-        rc_fill(s, &s->channels[3]);
-    } else if (ch_en == 0b0011) {
-        rc_resize(s, &s->channels[0], &s->channels[1]);
-    } else if (ch_en == 0b1001) {
-        rc_resize(s, &s->channels[0], &s->channels[3]);
-    } else if (ch_en == 0b1100) {
-        rc_resize(s, &s->channels[2], &s->channels[3]);
+    trace_bionz_rc_command(ch_en);
+
+    // Channels 0 and 2 are sources, 1 and 3 destinations. A fill only enables its destination.
+    src = ch_en & 0b0001 ? &s->channels[0] : ch_en & 0b0100 ? &s->channels[2] : NULL;
+    if ((ch_en & 0b0101) == 0b0101) {
+        bionz_error(OBJECT(s), "Unsupported command: channels 0x%x", ch_en);
+        error = true;
+    } else if (!(ch_en & 0b1010)) {
+        bionz_error(OBJECT(s), "No destination channel: channels 0x%x", ch_en);
+        error = true;
     } else {
-        hw_error("%s: Unsupported command\n", __func__);
+        for (i = 1; i < NUM_CHANNELS; i += 2) {
+            if (!(ch_en & (1 << i))) {
+                continue;
+            }
+            if (src) {
+                bytes += rc_resize(s, src, &s->channels[i], &error);
+            } else if (s->channels[i].ctrl == 0x21) {
+                bytes += rc_fill(s, &s->channels[i], &error);
+            } else {
+                bionz_error(OBJECT(s), "Unsupported command: channel %d ctrl 0x%x", i, s->channels[i].ctrl);
+                error = true;
+            }
+        }
     }
 
+    // Failed commands also set the (model specific) error bit next to the done bit
     for (i = 0; i < NUM_CHANNELS; i++) {
         if (s->channels[i].ctrl & 1) {
-            s->reg_intsts |= 1 << (i * 4);
+            s->reg_intsts |= (error ? 3 : 1) << (i * 4);
             s->channels[i].ctrl &= ~1;
         }
     }
     rc_update_irq(s);
+
+    trace_bionz_rc_complete(ch_en, bytes);
+    bionz_stats_end(&s->stats, start, bytes);
 }
 
 static uint64_t rc_ch_read(RcState *s, unsigned int ch, hwaddr offset, unsigned size)
@@ -360,6 +515,8 @@ static void rc_realize(DeviceState *dev, Error **errp)
     sysbus_init_mmio(SYS_BUS_DEVICE(dev), &s->mmio[1]);
 
     sysbus_init_irq(SYS_BUS_DEVICE(dev), &s->irq);
+
+    bionz_stats_register(&s->stats, OBJECT(dev));
 }
 
 static Property rc_properties[] = {
@@ -367,11 +524,43 @@ static Property rc_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_rc_channel = {
+    .name = TYPE_BIONZ_RC ".channel",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ctrl, RcChannel),
+        VMSTATE_UINT32(data, RcChannel),
+        VMSTATE_UINT32(addr, RcChannel),
+        VMSTATE_UINT32(num_cpy, RcChannel),
+        VMSTATE_INT32(num_skip, RcChannel),
+        VMSTATE_UINT32(num_repeat, RcChannel),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_rc = {
+    .name = TYPE_BIONZ_RC,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(channels, RcState, NUM_CHANNELS, 1, vmstate_rc_channel, RcChannel),
+        VMSTATE_UINT32(reg_intsts, RcState),
+        VMSTATE_UINT32(reg_inten, RcState),
+        VMSTATE_UINT32_ARRAY(reg_scale, RcState, 2),
+        VMSTATE_UINT32_ARRAY(reg_offset, RcState, 2),
+        VMSTATE_UINT32(reg_src_dim, RcState),
+        VMSTATE_UINT32(reg_dst_dim, RcState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void rc_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = rc_realize;
     dc->reset = rc_reset;
+    dc->vmsd = &vmstate_rc;
     device_class_set_props(dc, rc_properties);
 }
 
@@ -6,6 +6,7 @@
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 
 #define GPIO_V1_DIR     0x00
 #define GPIO_V1_RDATA   0x04
@@ -289,11 +290,25 @@ static Property gpio_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_gpio = {
+    .name = TYPE_BIONZ_GPIO,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(reg_dir, GpioState),
+        VMSTATE_UINT32(reg_wdata, GpioState),
+        VMSTATE_UINT32(reg_inen, GpioState),
+        VMSTATE_UINT32(rdata, GpioState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void gpio_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = gpio_realize;
     dc->reset = gpio_reset;
+    dc->vmsd = &vmstate_gpio;
     device_class_set_props(dc, gpio_properties);
 }
 
@@ -4,6 +4,7 @@
 #include "qemu/log.h"
 #include "hw/irq.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 
 #define GPIO_DIR     0x00
 #define GPIO_RDATA   0x04
@@ -194,11 +195,30 @@ static void gpiosys_realize(DeviceState *dev, Error **errp)
     }
 }
 
+static const VMStateDescription vmstate_gpiosys = {
+    .name = TYPE_BIONZ_GPIOSYS,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(reg_dir, GpiosysState),
+        VMSTATE_UINT16(reg_wdata, GpiosysState),
+        VMSTATE_UINT16(reg_intls, GpiosysState),
+        VMSTATE_UINT16(reg_inthe, GpiosysState),
+        VMSTATE_UINT16(reg_intle, GpiosysState),
+        VMSTATE_UINT16(reg_inten, GpiosysState),
+        VMSTATE_UINT16(reg_inen, GpiosysState),
+        VMSTATE_UINT16(rdata, GpiosysState),
+        VMSTATE_UINT16(intst, GpiosysState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void gpiosys_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = gpiosys_realize;
     dc->reset = gpiosys_reset;
+    dc->vmsd = &vmstate_gpiosys;
 }
 
 static const TypeInfo gpiosys_info = {
@@ -1,4 +1,5 @@
 /* QEMU model of the Sony interrupt controller */
+// One device can serve several cores: the input lines are shared, each target has its own registers and outputs
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
@@ -6,6 +7,7 @@
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "sysemu/sysemu.h"
 
 #define IRQ_STATUS       0x00
@@ -28,74 +30,110 @@
 #define CH_SOFTINT_SET   0x10
 #define CH_SOFTINT_CLEAR 0x14
 
+#define INTC_NUM_CHANNELS 32
+#define INTC_MAX_TARGETS 4
+
 #define TYPE_BIONZ_INTC "bionz_intc"
 #define BIONZ_INTC(obj) OBJECT_CHECK(IntcState, (obj), TYPE_BIONZ_INTC)
 
-typedef struct IntcState {
-    SysBusDevice parent_obj;
+typedef struct IntcState IntcState;
+
+typedef struct IntcTarget {
+    IntcState *intc;
     MemoryRegion mmio;
     qemu_irq irq;
     qemu_irq fiq;
+    bool irq_level;
+    bool fiq_level;
 
-    uint32_t num_enabled_channels;
-    uint8_t *enabled_channels;
+    // Channels with an enabled pending line, kept up to date on every change instead of rescanning all channels
+    uint32_t ch_pending;
 
-    uint32_t reg_status;
     uint32_t reg_select;
     uint32_t reg_enable;
     uint32_t reg_softint;
 
-    uint16_t ch_status[32];
-    uint16_t ch_enable[32];
-    uint16_t ch_softint[32];
-} IntcState;
+    uint16_t ch_enable[INTC_NUM_CHANNELS];
+    uint16_t ch_softint[INTC_NUM_CHANNELS];
+} IntcTarget;
+
+struct IntcState {
+    SysBusDevice parent_obj;
 
-static void intc_update(IntcState *s)
+    uint32_t num_targets;
+    uint32_t num_enabled_channels;
+    uint8_t *enabled_channels;
+
+    uint16_t ch_status[INTC_NUM_CHANNELS];
+
+    IntcTarget targets[INTC_MAX_TARGETS];
+};
+
+static uint32_t intc_status(IntcTarget *t)
 {
-    int i;
+    return t->ch_pending | t->reg_softint;
+}
 
-    s->reg_status = s->reg_softint;
-    for (i = 0; i < 32; i++) {
-        if ((s->ch_status[i] | s->ch_softint[i]) & s->ch_enable[i]) {
-            s->reg_status |= (1 << i);
-        }
+// Only changed output levels are forwarded to the core
+static void intc_update(IntcTarget *t)
+{
+    uint32_t active = intc_status(t) & t->reg_enable;
+    bool irq = active & ~t->reg_select;
+    bool fiq = active & t->reg_select;
+
+    if (irq != t->irq_level) {
+        t->irq_level = irq;
+        qemu_set_irq(t->irq, irq);
+    }
+    if (fiq != t->fiq_level) {
+        t->fiq_level = fiq;
+        qemu_set_irq(t->fiq, fiq);
     }
+}
+
+static bool intc_ch_pending(IntcTarget *t, unsigned ch)
+{
+    return (t->intc->ch_status[ch] | t->ch_softint[ch]) & t->ch_enable[ch];
+}
 
-    qemu_set_irq(s->irq, s->reg_status & s->reg_enable & ~s->reg_select);
-    qemu_set_irq(s->fiq, s->reg_status & s->reg_enable & s->reg_select);
+static void intc_update_channel(IntcTarget *t, unsigned ch)
+{
+    t->ch_pending = deposit32(t->ch_pending, ch, 1, intc_ch_pending(t, ch));
+    intc_update(t);
 }
 
 static void intc_irq_handler(void *opaque, int irq, int level)
 {
-    unsigned ch;
     IntcState *s = BIONZ_INTC(opaque);
+    unsigned ch = irq >> 4;
+    uint16_t status;
+    int i;
 
-    ch = irq >> 4;
-    irq &= 0xf;
-
-    if (level) {
-        s->ch_status[ch] |= (1 << irq);
-    } else {
-        s->ch_status[ch] &= ~(1 << irq);
+    status = level ? s->ch_status[ch] | (1 << (irq & 0xf)) : s->ch_status[ch] & ~(1 << (irq & 0xf));
+    if (status == s->ch_status[ch]) {
+        return;
     }
+    s->ch_status[ch] = status;
 
-    intc_update(s);
+    for (i = 0; i < s->num_targets; i++) {
+        intc_update_channel(&s->targets[i], ch);
+    }
 }
 
-static uint64_t intc_ch_read(IntcState *s, unsigned ch, hwaddr offset, unsigned size)
+static uint64_t intc_ch_read(IntcTarget *t, unsigned ch, hwaddr offset, unsigned size)
 {
     switch (offset) {
         case CH_RAW_STATUS:
-            return s->ch_status[ch] | s->ch_softint[ch];
+            return t->intc->ch_status[ch] | t->ch_softint[ch];
 
         case CH_STATUS:
-            return (s->ch_status[ch] | s->ch_softint[ch]) & s->ch_enable[ch];
+            return (t->intc->ch_status[ch] | t->ch_softint[ch]) & t->ch_enable[ch];
 
         case CH_ENABLE:
-            return s->ch_enable[ch];
+            return t->ch_enable[ch];
 
         case CH_SOFTINT:
-            return s->ch_softint[ch];
+            return t->ch_softint[ch];
 
         default:
             qemu_log_mask(LOG_UNIMP, "%s: unimplemented channel read @ 0x%" HWADDR_PRIx "\n", __func__, offset);
@@ -103,27 +141,27 @@ static uint64_t intc_ch_read(IntcState *s, unsigned ch, hwaddr offset, unsigned
     }
 }
 
-static void intc_ch_write(IntcState *s, unsigned ch, hwaddr offset, uint64_t value, unsigned size)
+static void intc_ch_write(IntcTarget *t, unsigned ch, hwaddr offset, uint64_t value, unsigned size)
 {
     switch (offset) {
         case CH_ENABLE_SET:
-            s->ch_enable[ch] |= value;
-            intc_update(s);
+            t->ch_enable[ch] |= value;
+            intc_update_channel(t, ch);
             break;
 
         case CH_ENABLE_CLEAR:
-            s->ch_enable[ch] &= ~value;
-            intc_update(s);
+            t->ch_enable[ch] &= ~value;
+            intc_update_channel(t, ch);
             break;
 
         case CH_SOFTINT_SET:
-            s->ch_softint[ch] |= value;
-            intc_update(s);
+            t->ch_softint[ch] |= value;
+            intc_update_channel(t, ch);
             break;
 
         case CH_SOFTINT_CLEAR:
-            s->ch_softint[ch] &= ~value;
-            intc_update(s);
+            t->ch_softint[ch] &= ~value;
+            intc_update_channel(t, ch);
             break;
 
         default:
@@ -133,30 +171,30 @@ static void intc_ch_write(IntcState *s, unsigned ch, hwaddr offset, uint64_t val
 
 static uint64_t intc_read(void *opaque, hwaddr offset, unsigned size)
 {
-    IntcState *s = BIONZ_INTC(opaque);
+    IntcTarget *t = opaque;
 
     if (offset >= 0x100 && offset <= 0x500) {
         offset -= 0x100;
-        return intc_ch_read(s, offset >> 5, offset & 0x1f, size);
+        return intc_ch_read(t, offset >> 5, offset & 0x1f, size);
     } else {
         switch (offset) {
             case IRQ_STATUS:
-                return s->reg_status & s->reg_enable & ~s->reg_select;
+                return intc_status(t) & t->reg_enable & ~t->reg_select;
 
             case FIQ_STATUS:
-                return s->reg_status & s->reg_enable & s->reg_select;
+                return intc_status(t) & t->reg_enable & t->reg_select;
 
             case IRQ_RAW_STATUS:
-                return s->reg_status;
+                return intc_status(t);
 
             case IRQ_SELECT:
-                return s->reg_select;
+                return t->reg_select;
 
             case IRQ_ENABLE:
-                return s->reg_enable;
+                return t->reg_enable;
 
             case INT_SOFT:
-                return s->reg_softint;
+                return t->reg_softint;
 
             default:
                 qemu_log_mask(LOG_UNIMP, "%s: unimplemented read @ 0x%" HWADDR_PRIx "\n", __func__, offset);
@@ -167,36 +205,36 @@ static uint64_t intc_read(void *opaque, hwaddr offset, unsigned size)
 
 static void intc_write(void *opaque, hwaddr offset, uint64_t value, unsigned size)
 {
-    IntcState *s = BIONZ_INTC(opaque);
+    IntcTarget *t = opaque;
 
     if (offset >= 0x100 && offset <= 0x500) {
         offset -= 0x100;
-        intc_ch_write(s, offset >> 5, offset & 0x1f, value, size);
+        intc_ch_write(t, offset >> 5, offset & 0x1f, value, size);
     } else if (size == 4) {
         switch (offset) {
             case IRQ_SELECT:
-                s->reg_select = value;
-                intc_update(s);
+                t->reg_select = value;
+                intc_update(t);
                 break;
 
             case IRQ_ENABLE_SET:
-                s->reg_enable |= value;
-                intc_update(s);
+                t->reg_enable |= value;
+                intc_update(t);
                 break;
 
             case IRQ_ENABLE_CLEAR:
-                s->reg_enable &= ~value;
-                intc_update(s);
+                t->reg_enable &= ~value;
+                intc_update(t);
                 break;
 
             case INT_SOFT_SET:
-                s->reg_softint |= value;
-                intc_update(s);
+                t->reg_softint |= value;
+                intc_update(t);
                 break;
 
             case INT_SOFT_CLEAR:
-                s->reg_softint &= ~value;
-                intc_update(s);
+                t->reg_softint &= ~value;
+                intc_update(t);
                 break;
 
             default:
@@ -217,22 +255,31 @@ static const struct MemoryRegionOps intc_ops = {
 
 static void intc_reset(DeviceState *dev)
 {
-    int i;
     IntcState *s = BIONZ_INTC(dev);
+    IntcTarget *t;
+    int i, j;
 
-    s->reg_status = 0;
-    s->reg_select = 0;
-    s->reg_enable = 0;
-    s->reg_softint = 0;
-
-    for (i = 0; i < 32; i++) {
+    for (i = 0; i < INTC_NUM_CHANNELS; i++) {
         s->ch_status[i] = 0;
-        s->ch_enable[i] = 0;
-        s->ch_softint[i] = 0;
     }
-    for (i = 0; i < s->num_enabled_channels; i++) {
-        assert(s->enabled_channels[i] < 32);
-        s->ch_enable[s->enabled_channels[i]] = 0xffff;
+
+    for (i = 0; i < s->num_targets; i++) {
+        t = &s->targets[i];
+        t->ch_pending = 0;
+        t->reg_select = 0;
+        t->reg_enable = 0;
+        t->reg_softint = 0;
+
+        for (j = 0; j < INTC_NUM_CHANNELS; j++) {
+            t->ch_enable[j] = 0;
+            t->ch_softint[j] = 0;
+        }
+        for (j = 0; j < s->num_enabled_channels; j++) {
+            assert(s->enabled_channels[j] < INTC_NUM_CHANNELS);
+            t->ch_enable[s->enabled_channels[j]] = 0xffff;
+        }
+
+        intc_update(t);
     }
 }
 
@@ -240,26 +287,94 @@ static void intc_realize(DeviceState *dev, Error **errp)
 {
     SysBusDevice *sbd = SYS_BUS_DEVICE(dev);
     IntcState *s = BIONZ_INTC(dev);
+    IntcTarget *t;
+    char *name;
+    int i;
+
+    if (s->num_targets < 1 || s->num_targets > INTC_MAX_TARGETS) {
+        error_setg(errp, "num-targets must be between 1 and %d", INTC_MAX_TARGETS);
+        return;
+    }
 
-    memory_region_init_io(&s->mmio, OBJECT(dev), &intc_ops, s, TYPE_BIONZ_INTC, 0x500);
-    sysbus_init_mmio(sbd, &s->mmio);
+    // mmio region i and the irq/fiq pair 2i/2i+1 belong to target i
+    for (i = 0; i < s->num_targets; i++) {
+        t = &s->targets[i];
+        t->intc = s;
+
+        name = g_strdup_printf(TYPE_BIONZ_INTC ".%d", i);
+        memory_region_init_io(&t->mmio, OBJECT(dev), &intc_ops, t, name, 0x500);
+        g_free(name);
+        sysbus_init_mmio(sbd, &t->mmio);
+
+        sysbus_init_irq(sbd, &t->irq);
+        sysbus_init_irq(sbd, &t->fiq);
+    }
 
-    qdev_init_gpio_in(dev, intc_irq_handler, 32 * 16);
-    sysbus_init_irq(sbd, &s->irq);
-    sysbus_init_irq(sbd, &s->fiq);
+    qdev_init_gpio_in(dev, intc_irq_handler, INTC_NUM_CHANNELS * 16);
 }
 
 static Property intc_properties[] = {
+    DEFINE_PROP_UINT32("num-targets", IntcState, num_targets, 1),
     DEFINE_PROP_ARRAY("enabled-channels", IntcState, num_enabled_channels, enabled_channels, qdev_prop_uint8, uint8_t),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+// The pending summary and output levels are derived state, the core restores its own input levels
+static int intc_post_load(void *opaque, int version_id)
+{
+    IntcState *s = BIONZ_INTC(opaque);
+    IntcTarget *t;
+    uint32_t active;
+    int i, ch;
+
+    for (i = 0; i < s->num_targets; i++) {
+        t = &s->targets[i];
+        t->ch_pending = 0;
+        for (ch = 0; ch < INTC_NUM_CHANNELS; ch++) {
+            t->ch_pending = deposit32(t->ch_pending, ch, 1, intc_ch_pending(t, ch));
+        }
+
+        active = intc_status(t) & t->reg_enable;
+        t->irq_level = active & ~t->reg_select;
+        t->fiq_level = active & t->reg_select;
+    }
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_intc_target = {
+    .name = TYPE_BIONZ_INTC ".target",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(reg_select, IntcTarget),
+        VMSTATE_UINT32(reg_enable, IntcTarget),
+        VMSTATE_UINT32(reg_softint, IntcTarget),
+        VMSTATE_UINT16_ARRAY(ch_enable, IntcTarget, INTC_NUM_CHANNELS),
+        VMSTATE_UINT16_ARRAY(ch_softint, IntcTarget, INTC_NUM_CHANNELS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_intc = {
+    .name = TYPE_BIONZ_INTC,
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .post_load = intc_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16_ARRAY(ch_status, IntcState, INTC_NUM_CHANNELS),
+        VMSTATE_STRUCT_VARRAY_UINT32(targets, IntcState, num_targets, 1, vmstate_intc_target, IntcTarget),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void intc_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = intc_realize;
     device_class_set_props(dc, intc_properties);
     dc->reset = intc_reset;
+    dc->vmsd = &vmstate_intc;
 }
 
 static const TypeInfo intc_info = {
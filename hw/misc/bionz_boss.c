@@ -2,13 +2,16 @@
 
 #include "qemu/osdep.h"
 #include "exec/address-spaces.h"
+#include "hw/arm/bionz_stats.h"
 #include "hw/irq.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
 #include "qemu/log.h"
 #include "sysemu/cpus.h"
 #include "target/arm/arm-powerctl.h"
 #include "target/arm/cpu.h"
+#include "trace.h"
 
 #define BOSS_CPUID 0xB055
 #define BOSS_SRAM_BASE 0x00000000
@@ -38,6 +41,10 @@ typedef struct BossState {
     uint32_t enable;
     uint32_t irq_int_status;
     uint32_t irq_ext_status;
+
+    // Doorbell to reply round trips
+    int64_t doorbell_start;
+    BionzStats stats;
 } BossState;
 
 typedef struct BossCPUClass {
@@ -51,6 +58,44 @@ static void boss_update_irq(BossState *s)
     qemu_set_irq(s->irq_ext, s->irq_ext_status);
 }
 
+/*
+ * The boss is stopped between requests. Resume it without going through
+ * qemu_cpu_kick(), which under round-robin TCG makes every vCPU leave its
+ * time slice and costs an extra scheduler pass before the boss gets to run.
+ */
+static void boss_wakeup(BossState *s)
+{
+    CPUState *cs = CPU(&s->cpu);
+    bool resumed = cs->stop || cs->stopped;
+
+    cs->stop = false;
+    cs->stopped = false;
+
+    if (!qemu_tcg_mttcg_enabled() && current_cpu && current_cpu != cs) {
+        // End the time slice of the ringing vCPU, the boss is next in line
+        cpu_exit(current_cpu);
+    } else {
+        qemu_cpu_kick(cs);
+    }
+
+    s->doorbell_start = bionz_stats_start();
+    trace_bionz_boss_doorbell(resumed);
+}
+
+// The reply stops the boss until the next doorbell, the ringing vCPU takes over right away
+static void boss_reply(BossState *s)
+{
+    if (current_cpu == CPU(&s->cpu)) {
+        cpu_stop_current();
+    }
+
+    if (s->doorbell_start) {
+        trace_bionz_boss_reply(get_clock() - s->doorbell_start);
+        bionz_stats_end(&s->stats, s->doorbell_start, 0);
+        s->doorbell_start = 0;
+    }
+}
+
 static uint64_t boss_io_read(void *opaque, hwaddr offset, unsigned size)
 {
     BossState *s = BIONZ_BOSS(opaque);
@@ -76,8 +121,8 @@ static void boss_io_write(void *opaque, hwaddr offset, uint64_t value, unsigned
         case 0x00:
             s->irq_ext_status = value & 1;
             boss_update_irq(s);
-            if ((value & 1) && current_cpu == CPU(&s->cpu)) {
-                cpu_stop_current();
+            if (value & 1) {
+                boss_reply(s);
             }
             break;
 
@@ -89,7 +134,7 @@ static void boss_io_write(void *opaque, hwaddr offset, uint64_t value, unsigned
             }
             boss_update_irq(s);
             if (value & 1) {
-                cpu_resume(CPU(&s->cpu));
+                boss_wakeup(s);
             }
             break;
 
@@ -205,6 +250,7 @@ static void boss_reset(DeviceState *dev)
     s->enable = 0;
     s->irq_int_status = 0;
     s->irq_ext_status = 0;
+    s->doorbell_start = 0;
 }
 
 static void boss_irq_nand_handler(void *opaque, int irq, int level)
@@ -248,6 +294,8 @@ static void boss_realize(DeviceState *dev, Error **errp)
 
     qdev_init_gpio_in(dev, boss_irq_nand_handler, 1);
     sysbus_init_irq(sbd, &s->irq_ext);
+
+    bionz_stats_register(&s->stats, OBJECT(dev));
 }
 
 static void boss_cpu_reset(DeviceState *dev)
@@ -281,11 +329,24 @@ static void boss_cpu_register_type(void)
 
 type_init(boss_cpu_register_type)
 
+static const VMStateDescription vmstate_boss = {
+    .name = TYPE_BIONZ_BOSS,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(enable, BossState),
+        VMSTATE_UINT32(irq_int_status, BossState),
+        VMSTATE_UINT32(irq_ext_status, BossState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void boss_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = boss_realize;
     dc->reset = boss_reset;
+    dc->vmsd = &vmstate_boss;
 }
 
 static const TypeInfo boss_info = {
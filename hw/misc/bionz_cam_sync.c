@@ -2,6 +2,7 @@
 
 #include "qemu/osdep.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
 
 #define TYPE_BIONZ_CAM_SYNC "bionz_cam_sync"
@@ -67,11 +68,22 @@ static void cam_sync_realize(DeviceState *dev, Error **errp)
     sysbus_init_mmio(sbd, &s->mmio);
 }
 
+static const VMStateDescription vmstate_cam_sync = {
+    .name = TYPE_BIONZ_CAM_SYNC,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(value, CamSyncState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void cam_sync_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = cam_sync_realize;
     dc->reset = cam_sync_reset;
+    dc->vmsd = &vmstate_cam_sync;
 }
 
 static const TypeInfo cam_sync_info = {
@@ -1,10 +1,16 @@
 /* QEMU model of the Sony hardware lz77 decompressor (ldec) */
 
 #include "qemu/osdep.h"
+#include "hw/arm/bionz_error.h"
+#include "hw/arm/bionz_stats.h"
 #include "hw/hw.h"
+#include "hw/irq.h"
 #include "hw/sysbus.h"
+#include "hw/dma/bionz_dma.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
 #include "qemu/lz77.h"
+#include "trace.h"
 
 #define LDEC_CTRL     0x00
 #define LDEC_MODE     0x04
@@ -17,6 +23,10 @@
 
 #define LDEC_CTRL_ENABLE (1 << 1)
 
+// Input written through the fifo register while the decoder cannot take it. PIO writers push a
+// whole compressed block before reading its output, a raw block with its header must fit behind a full ring.
+#define LDEC_FIFO_SIZE (2 * LZ77_BLOCK_SIZE)
+
 #define TYPE_BIONZ_LDEC "bionz_ldec"
 #define BIONZ_LDEC(obj) OBJECT_CHECK(LdecState, (obj), TYPE_BIONZ_LDEC)
 
@@ -25,62 +35,73 @@ typedef struct LdecState {
     MemoryRegion container;
     MemoryRegion mmio;
     MemoryRegion fifo;
+    qemu_irq dma_request[2];
 
     uint32_t reg_ctrl;
 
-    unsigned char *input_buf;
-    size_t input_buf_size;
-    size_t input_size;
+    LZ77Stream stream;
+
+    uint8_t input_buf[LDEC_FIFO_SIZE];
+    uint32_t input_off;
+    uint32_t input_size;
 
-    unsigned char *output_buf;
-    size_t output_off;
-    size_t output_size;
+    BionzStats stats;
 } LdecState;
 
+// The decoder only stops taking input when its output ring is full
+static bool ldec_input_ready(LdecState *s)
+{
+    return s->input_off == s->input_size && lz77_stream_avail(&s->stream) < LZ77_WINDOW_SIZE;
+}
+
+// Request lines for the input and output fifo
+static void ldec_update_request(LdecState *s)
+{
+    bool enable = s->reg_ctrl & LDEC_CTRL_ENABLE;
+
+    qemu_set_irq(s->dma_request[0], enable && ldec_input_ready(s));
+    qemu_set_irq(s->dma_request[1], enable && lz77_stream_avail(&s->stream));
+}
+
 static void ldec_reset(DeviceState *dev)
 {
     LdecState *s = BIONZ_LDEC(dev);
 
     s->reg_ctrl = 0;
 
-    if (s->input_buf) {
-        g_free(s->input_buf);
-        s->input_buf = NULL;
-    }
-    s->input_buf_size = 0;
+    s->input_off = 0;
     s->input_size = 0;
 
-    if (s->output_buf) {
-        g_free(s->output_buf);
-        s->output_buf = NULL;
+    lz77_stream_init(&s->stream);
+    ldec_update_request(s);
+}
+
+// Returns the number of bytes the decoder consumed
+static size_t ldec_decode(LdecState *s, const uint8_t *buf, size_t len)
+{
+    int res = lz77_stream_write(&s->stream, buf, MIN(len, INT_MAX));
+
+    if (res < 0) {
+        // Corrupt stream, drop the input and start over with the next block
+        bionz_error(OBJECT(s), "Invalid lz77 stream");
+        lz77_stream_init(&s->stream);
+        return len;
     }
-    s->output_off = 0;
-    s->output_size = 0;
+    return res;
 }
 
+// Continues with the input left in the fifo
 static void ldec_run(LdecState *s)
 {
-    unsigned char *src;
-    int res;
-
-    if (!s->input_size) {
+    if (s->input_off == s->input_size) {
         return;
     }
 
-    src = s->input_buf;
-    while (src < s->input_buf + s->input_size) {
-        s->output_buf = realloc(s->output_buf, s->output_size + 0x1000);
-        res = lz77_inflate(src, s->input_buf + s->input_size - src, s->output_buf + s->output_size, 0x1000, &src);
-        if (res < 0) {
-            hw_error("%s: lz77_inflate failed\n", __func__);
-        }
-        s->output_size += res;
+    s->input_off += ldec_decode(s, s->input_buf + s->input_off, s->input_size - s->input_off);
+    if (s->input_off == s->input_size) {
+        s->input_off = 0;
+        s->input_size = 0;
     }
-
-    g_free(s->input_buf);
-    s->input_buf = NULL;
-    s->input_buf_size = 0;
-    s->input_size = 0;
 }
 
 static uint64_t ldec_read(void *opaque, hwaddr offset, unsigned size)
@@ -92,8 +113,8 @@ static uint64_t ldec_read(void *opaque, hwaddr offset, unsigned size)
             return s->reg_ctrl;
 
         case LDEC_RDCTRL:
-            if (s->output_size - s->output_off) {
-                return (((s->output_size - s->output_off) & 0x3f) << 8) + 0x10;
+            if (lz77_stream_avail(&s->stream)) {
+                return ((lz77_stream_avail(&s->stream) & 0x3f) << 8) + 0x10;
             }
             return 0;
 
@@ -109,10 +130,12 @@ static void ldec_write(void *opaque, hwaddr offset, uint64_t value, unsigned siz
 
     switch (offset) {
         case LDEC_CTRL:
+            trace_bionz_ldec_ctrl(value);
             s->reg_ctrl = value;
             if (!(value & LDEC_CTRL_ENABLE)) {
                 ldec_reset(DEVICE(s));
             }
+            ldec_update_request(s);
             break;
 
         default:
@@ -131,19 +154,19 @@ static const struct MemoryRegionOps ldec_ops = {
 static uint64_t ldec_fifo_read(void *opaque, hwaddr offset, unsigned size)
 {
     uint64_t value;
-    size_t sz;
     LdecState *s = BIONZ_LDEC(opaque);
 
     if (!(s->reg_ctrl & LDEC_CTRL_ENABLE)) {
-        hw_error("%s: not enabled\n", __func__);
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: not enabled\n", __func__);
+        return 0;
     }
 
-    ldec_run(s);
-
     value = 0;
-    sz = MIN(size, s->output_size - s->output_off);
-    memcpy(&value, s->output_buf + s->output_off, sz);
-    s->output_off += sz;
+    lz77_stream_read(&s->stream, (unsigned char *) &value, size);
+
+    // Space was freed in the output ring, continue with the pending input
+    ldec_run(s);
+    ldec_update_request(s);
 
     return value;
 }
@@ -151,18 +174,33 @@ static uint64_t ldec_fifo_read(void *opaque, hwaddr offset, unsigned size)
 static void ldec_fifo_write(void *opaque, hwaddr offset, uint64_t value, unsigned size)
 {
     LdecState *s = BIONZ_LDEC(opaque);
+    int64_t start;
 
     if (!(s->reg_ctrl & LDEC_CTRL_ENABLE)) {
-        hw_error("%s: not enabled\n", __func__);
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: not enabled\n", __func__);
+        return;
     }
 
-    if (s->input_size + size > s->input_buf_size) {
-        s->input_buf_size += 0x1000;
-        s->input_buf = g_realloc(s->input_buf, s->input_buf_size);
+    if (s->input_size + size > LDEC_FIFO_SIZE) {
+        memmove(s->input_buf, s->input_buf + s->input_off, s->input_size - s->input_off);
+        s->input_size -= s->input_off;
+        s->input_off = 0;
+    }
+    if (s->input_size + size > LDEC_FIFO_SIZE) {
+        bionz_error(OBJECT(s), "Input fifo full: %u bytes pending", s->input_size);
+        return;
     }
 
+    start = bionz_stats_start();
+
     memcpy(s->input_buf + s->input_size, &value, size);
     s->input_size += size;
+
+    ldec_run(s);
+    ldec_update_request(s);
+
+    trace_bionz_ldec_input(size, lz77_stream_avail(&s->stream));
+    bionz_stats_end(&s->stats, start, size);
 }
 
 static const struct MemoryRegionOps ldec_fifo_ops = {
@@ -173,6 +211,60 @@ static const struct MemoryRegionOps ldec_fifo_ops = {
     .valid.max_access_size = 4,
 };
 
+static size_t ldec_dma_read(BionzDmaPeripheral *obj, uint8_t *buf, size_t len)
+{
+    LdecState *s = BIONZ_LDEC(obj);
+    size_t done = 0;
+    int n;
+    int64_t start;
+
+    if (!(s->reg_ctrl & LDEC_CTRL_ENABLE)) {
+        return 0;
+    }
+
+    start = bionz_stats_start();
+
+    // Input is only left over while the output ring is full, stop once it runs empty
+    while (done < len) {
+        n = lz77_stream_read(&s->stream, buf + done, MIN(len - done, INT_MAX));
+        if (!n) {
+            break;
+        }
+        done += n;
+        ldec_run(s);
+    }
+
+    ldec_update_request(s);
+
+    trace_bionz_ldec_output(len, done);
+    bionz_stats_end(&s->stats, start, done);
+    return done;
+}
+
+// Takes only what the decoder consumes, the channel stalls until the output ring has room again
+static size_t ldec_dma_write(BionzDmaPeripheral *obj, const uint8_t *buf, size_t len)
+{
+    LdecState *s = BIONZ_LDEC(obj);
+    size_t done = 0;
+    int64_t start;
+
+    if (!(s->reg_ctrl & LDEC_CTRL_ENABLE)) {
+        return 0;
+    }
+
+    start = bionz_stats_start();
+
+    ldec_run(s);
+    if (s->input_off == s->input_size) {
+        done = ldec_decode(s, buf, len);
+    }
+    ldec_update_request(s);
+
+    trace_bionz_ldec_input(done, lz77_stream_avail(&s->stream));
+    bionz_stats_end(&s->stats, start, done);
+    return done;
+}
+
 static void ldec_realize(DeviceState *dev, Error **errp)
 {
     SysBusDevice *sbd = SYS_BUS_DEVICE(dev);
@@ -186,13 +278,67 @@ static void ldec_realize(DeviceState *dev, Error **errp)
 
     memory_region_init_io(&s->fifo, OBJECT(dev), &ldec_fifo_ops, s, TYPE_BIONZ_LDEC ".fifo", 0x4);
     memory_region_add_subregion(&s->container, 0x4000, &s->fifo);
+
+    qdev_init_gpio_out_named(dev, s->dma_request, "dma-request", 2);
+
+    bionz_stats_register(&s->stats, OBJECT(dev));
 }
 
+static int ldec_post_load(void *opaque, int version_id)
+{
+    LdecState *s = BIONZ_LDEC(opaque);
+
+    if (s->input_size > LDEC_FIFO_SIZE || s->input_off > s->input_size || !lz77_stream_valid(&s->stream)) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_lz77_stream = {
+    .name = TYPE_BIONZ_LDEC ".lz77",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BUFFER(window, LZ77Stream),
+        VMSTATE_UINT32(wpos, LZ77Stream),
+        VMSTATE_UINT32(rpos, LZ77Stream),
+        VMSTATE_UINT32(state, LZ77Stream),
+        VMSTATE_UINT32(flags, LZ77Stream),
+        VMSTATE_UINT32(items, LZ77Stream),
+        VMSTATE_UINT32(code, LZ77Stream),
+        VMSTATE_UINT32(code_len, LZ77Stream),
+        VMSTATE_UINT32(len, LZ77Stream),
+        VMSTATE_UINT32(dist, LZ77Stream),
+        VMSTATE_UINT32(block_out, LZ77Stream),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_ldec = {
+    .name = TYPE_BIONZ_LDEC,
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .post_load = ldec_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(reg_ctrl, LdecState),
+        VMSTATE_BUFFER(input_buf, LdecState),
+        VMSTATE_UINT32(input_off, LdecState),
+        VMSTATE_UINT32(input_size, LdecState),
+        VMSTATE_STRUCT(stream, LdecState, 1, vmstate_lz77_stream, LZ77Stream),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void ldec_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
+    BionzDmaPeripheralClass *dpc = BIONZ_DMA_PERIPHERAL_CLASS(klass);
     dc->realize = ldec_realize;
     dc->reset = ldec_reset;
+    dc->vmsd = &vmstate_ldec;
+    dpc->read = ldec_dma_read;
+    dpc->write = ldec_dma_write;
 }
 
 static const TypeInfo ldec_info = {
@@ -200,6 +346,10 @@ static const TypeInfo ldec_info = {
     .parent        = TYPE_SYS_BUS_DEVICE,
     .instance_size = sizeof(LdecState),
     .class_init    = ldec_class_init,
+    .interfaces    = (InterfaceInfo[]) {
+        { TYPE_BIONZ_DMA_PERIPHERAL },
+        { }
+    },
 };
 
 static void ldec_register_type(void)
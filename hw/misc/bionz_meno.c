@@ -1,14 +1,23 @@
 /* QEMU model of the Sony BIONZ onenand coprocessor (meno) */
 
 #include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "exec/address-spaces.h"
+#include "hw/arm/bionz_error.h"
+#include "hw/arm/bionz_stats.h"
 #include "hw/hw.h"
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
 #include "qemu/log.h"
 #include "qemu/lz77.h"
+#include "qemu/queue.h"
+#include "qemu/units.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/dma.h"
+#include "trace.h"
 
 #define PHYS_ADDR(addr) ((addr) - 0x10000000)
 
@@ -16,10 +25,30 @@
 #define NAND_SPARE_SIZE 0x10
 #define NAND_SECTORS_PER_BLOCK 0x100
 #define NAND_NUM_BLOCKS 0x800
+#define NAND_NUM_SECTORS (NAND_NUM_BLOCKS * NAND_SECTORS_PER_BLOCK)
 
 #define TYPE_BIONZ_MENO "bionz_meno"
 #define BIONZ_MENO(obj) OBJECT_CHECK(MenoState, (obj), TYPE_BIONZ_MENO)
 
+typedef struct MenoLzSector {
+    uint32_t block;
+    uint32_t sector;
+    uint32_t num_sector;
+} MenoLzSector;
+
+typedef struct MenoLzKey {
+    uint32_t offset;
+    uint32_t block_size;
+    MenoLzSector sectors[];
+} MenoLzKey;
+
+typedef struct MenoCacheEntry {
+    GBytes *key;
+    void *data;
+    size_t size;
+    QTAILQ_ENTRY(MenoCacheEntry) next;
+} MenoCacheEntry;
+
 typedef struct MenoState {
     SysBusDevice parent_obj;
     MemoryRegion container;
@@ -31,6 +60,16 @@ typedef struct MenoState {
 
     uint32_t csr;
     uint32_t poll_mode;
+
+    uint64_t cache_max;
+    uint64_t cache_size;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    GHashTable *cache;
+    QTAILQ_HEAD(, MenoCacheEntry) cache_lru;
+    NotifierWithReturn write_notifier;
+
+    BionzStats stats;
 } MenoState;
 
 typedef struct MenoReadArgs {
@@ -51,18 +90,130 @@ typedef struct MenoLzReadArgs {
     uint32_t buffer;
 } MenoLzReadArgs;
 
+static void meno_cache_free_entry(gpointer data)
+{
+    MenoCacheEntry *e = data;
+    g_bytes_unref(e->key);
+    g_free(e->data);
+    g_free(e);
+}
+
+static MenoCacheEntry *meno_cache_lookup(MenoState *s, GBytes *key)
+{
+    MenoCacheEntry *e = g_hash_table_lookup(s->cache, key);
+    if (e) {
+        QTAILQ_REMOVE(&s->cache_lru, e, next);
+        QTAILQ_INSERT_HEAD(&s->cache_lru, e, next);
+    }
+    return e;
+}
+
+static void meno_cache_insert(MenoState *s, GBytes *key, const void *data, size_t size)
+{
+    MenoCacheEntry *e;
+
+    if (size > s->cache_max) {
+        return;
+    }
+
+    while (s->cache_size + size > s->cache_max) {
+        e = QTAILQ_LAST(&s->cache_lru);
+        QTAILQ_REMOVE(&s->cache_lru, e, next);
+        s->cache_size -= e->size;
+        g_hash_table_remove(s->cache, e->key);
+    }
+
+    e = g_new(MenoCacheEntry, 1);
+    e->key = g_bytes_ref(key);
+    e->data = g_memdup(data, size);
+    e->size = size;
+    g_hash_table_insert(s->cache, e->key, e);
+    QTAILQ_INSERT_HEAD(&s->cache_lru, e, next);
+    s->cache_size += size;
+}
+
+// Drops the cached blocks that were inflated from sectors a NAND write overlaps
+static int meno_cache_invalidate(NotifierWithReturn *notifier, void *opaque)
+{
+    MenoState *s = container_of(notifier, MenoState, write_notifier);
+    BdrvTrackedRequest *req = opaque;
+    MenoCacheEntry *e, *tmp;
+    const MenoLzKey *lz;
+    const MenoLzSector *sec;
+    size_t key_size, i;
+    uint64_t start, end;
+
+    QTAILQ_FOREACH_SAFE(e, &s->cache_lru, next, tmp) {
+        lz = g_bytes_get_data(e->key, &key_size);
+        for (i = 0; i < (key_size - sizeof(MenoLzKey)) / sizeof(MenoLzSector); i++) {
+            sec = &lz->sectors[i];
+            start = ((uint64_t) sec->block * NAND_SECTORS_PER_BLOCK + sec->sector) * NAND_SECTOR_SIZE;
+            end = start + (uint64_t) sec->num_sector * NAND_SECTOR_SIZE;
+            if (start < req->offset + req->bytes && req->offset < end) {
+                trace_bionz_meno_cache_invalidate(req->offset, req->bytes, e->size);
+                QTAILQ_REMOVE(&s->cache_lru, e, next);
+                s->cache_size -= e->size;
+                g_hash_table_remove(s->cache, e->key);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void meno_cache_clear(MenoState *s)
+{
+    g_hash_table_remove_all(s->cache);
+    QTAILQ_INIT(&s->cache_lru);
+    s->cache_size = 0;
+}
+
 static void meno_update_irq(MenoState *s)
 {
     qemu_set_irq(s->intr, !s->poll_mode && s->csr);
 }
 
-static void meno_nand_read(MenoState *s, uint32_t args_ptr, uint32_t offset, uint32_t sector_size)
+/* Returns a negative errno if the block device cannot be read */
+static int meno_blk_read(BlockBackend *blk, uint32_t offset, hwaddr addr, uint32_t size)
+{
+    dma_addr_t len;
+    void *buffer;
+    int ret;
+
+    // Read straight into guest memory, bounce only what cannot be mapped
+    while (size) {
+        len = size;
+        buffer = dma_memory_map(&address_space_memory, addr, &len, DMA_DIRECTION_FROM_DEVICE);
+        if (buffer) {
+            ret = blk_pread(blk, offset, buffer, len);
+            dma_memory_unmap(&address_space_memory, buffer, len, DMA_DIRECTION_FROM_DEVICE, len);
+        } else {
+            len = size;
+            buffer = g_malloc(len);
+            ret = blk_pread(blk, offset, buffer, len);
+            cpu_physical_memory_write(addr, buffer, len);
+            g_free(buffer);
+        }
+
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += len;
+        addr += len;
+        size -= len;
+    }
+    return 0;
+}
+
+/* Returns the number of bytes read */
+static uint32_t meno_nand_read(MenoState *s, uint32_t args_ptr, uint32_t offset, uint32_t sector_size)
 {
     MenoReadArgs args;
     uint32_t buffer_ptr;
-    uint32_t size;
-    void *buffer;
-    int i;
+    uint32_t size, total = 0;
+    int i, ret;
     BlockBackend *blk = s->blk_name ? blk_by_name(s->blk_name) : NULL;
 
     cpu_physical_memory_read(PHYS_ADDR(args_ptr), &args, sizeof(args));
@@ -72,91 +223,175 @@ static void meno_nand_read(MenoState *s, uint32_t args_ptr, uint32_t offset, uin
         cpu_physical_memory_read(PHYS_ADDR(args.buffer_ptr + i * sizeof(buffer_ptr)), &buffer_ptr, sizeof(buffer_ptr));
         cpu_physical_memory_read(PHYS_ADDR(args.size_ptr + i * sizeof(size)), &size, sizeof(size));
 
-        buffer = g_malloc(size);
-        if (blk && blk_pread(blk, offset, buffer, size) < 0) {
-            hw_error("%s: Cannot read block device\n", __func__);
+        if (blk) {
+            ret = meno_blk_read(blk, offset, PHYS_ADDR(buffer_ptr), size);
+            if (ret < 0) {
+                bionz_error(OBJECT(s), "Cannot read block device: %s", strerror(-ret));
+                break;
+            }
         }
-        cpu_physical_memory_write(PHYS_ADDR(buffer_ptr), buffer, size);
-        g_free(buffer);
 
         offset += size;
+        total += size;
     }
+
+    return total;
 }
 
-static void meno_nand_lz_read(MenoState *s, uint32_t args_ptr)
+/* Returns the number of bytes written to the destination */
+static uint32_t meno_nand_lz_read(MenoState *s, uint32_t args_ptr)
 {
     MenoLzReadArgs args;
-    uint32_t block, sector, num_sector;
-    unsigned int src_size, dst_size, off;
+    MenoLzKey *lz;
+    MenoLzSector *sec;
+    MenoCacheEntry *e;
+    GBytes *key;
+    size_t key_size;
+    uint64_t src_size;
+    unsigned int dst_size, off;
     unsigned char *src_buffer, *dst_buffer, *src, *dst;
+    dma_addr_t len;
+    bool mapped, ok = true;
     int i, res;
     BlockBackend *blk = s->blk_name ? blk_by_name(s->blk_name) : NULL;
 
     cpu_physical_memory_read(PHYS_ADDR(args_ptr), &args, sizeof(args));
 
+    // The runs, their sizes and the block size come from the guest, a block cannot span more than the whole NAND
+    if (args.num > NAND_NUM_SECTORS || args.block_size >= 32) {
+        bionz_error(OBJECT(s), "Invalid lz77 read: %u sector runs, block size 2^%u", args.num, args.block_size);
+        return 0;
+    }
+    key_size = sizeof(MenoLzKey) + (size_t) args.num * sizeof(MenoLzSector);
+    lz = g_try_malloc(key_size);
+    if (!lz) {
+        bionz_error(OBJECT(s), "Cannot allocate %u sector runs", args.num);
+        return 0;
+    }
+    lz->offset = args.offset;
+    lz->block_size = args.block_size;
+
     src_size = 0;
     for (i = 0; i < args.num; i++) {
-        cpu_physical_memory_read(PHYS_ADDR(args.num_sector_ptr + i * sizeof(num_sector)), &num_sector, sizeof(num_sector));
-        src_size += num_sector * NAND_SECTOR_SIZE;
+        sec = &lz->sectors[i];
+        cpu_physical_memory_read(PHYS_ADDR(args.block_ptr + i * sizeof(sec->block)), &sec->block, sizeof(sec->block));
+        cpu_physical_memory_read(PHYS_ADDR(args.sector_ptr + i * sizeof(sec->sector)), &sec->sector, sizeof(sec->sector));
+        cpu_physical_memory_read(PHYS_ADDR(args.num_sector_ptr + i * sizeof(sec->num_sector)), &sec->num_sector, sizeof(sec->num_sector));
+        src_size += (uint64_t) sec->num_sector * NAND_SECTOR_SIZE;
+    }
+    if (src_size > (uint64_t) NAND_NUM_SECTORS * NAND_SECTOR_SIZE) {
+        bionz_error(OBJECT(s), "Invalid lz77 read: %" PRIu64 " bytes of sectors", src_size);
+        g_free(lz);
+        return 0;
     }
-    dst_size = 1 << args.block_size;
+    dst_size = 1u << args.block_size;
 
-    src_buffer = g_malloc(src_size);
-    dst_buffer = g_malloc(dst_size);
+    key = g_bytes_new_take(lz, key_size);
+
+    e = meno_cache_lookup(s, key);
+    trace_bionz_meno_lz_read(args.num, src_size, dst_size, !!e);
+    if (e) {
+        s->cache_hits++;
+        cpu_physical_memory_write(PHYS_ADDR(args.buffer), e->data, e->size);
+        g_bytes_unref(key);
+        return e->size;
+    }
+    s->cache_misses++;
+
+    src_buffer = g_try_malloc(src_size);
+    if (!src_buffer) {
+        bionz_error(OBJECT(s), "Cannot allocate %" PRIu64 " bytes of sectors", src_size);
+        g_bytes_unref(key);
+        return 0;
+    }
+
+    // Inflate directly into the destination if it is contiguous guest RAM
+    len = dst_size;
+    dst_buffer = dma_memory_map(&address_space_memory, PHYS_ADDR(args.buffer), &len, DMA_DIRECTION_FROM_DEVICE);
+    mapped = dst_buffer && len == dst_size;
+    if (!mapped) {
+        if (dst_buffer) {
+            dma_memory_unmap(&address_space_memory, dst_buffer, len, DMA_DIRECTION_FROM_DEVICE, 0);
+        }
+        dst_buffer = g_try_malloc0(dst_size);
+        if (!dst_buffer) {
+            bionz_error(OBJECT(s), "Cannot allocate a block of 0x%x bytes", dst_size);
+            g_free(src_buffer);
+            g_bytes_unref(key);
+            return 0;
+        }
+    }
 
     src = src_buffer;
     for (i = 0; i < args.num; i++) {
-        cpu_physical_memory_read(PHYS_ADDR(args.block_ptr + i * sizeof(block)), &block, sizeof(block));
-        cpu_physical_memory_read(PHYS_ADDR(args.sector_ptr + i * sizeof(sector)), &sector, sizeof(sector));
-        cpu_physical_memory_read(PHYS_ADDR(args.num_sector_ptr + i * sizeof(num_sector)), &num_sector, sizeof(num_sector));
-        off = (block * NAND_SECTORS_PER_BLOCK + sector) * NAND_SECTOR_SIZE;
-        if (blk && blk_pread(blk, off, src, num_sector * NAND_SECTOR_SIZE) < 0) {
-            hw_error("%s: Cannot read block device\n", __func__);
+        sec = &lz->sectors[i];
+        off = (sec->block * NAND_SECTORS_PER_BLOCK + sec->sector) * NAND_SECTOR_SIZE;
+        if (blk && blk_pread(blk, off, src, sec->num_sector * NAND_SECTOR_SIZE) < 0) {
+            bionz_error(OBJECT(s), "Cannot read block device");
+            ok = false;
+            break;
         }
-        src += num_sector * NAND_SECTOR_SIZE;
+        src += sec->num_sector * NAND_SECTOR_SIZE;
     }
 
+    // A failed block is left partially written and not cached, the command still completes
     src = src_buffer + args.offset;
     dst = dst_buffer;
-    while (src < src_buffer + src_size && dst < dst_buffer + dst_size) {
+    while (ok && src < src_buffer + src_size && dst < dst_buffer + dst_size) {
         res = lz77_inflate(src, src_buffer + src_size - src, dst, dst_buffer + dst_size - dst, &src);
         if (res < 0) {
-            hw_error("%s: lz77_inflate failed\n", __func__);
+            bionz_error(OBJECT(s), "Invalid lz77 block at 0x%x", (unsigned int) (src - src_buffer));
+            ok = false;
+            break;
         }
         dst += res;
     }
 
-    cpu_physical_memory_write(PHYS_ADDR(args.buffer), dst_buffer, dst_size);
+    if (blk && ok) {
+        meno_cache_insert(s, key, dst_buffer, dst_size);
+    }
+
+    if (mapped) {
+        dma_memory_unmap(&address_space_memory, dst_buffer, dst_size, DMA_DIRECTION_FROM_DEVICE, dst_size);
+    } else {
+        cpu_physical_memory_write(PHYS_ADDR(args.buffer), dst_buffer, dst_size);
+        g_free(dst_buffer);
+    }
 
     g_free(src_buffer);
-    g_free(dst_buffer);
+    g_bytes_unref(key);
+    return dst_size;
 }
 
 static void meno_command(MenoState *s)
 {
-    uint32_t args_ptr, action;
+    uint32_t args_ptr, action, bytes = 0;
     void *fwram = memory_region_get_ram_ptr(&s->fwram);
+    int64_t start = bionz_stats_start();
 
     cpu_physical_memory_read(PHYS_ADDR(*(uint32_t *)(fwram + 0x18d4)), &args_ptr, sizeof(args_ptr));
     cpu_physical_memory_read(PHYS_ADDR(args_ptr), &action, sizeof(action));
     args_ptr += 0x14;
 
+    trace_bionz_meno_command(action);
     switch (action) {
         case 1:
-            meno_nand_read(s, args_ptr, 0, NAND_SECTOR_SIZE);
+            bytes = meno_nand_read(s, args_ptr, 0, NAND_SECTOR_SIZE);
             break;
 
         case 2:
-            meno_nand_read(s, args_ptr, NAND_NUM_BLOCKS * NAND_SECTORS_PER_BLOCK * NAND_SECTOR_SIZE, NAND_SPARE_SIZE);
+            bytes = meno_nand_read(s, args_ptr, NAND_NUM_BLOCKS * NAND_SECTORS_PER_BLOCK * NAND_SECTOR_SIZE, NAND_SPARE_SIZE);
             break;
 
         case 12:
-            meno_nand_lz_read(s, args_ptr);
+            bytes = meno_nand_lz_read(s, args_ptr);
             break;
 
         default:
             qemu_log_mask(LOG_UNIMP, "%s: unimplemented command %d\n", __func__, action);
     }
+    trace_bionz_meno_complete(action, bytes);
+    bionz_stats_end(&s->stats, start, bytes);
 
     s->csr = 1;
     meno_update_irq(s);
@@ -227,6 +462,7 @@ static void meno_realize(DeviceState *dev, Error **errp)
 {
     SysBusDevice *sbd = SYS_BUS_DEVICE(dev);
     MenoState *s = BIONZ_MENO(dev);
+    BlockBackend *blk = s->blk_name ? blk_by_name(s->blk_name) : NULL;
 
     memory_region_init(&s->container, OBJECT(dev), TYPE_BIONZ_MENO, 0x3000);
     sysbus_init_mmio(sbd, &s->container);
@@ -235,22 +471,56 @@ static void meno_realize(DeviceState *dev, Error **errp)
     memory_region_add_subregion(&s->container, 0, &s->mmio);
 
     /* The firmware is written to the fwram by the device driver. The firmware is ignored by this model. */
-    memory_region_init_ram_nomigrate(&s->fwram, OBJECT(dev), TYPE_BIONZ_MENO ".fwram", 0x2000, &error_fatal);
+    memory_region_init_ram(&s->fwram, OBJECT(dev), TYPE_BIONZ_MENO ".fwram", 0x2000, &error_fatal);
     memory_region_add_subregion(&s->container, 0x1000, &s->fwram);
 
     sysbus_init_irq(sbd, &s->intr);
+
+    s->cache = g_hash_table_new_full(g_bytes_hash, g_bytes_equal, NULL, meno_cache_free_entry);
+    QTAILQ_INIT(&s->cache_lru);
+    object_property_add_uint64_ptr(OBJECT(dev), "lz_cache_hits", &s->cache_hits, OBJ_PROP_FLAG_READ);
+    object_property_add_uint64_ptr(OBJECT(dev), "lz_cache_misses", &s->cache_misses, OBJ_PROP_FLAG_READ);
+
+    // The NAND is shared with the onenand model, which programs and erases it
+    if (blk && blk_bs(blk)) {
+        s->write_notifier.notify = meno_cache_invalidate;
+        bdrv_add_before_write_notifier(blk_bs(blk), &s->write_notifier);
+    }
+
+    bionz_stats_register(&s->stats, OBJECT(dev));
 }
 
 static Property meno_properties[] = {
     DEFINE_PROP_STRING("drive_name", MenoState, blk_name),
+    DEFINE_PROP_SIZE("lz_cache_size", MenoState, cache_max, 32 * MiB),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+// Loading a snapshot reverts the NAND without write requests, so nothing cached can be trusted
+static int meno_post_load(void *opaque, int version_id)
+{
+    meno_cache_clear(BIONZ_MENO(opaque));
+    return 0;
+}
+
+static const VMStateDescription vmstate_meno = {
+    .name = TYPE_BIONZ_MENO,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = meno_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(csr, MenoState),
+        VMSTATE_UINT32(poll_mode, MenoState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void meno_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = meno_realize;
     dc->reset = meno_reset;
+    dc->vmsd = &vmstate_meno;
     device_class_set_props(dc, meno_properties);
 }
 
@@ -4,6 +4,7 @@
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
 
 #define MAX_MBOX 32
@@ -247,11 +248,48 @@ static Property pl320_properties[] = {
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_pl320_mbox = {
+    .name = TYPE_PL320 ".mbox",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(src, Pl320Mbox),
+        VMSTATE_UINT32(dst, Pl320Mbox),
+        VMSTATE_UINT32(mask, Pl320Mbox),
+        VMSTATE_UINT32(send, Pl320Mbox),
+        VMSTATE_UINT32_ARRAY(data, Pl320Mbox, MAX_DATA),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_pl320_intr = {
+    .name = TYPE_PL320 ".intr",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(masked, Pl320Intr),
+        VMSTATE_UINT32(raw, Pl320Intr),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_pl320 = {
+    .name = TYPE_PL320,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(mbox, Pl320State, MAX_MBOX, 1, vmstate_pl320_mbox, Pl320Mbox),
+        VMSTATE_STRUCT_ARRAY(intr, Pl320State, MAX_INTR, 1, vmstate_pl320_intr, Pl320Intr),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void pl320_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = pl320_realize;
     dc->reset = pl320_reset;
+    dc->vmsd = &vmstate_pl320;
     device_class_set_props(dc, pl320_properties);
 }
 
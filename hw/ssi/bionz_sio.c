@@ -6,6 +6,7 @@
 #include "hw/irq.h"
 #include "hw/ssi/ssi.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 
 #define SIO_CS 0x00
 #define SIO_SA 0x08
@@ -121,18 +122,31 @@ static void sio_realize(DeviceState *dev, Error **errp)
     memory_region_init_io(&s->mmio, OBJECT(dev), &sio_ops, s, TYPE_BIONZ_SIO ".mmio", 0x100);
     sysbus_init_mmio(sbd, &s->mmio);
 
-    memory_region_init_ram_nomigrate(&s->bufram, OBJECT(dev), TYPE_BIONZ_SIO ".buf", 0x100, &error_fatal);
+    memory_region_init_ram(&s->bufram, OBJECT(dev), TYPE_BIONZ_SIO ".buf", 0x100, &error_fatal);
     sysbus_init_mmio(sbd, &s->bufram);
 
     sysbus_init_irq(sbd, &s->intr);
     s->ssi = ssi_create_bus(dev, "sio");
 }
 
+static const VMStateDescription vmstate_sio = {
+    .name = TYPE_BIONZ_SIO,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(reg_cs, SioState),
+        VMSTATE_UINT8(reg_sa, SioState),
+        VMSTATE_UINT8(reg_n, SioState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void sio_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = sio_realize;
     dc->reset = sio_reset;
+    dc->vmsd = &vmstate_sio;
 }
 
 static const TypeInfo sio_info = {
@@ -4,6 +4,7 @@
 #include "hw/irq.h"
 #include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
 #include "sysemu/sysemu.h"
 
@@ -184,11 +185,27 @@ static Property hwtimer_properties[] = {
     DEFINE_PROP_END_OF_LIST()
 };
 
+static const VMStateDescription vmstate_hwtimer = {
+    .name = TYPE_BIONZ_HWTIMER,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_TIMER_PTR(timer, HwtimerState),
+        VMSTATE_INT64(last_tick, HwtimerState),
+        VMSTATE_INT64(next_tick, HwtimerState),
+        VMSTATE_UINT32(reg_ctl, HwtimerState),
+        VMSTATE_UINT32(reg_cmp, HwtimerState),
+        VMSTATE_UINT32(reg_value, HwtimerState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void hwtimer_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = hwtimer_realize;
     dc->reset = hwtimer_reset;
+    dc->vmsd = &vmstate_hwtimer;
     device_class_set_props(dc, hwtimer_properties);
 }
 
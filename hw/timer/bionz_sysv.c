@@ -1,13 +1,17 @@
 /* QEMU model of the Sony CXD4108 sysv tick timer */
 
 #include "qemu/osdep.h"
+#include "hw/core/cpu.h"
 #include "hw/irq.h"
+#include "hw/qdev-properties.h"
 #include "hw/sysbus.h"
+#include "migration/vmstate.h"
 #include "qemu/log.h"
 #include "sysemu/sysemu.h"
 
 #define NUM_IRQ 10
 #define PERIOD_NS 16683333 // NTSC
+#define VSYNC_IRQS 0b1001001
 
 #define TYPE_BIONZ_SYSV "bionz_sysv"
 #define BIONZ_SYSV(obj) OBJECT_CHECK(SysvState, (obj), TYPE_BIONZ_SYSV)
@@ -20,15 +24,51 @@ typedef struct SysvState {
 
     QEMUTimer *timer;
     bool field;
+    uint32_t vsync_coalesce;
+    bool vsync_irq_enabled;
 
     uint32_t reg_en0;
     uint32_t reg_en1;
     uint32_t reg_intsts;
 } SysvState;
 
-static void sysv_set_timer(SysvState *s)
+// Under MTTCG the vCPU threads update halted without the BQL
+static bool sysv_cpus_halted(void)
 {
-    timer_mod(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + PERIOD_NS);
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (!atomic_read(&cpu->halted)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Nobody waits for the next vsync if no interrupt is raised for it, here or in the VIP
+static bool sysv_vsync_irq_enabled(SysvState *s)
+{
+    return (s->reg_en0 & s->reg_en1 & VSYNC_IRQS) || s->vsync_irq_enabled;
+}
+
+static void sysv_set_timer(SysvState *s, bool coalesce)
+{
+    int64_t period = PERIOD_NS;
+
+    // Stretch the period while nothing runs, this saves wakeups and icount clock warps
+    if (coalesce) {
+        period *= s->vsync_coalesce;
+    }
+
+    timer_mod(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + period);
+}
+
+// A stretched period must not delay an interrupt the guest just enabled
+static void sysv_irq_enabled_changed(SysvState *s)
+{
+    if (sysv_vsync_irq_enabled(s)) {
+        timer_mod_anticipate(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + PERIOD_NS);
+    }
 }
 
 static void sysv_update(SysvState *s)
@@ -42,14 +82,26 @@ static void sysv_update(SysvState *s)
 static void sysv_tick(void *opaque)
 {
     SysvState *s = BIONZ_SYSV(opaque);
+    bool coalesce;
+
+    // Decide before raising anything, the interrupts below wake the CPUs only later
+    coalesce = s->vsync_coalesce > 1 && !sysv_vsync_irq_enabled(s) && sysv_cpus_halted();
 
     s->field = !s->field;
     qemu_set_irq(s->vsync, s->field);
 
-    s->reg_intsts |= s->reg_en0 & s->reg_en1 & 0b1001001;
+    s->reg_intsts |= s->reg_en0 & s->reg_en1 & VSYNC_IRQS;
     sysv_update(s);
 
-    sysv_set_timer(s);
+    sysv_set_timer(s, coalesce);
+}
+
+static void sysv_set_vsync_irq_enabled(void *opaque, int irq, int level)
+{
+    SysvState *s = BIONZ_SYSV(opaque);
+
+    s->vsync_irq_enabled = level;
+    sysv_irq_enabled_changed(s);
 }
 
 static uint64_t sysv_read(void *opaque, hwaddr offset, unsigned size)
@@ -76,10 +128,12 @@ static void sysv_write(void *opaque, hwaddr offset, uint64_t value, unsigned siz
     switch (offset) {
         case 0x18:
             s->reg_en0 = value;
+            sysv_irq_enabled_changed(s);
             break;
 
         case 0x1c:
             s->reg_en1 = value;
+            sysv_irq_enabled_changed(s);
             break;
 
         case 0x24:
@@ -110,7 +164,7 @@ static void sysv_reset(DeviceState *dev)
     s->reg_intsts = 0;
 
     timer_del(s->timer);
-    sysv_set_timer(s);
+    sysv_set_timer(s, false);
     sysv_update(s);
 }
 
@@ -128,13 +182,35 @@ static void sysv_realize(DeviceState *dev, Error **errp)
         sysbus_init_irq(sbd, &s->irqs[i]);
     }
     qdev_init_gpio_out(dev, &s->vsync, 1);
+    qdev_init_gpio_in_named(dev, sysv_set_vsync_irq_enabled, "vsync-irq-enabled", 1);
 }
 
+static Property sysv_properties[] = {
+    DEFINE_PROP_UINT32("vsync-coalesce", SysvState, vsync_coalesce, 1),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static const VMStateDescription vmstate_sysv = {
+    .name = TYPE_BIONZ_SYSV,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_TIMER_PTR(timer, SysvState),
+        VMSTATE_BOOL(field, SysvState),
+        VMSTATE_UINT32(reg_en0, SysvState),
+        VMSTATE_UINT32(reg_en1, SysvState),
+        VMSTATE_UINT32(reg_intsts, SysvState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void sysv_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = sysv_realize;
     dc->reset = sysv_reset;
+    dc->vmsd = &vmstate_sysv;
+    device_class_set_props(dc, sysv_properties);
 }
 
 static const TypeInfo sysv_info = {
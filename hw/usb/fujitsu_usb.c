@@ -6,7 +6,9 @@
 #include "hw/sysbus.h"
 #include "hw/usb.h"
 #include "hw/usb/tcp_usb.h"
+#include "migration/vmstate.h"
 #include "qapi/error.h"
+#include "qemu/error-report.h"
 #include "qemu/log.h"
 
 #define F_USB20HDC_REGISTER_MODE     0x0004
@@ -93,6 +95,7 @@ typedef struct FujitsuUsbState {
     qemu_irq intr;
 
     uint32_t port;
+    char *addr;
     TcpUsbState tcp_usb_state;
 
     uint32_t reg_inten;
@@ -137,6 +140,14 @@ static uint32_t fujitsu_usb_get_ints(FujitsuUsbState *s)
 static void fujitsu_usb_update_irq(FujitsuUsbState *s)
 {
     qemu_set_irq(s->intr, s->reg_inten & fujitsu_usb_get_ints(s));
+
+    // Endpoint state may have changed, retry the requests held after a NAK
+    tcp_usb_kick(&s->tcp_usb_state);
+}
+
+static void fujitsu_usb_tcp_update(void *arg)
+{
+    fujitsu_usb_update_irq(FUJITSU_USB(arg));
 }
 
 static int fujitsu_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char *buffer)
@@ -150,7 +161,6 @@ static int fujitsu_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char
 
     if (header->flags & tcp_usb_reset) {
         s->reg_devs |= F_USB20HDC_REGISTER_DEV_INT_USBRSTE | F_USB20HDC_REGISTER_DEV_INT_USBRSTB;
-        fujitsu_usb_update_irq(s);
         return USB_RET_SUCCESS;
     }
 
@@ -205,7 +215,6 @@ static int fujitsu_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char
             }
         }
 
-        fujitsu_usb_update_irq(s);
         return count;
     } else {
         if (s->reg_epctrl[ep] & F_USB20HDC_REGISTER_EPCTRL_NACKRESP) {
@@ -226,17 +235,12 @@ static int fujitsu_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char
                     count = s->reg_dmatci[i];
                 }
 
-                if (header->ep & USB_DIR_IN) {
-                    cpu_physical_memory_read(s->reg_dmacsa[i], buffer, count);
-                } else {
-                    cpu_physical_memory_write(s->reg_dmacda[i], buffer, count);
-                }
+                tcp_usb_dma(header, buffer, (header->ep & USB_DIR_IN) ? s->reg_dmacsa[i] : s->reg_dmacda[i], count);
 
                 s->reg_dmac[i] &= ~F_USB20HDC_REGISTER_DMAC_START;
                 s->reg_dmatc[i] = count;
                 s->reg_dmaint |= 1 << i;
 
-                fujitsu_usb_update_irq(s);
                 return count;
             }
         }
@@ -378,7 +382,7 @@ static void fujitsu_usb_write(void *arg, hwaddr offset, uint64_t value, unsigned
         case F_USB20HDC_REGISTER_DEVC:
             s->reg_devc = value;
             if ((value & F_USB20HDC_REGISTER_DEV_INT_USBRSTE) && (value & F_USB20HDC_REGISTER_DEV_INT_USBRSTB)) {
-                if (tcp_usb_serve(&s->tcp_usb_state, s->port) < 0) {
+                if (tcp_usb_serve(&s->tcp_usb_state, s->addr, s->port) < 0) {
                     hw_error("%s: failed to start tcp_usb server\n", __func__);
                 }
             }
@@ -507,7 +511,7 @@ static void fujitsu_usb_realize(DeviceState *dev, Error **errp)
     SysBusDevice *sbd = SYS_BUS_DEVICE(dev);
     FujitsuUsbState *s = FUJITSU_USB(dev);
 
-    tcp_usb_init(&s->tcp_usb_state, fujitsu_usb_tcp_callback, s);
+    tcp_usb_init(&s->tcp_usb_state, fujitsu_usb_tcp_callback, fujitsu_usb_tcp_update, s);
 
     memory_region_init(&s->container, OBJECT(dev), TYPE_FUJITSU_USB ".container", 0x10000);
     sysbus_init_mmio(sbd, &s->container);
@@ -526,14 +530,55 @@ static void fujitsu_usb_realize(DeviceState *dev, Error **errp)
 
 static Property fujitsu_usb_properties[] = {
     DEFINE_PROP_UINT32("port", FujitsuUsbState, port, 7642),
+    DEFINE_PROP_STRING("addr", FujitsuUsbState, addr),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static int fujitsu_usb_post_load(void *opaque, int version_id)
+{
+    FujitsuUsbState *s = FUJITSU_USB(opaque);
+
+    if ((s->reg_devc & F_USB20HDC_REGISTER_DEV_INT_USBRSTE) && (s->reg_devc & F_USB20HDC_REGISTER_DEV_INT_USBRSTB)) {
+        // The snapshot is still usable if the port is taken, e.g. by the instance it was saved from
+        if (tcp_usb_serve(&s->tcp_usb_state, s->addr, s->port) < 0) {
+            warn_report("%s: continuing without tcp_usb server", __func__);
+        }
+    }
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_fujitsu_usb = {
+    .name = TYPE_FUJITSU_USB,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = fujitsu_usb_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(reg_inten, FujitsuUsbState),
+        VMSTATE_UINT32(reg_devc, FujitsuUsbState),
+        VMSTATE_UINT32(reg_devs, FujitsuUsbState),
+        VMSTATE_UINT8(reg_dmaint, FujitsuUsbState),
+        VMSTATE_UINT32_ARRAY(reg_epctrl, FujitsuUsbState, F_USB20HDC_NUM_EP),
+        VMSTATE_UINT32_ARRAY(reg_epconf, FujitsuUsbState, F_USB20HDC_NUM_EP),
+        VMSTATE_UINT32_ARRAY(reg_epcount0, FujitsuUsbState, F_USB20HDC_NUM_EP),
+        VMSTATE_UINT32_ARRAY(reg_epcount1, FujitsuUsbState, F_USB20HDC_NUM_EP),
+        VMSTATE_BOOL_ARRAY(reg_epbufwr, FujitsuUsbState, F_USB20HDC_NUM_EP),
+        VMSTATE_BOOL_ARRAY(reg_epbufrd, FujitsuUsbState, F_USB20HDC_NUM_EP),
+        VMSTATE_UINT32_ARRAY(reg_dmac, FujitsuUsbState, F_USB20HDC_NUM_DMA),
+        VMSTATE_UINT32_ARRAY(reg_dmatci, FujitsuUsbState, F_USB20HDC_NUM_DMA),
+        VMSTATE_UINT32_ARRAY(reg_dmatc, FujitsuUsbState, F_USB20HDC_NUM_DMA),
+        VMSTATE_UINT32_ARRAY(reg_dmacsa, FujitsuUsbState, F_USB20HDC_NUM_DMA),
+        VMSTATE_UINT32_ARRAY(reg_dmacda, FujitsuUsbState, F_USB20HDC_NUM_DMA),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void fujitsu_usb_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = fujitsu_usb_realize;
     dc->reset = fujitsu_usb_reset;
+    dc->vmsd = &vmstate_fujitsu_usb;
     device_class_set_props(dc, fujitsu_usb_properties);
 }
 
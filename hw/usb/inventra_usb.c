@@ -6,6 +6,8 @@
 #include "hw/sysbus.h"
 #include "hw/usb.h"
 #include "hw/usb/tcp_usb.h"
+#include "migration/vmstate.h"
+#include "qemu/error-report.h"
 #include "qemu/log.h"
 
 #define INTRTX    0x02
@@ -64,9 +66,9 @@
 #define INVENTRA_USB(obj) OBJECT_CHECK(InventraUsbState, (obj), TYPE_INVENTRA_USB)
 
 typedef struct FifoState {
-    char buf[FIFO_SIZE];
-    size_t r;
-    size_t w;
+    uint8_t buf[FIFO_SIZE];
+    uint32_t r;
+    uint32_t w;
 } FifoState;
 
 typedef struct InventraUsbEpState {
@@ -86,6 +88,7 @@ typedef struct InventraUsbState {
     qemu_irq intr1;
 
     uint32_t port;
+    char *addr;
     TcpUsbState tcp_usb_state;
     bool dynfifo;
 
@@ -144,6 +147,14 @@ static void inventra_usb_update_irq(InventraUsbState *s)
 {
     qemu_set_irq(s->intr0, (s->intrusb & s->intrusbe) | (s->intrtx & s->intrtxe) | (s->intrrx & s->intrrxe));
     qemu_set_irq(s->intr1, (s->dma_cntl & DMA_IE) ? s->dma_intr : 0);
+
+    // Endpoint state may have changed, retry the requests held after a NAK
+    tcp_usb_kick(&s->tcp_usb_state);
+}
+
+static void inventra_usb_tcp_update(void *arg)
+{
+    inventra_usb_update_irq(INVENTRA_USB(arg));
 }
 
 static int inventra_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char *buffer)
@@ -151,13 +162,12 @@ static int inventra_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char
     InventraUsbState *s = INVENTRA_USB(arg);
     uint8_t ep;
     InventraUsbEpState *eps;
-    size_t count, residue;
+    size_t count, residue, n;
     bool dma_en;
     char dma_buf[FIFO_SIZE];
 
     if (header->flags & tcp_usb_reset) {
         s->intrusb |= INTRUSB_RESET;
-        inventra_usb_update_irq(s);
         return USB_RET_SUCCESS;
     }
 
@@ -173,7 +183,6 @@ static int inventra_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char
             s->csr0 &= ~CSR0_SENDSTALL;
             s->csr0 |= CSR0_SENTSTALL;
             s->intrtx |= 1 << ep;
-            inventra_usb_update_irq(s);
             return USB_RET_NAK;
         }
 
@@ -190,7 +199,7 @@ static int inventra_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char
         s->intrtx |= 1 << ep;
     } else {
         eps = &s->eps[ep - 1];
-        dma_en = (s->dma_cntl & DMA_ENAB) &&
+        dma_en = (s->dma_cntl & DMA_ENAB) && s->dma_count &&
                  (((s->dma_cntl >> DMA_EP_SHIFT) & DMA_EP_MASK) == ep) &&
                  !(s->dma_cntl & DMA_DIR) == !(header->ep & USB_DIR_IN);
 
@@ -199,25 +208,28 @@ static int inventra_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char
                 eps->txcsrl &= ~TXCSRL_SENDSTALL;
                 eps->txcsrl |= TXCSRL_SENTSTALL;
                 s->intrtx |= 1 << ep;
-                inventra_usb_update_irq(s);
                 return USB_RET_STALL;
             }
 
             if (dma_en) {
-                if (count < s->dma_count) {
-                    hw_error("%s: packet length less than dma count\n", __func__);
-                }
-                residue = s->dma_count % eps->txmaxp;
-                count = s->dma_count - residue;
-                cpu_physical_memory_read(s->dma_addr, buffer, count);
+                // Whole packets are sent straight from guest memory, a transfer may span several requests.
+                // A short last packet is left in the fifo for the guest to send.
+                residue = eps->txmaxp ? s->dma_count % eps->txmaxp : 0;
+                count = MIN(count, s->dma_count - residue);
+                tcp_usb_dma(header, buffer, s->dma_addr, count);
                 s->dma_addr += count;
+                s->dma_count -= count;
 
-                if (residue > sizeof(dma_buf)) {
-                    hw_error("%s: out of capacity for residue\n", __func__);
+                if (s->dma_count == residue) {
+                    if (residue > sizeof(dma_buf)) {
+                        hw_error("%s: out of capacity for residue\n", __func__);
+                    }
+                    cpu_physical_memory_read(s->dma_addr, dma_buf, residue);
+                    fifo_write(&eps->txfifo, dma_buf, residue);
+                    s->dma_addr += residue;
+                    s->dma_count = 0;
+                    s->dma_intr |= 1;
                 }
-                cpu_physical_memory_read(s->dma_addr, dma_buf, residue);
-                fifo_write(&eps->txfifo, dma_buf, residue);
-                s->dma_intr |= 1;
             } else {
                 if (!(eps->txcsrl & TXCSRL_TXPKTRDY)) {
                     return USB_RET_NAK;
@@ -231,18 +243,24 @@ static int inventra_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char
                 eps->rxcsrl &= ~RXCSRL_SENDSTALL;
                 eps->rxcsrl |= RXCSRL_SENTSTALL;
                 s->intrrx |= 1 << ep;
-                inventra_usb_update_irq(s);
                 return USB_RET_STALL;
             }
 
+            // The transfer may span several requests, only data past its end goes to the fifo
+            n = dma_en ? MIN(count, s->dma_count) : 0;
+            if (count > n && ((eps->rxcsrl & RXCSRL_RXPKTRDY) || count - n > sizeof(eps->rxfifo.buf) - eps->rxfifo.w)) {
+                // Hold the request until the guest has drained the previous packet
+                return USB_RET_NAK;
+            }
+
             if (dma_en) {
-                if (count < s->dma_count) {
-                    hw_error("%s: packet length less than dma count\n", __func__);
+                tcp_usb_dma(header, buffer, s->dma_addr, n);
+                s->dma_addr += n;
+                s->dma_count -= n;
+                if (!s->dma_count) {
+                    s->dma_intr |= 1;
                 }
-                cpu_physical_memory_write(s->dma_addr, buffer, s->dma_count);
-                s->dma_addr += s->dma_count;
-                s->dma_intr |= 1;
-                fifo_write(&eps->rxfifo, buffer + s->dma_count, count - s->dma_count);
+                fifo_write(&eps->rxfifo, buffer + n, count - n);
             } else {
                 fifo_write(&eps->rxfifo, buffer, count);
             }
@@ -254,7 +272,6 @@ static int inventra_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char
         }
     }
 
-    inventra_usb_update_irq(s);
     return count;
 }
 
@@ -338,6 +355,8 @@ static void inventra_usb_ep_write(InventraUsbState *s, InventraUsbEpState *eps,
                     fifo_flush(&eps->rxfifo);
                 }
                 eps->rxcsrl = value & (RXCSRL_RXPKTRDY | RXCSRL_SENDSTALL | (eps->rxcsrl & RXCSRL_SENTSTALL));
+                // The fifo may have been drained, retry an OUT request held after a NAK
+                tcp_usb_kick(&s->tcp_usb_state);
                 return;
 
             case RXCSR + 1:
@@ -453,7 +472,7 @@ static void inventra_usb_write(void *arg, hwaddr offset, uint64_t value, unsigne
         switch (offset) {
             case INTRUSBE:
                 if (value & INTRUSB_RESET) {
-                    if (tcp_usb_serve(&s->tcp_usb_state, s->port) < 0) {
+                    if (tcp_usb_serve(&s->tcp_usb_state, s->addr, s->port) < 0) {
                         hw_error("%s: failed to start tcp_usb server\n", __func__);
                     }
                 }
@@ -551,7 +570,7 @@ static void inventra_usb_realize(DeviceState *dev, Error **errp)
     SysBusDevice *sbd = SYS_BUS_DEVICE(dev);
     InventraUsbState *s = INVENTRA_USB(dev);
 
-    tcp_usb_init(&s->tcp_usb_state, inventra_usb_tcp_callback, s);
+    tcp_usb_init(&s->tcp_usb_state, inventra_usb_tcp_callback, inventra_usb_tcp_update, s);
 
     memory_region_init_io(&s->mmio, OBJECT(dev), &inventra_usb_ops, s, TYPE_INVENTRA_USB, 0x350);
     sysbus_init_mmio(sbd, &s->mmio);
@@ -562,15 +581,95 @@ static void inventra_usb_realize(DeviceState *dev, Error **errp)
 
 static Property inventra_usb_properties[] = {
     DEFINE_PROP_UINT32("port", InventraUsbState, port, 7642),
+    DEFINE_PROP_STRING("addr", InventraUsbState, addr),
     DEFINE_PROP_BOOL("dynfifo", InventraUsbState, dynfifo, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static int fifo_post_load(void *opaque, int version_id)
+{
+    FifoState *fifo = opaque;
+
+    if (fifo->r > fifo->w || fifo->w > sizeof(fifo->buf)) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_fifo = {
+    .name = TYPE_INVENTRA_USB ".fifo",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = fifo_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BUFFER(buf, FifoState),
+        VMSTATE_UINT32(r, FifoState),
+        VMSTATE_UINT32(w, FifoState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_inventra_usb_ep = {
+    .name = TYPE_INVENTRA_USB ".ep",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(txmaxp, InventraUsbEpState),
+        VMSTATE_UINT8(txcsrl, InventraUsbEpState),
+        VMSTATE_UINT8(txcsrh, InventraUsbEpState),
+        VMSTATE_UINT8(rxcsrl, InventraUsbEpState),
+        VMSTATE_UINT8(rxcsrh, InventraUsbEpState),
+        VMSTATE_STRUCT(txfifo, InventraUsbEpState, 1, vmstate_fifo, FifoState),
+        VMSTATE_STRUCT(rxfifo, InventraUsbEpState, 1, vmstate_fifo, FifoState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int inventra_usb_post_load(void *opaque, int version_id)
+{
+    InventraUsbState *s = INVENTRA_USB(opaque);
+
+    if (s->intrusbe & INTRUSB_RESET) {
+        // The snapshot is still usable if the port is taken, e.g. by the instance it was saved from
+        if (tcp_usb_serve(&s->tcp_usb_state, s->addr, s->port) < 0) {
+            warn_report("%s: continuing without tcp_usb server", __func__);
+        }
+    }
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_inventra_usb = {
+    .name = TYPE_INVENTRA_USB,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = inventra_usb_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT8(intrusb, InventraUsbState),
+        VMSTATE_UINT8(intrusbe, InventraUsbState),
+        VMSTATE_UINT16(intrtx, InventraUsbState),
+        VMSTATE_UINT16(intrtxe, InventraUsbState),
+        VMSTATE_UINT16(intrrx, InventraUsbState),
+        VMSTATE_UINT16(intrrxe, InventraUsbState),
+        VMSTATE_UINT8(index, InventraUsbState),
+        VMSTATE_UINT8(dma_intr, InventraUsbState),
+        VMSTATE_UINT16(dma_cntl, InventraUsbState),
+        VMSTATE_UINT32(dma_addr, InventraUsbState),
+        VMSTATE_UINT32(dma_count, InventraUsbState),
+        VMSTATE_UINT16(csr0, InventraUsbState),
+        VMSTATE_STRUCT(fifo0, InventraUsbState, 1, vmstate_fifo, FifoState),
+        VMSTATE_STRUCT_ARRAY(eps, InventraUsbState, NUM_EP - 1, 1, vmstate_inventra_usb_ep, InventraUsbEpState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void inventra_usb_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = inventra_usb_realize;
     dc->reset = inventra_usb_reset;
+    dc->vmsd = &vmstate_inventra_usb;
     device_class_set_props(dc, inventra_usb_properties);
 }
 
@@ -24,6 +24,8 @@
 #include "hw/sysbus.h"
 #include "hw/usb.h"
 #include "hw/usb/tcp_usb.h"
+#include "migration/vmstate.h"
+#include "qemu/error-report.h"
 #include "qemu/log.h"
 
 #define GOTGCTL  0x0
@@ -104,6 +106,7 @@ typedef struct SynopsysUsbState {
     qemu_irq irq;
 
     uint32_t port;
+    char *addr;
     TcpUsbState tcp_usb_state;
 
     uint32_t gotgctl;
@@ -164,6 +167,14 @@ static void synopsys_usb_update_irq(SynopsysUsbState *s)
     } else {
         qemu_irq_lower(s->irq);
     }
+
+    // Endpoint state may have changed, retry the requests held after a NAK
+    tcp_usb_kick(&s->tcp_usb_state);
+}
+
+static void synopsys_usb_tcp_update(void *arg)
+{
+    synopsys_usb_update_irq(SYNOPSYS_USB(arg));
 }
 
 static int synopsys_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char *buffer)
@@ -175,7 +186,6 @@ static int synopsys_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char
 
     if (header->flags & tcp_usb_reset) {
         s->gintsts |= GINTMSK_RESET;
-        synopsys_usb_update_irq(s);
         return USB_RET_SUCCESS;
     }
 
@@ -216,11 +226,7 @@ static int synopsys_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char
     }
 
     if (s->gahbcfg & GAHBCFG_DMAEN) {
-        if (header->ep & USB_DIR_IN) {
-            cpu_physical_memory_read(eps->depdma, buffer, count);
-        } else {
-            cpu_physical_memory_write(eps->depdma, buffer, count);
-        }
+        tcp_usb_dma(header, buffer, eps->depdma, count);
         eps->depdma += count;
     }
 
@@ -238,7 +244,6 @@ static int synopsys_usb_tcp_callback(void *arg, const TcpUsbHeader *header, char
         eps->depint |= DEPINT_XFERCOMPL;
     }
 
-    synopsys_usb_update_irq(s);
     return count;
 }
 
@@ -391,7 +396,7 @@ static void synopsys_usb_write(void *arg, hwaddr offset, uint64_t value, unsigne
                     s->gintsts |= GINTMSK_ENUMDONE;
                 }
                 if (value & GINTMSK_RESET) {
-                    if (tcp_usb_serve(&s->tcp_usb_state, s->port) < 0) {
+                    if (tcp_usb_serve(&s->tcp_usb_state, s->addr, s->port) < 0) {
                         hw_error("%s: failed to start tcp_usb server\n", __func__);
                     }
                 }
@@ -488,7 +493,7 @@ static void synopsys_usb_realize(DeviceState *dev, Error **errp)
     SysBusDevice *sbd = SYS_BUS_DEVICE(dev);
     SynopsysUsbState *s = SYNOPSYS_USB(dev);
 
-    tcp_usb_init(&s->tcp_usb_state, synopsys_usb_tcp_callback, s);
+    tcp_usb_init(&s->tcp_usb_state, synopsys_usb_tcp_callback, synopsys_usb_tcp_update, s);
 
     memory_region_init_io(&s->mmio, OBJECT(dev), &synopsys_usb_ops, s, TYPE_SYNOPSYS_USB, 0x40000);
     sysbus_init_mmio(sbd, &s->mmio);
@@ -498,14 +503,68 @@ static void synopsys_usb_realize(DeviceState *dev, Error **errp)
 
 static Property synopsys_usb_properties[] = {
     DEFINE_PROP_UINT32("port", SynopsysUsbState, port, 7642),
+    DEFINE_PROP_STRING("addr", SynopsysUsbState, addr),
     DEFINE_PROP_END_OF_LIST(),
 };
 
+static const VMStateDescription vmstate_synopsys_usb_ep = {
+    .name = TYPE_SYNOPSYS_USB ".ep",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(depctl, SynopsysUsbEpState),
+        VMSTATE_UINT32(depint, SynopsysUsbEpState),
+        VMSTATE_UINT32(deptsiz, SynopsysUsbEpState),
+        VMSTATE_UINT64(depdma, SynopsysUsbEpState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int synopsys_usb_post_load(void *opaque, int version_id)
+{
+    SynopsysUsbState *s = SYNOPSYS_USB(opaque);
+
+    if (s->gintmsk & GINTMSK_RESET) {
+        // The snapshot is still usable if the port is taken, e.g. by the instance it was saved from
+        if (tcp_usb_serve(&s->tcp_usb_state, s->addr, s->port) < 0) {
+            warn_report("%s: continuing without tcp_usb server", __func__);
+        }
+    }
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_synopsys_usb = {
+    .name = TYPE_SYNOPSYS_USB,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = synopsys_usb_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(gotgctl, SynopsysUsbState),
+        VMSTATE_UINT32(gahbcfg, SynopsysUsbState),
+        VMSTATE_UINT32(gintsts, SynopsysUsbState),
+        VMSTATE_UINT32(gintmsk, SynopsysUsbState),
+        VMSTATE_UINT32(ghwcfg1, SynopsysUsbState),
+        VMSTATE_UINT32(ghwcfg2, SynopsysUsbState),
+        VMSTATE_UINT32(ghwcfg3, SynopsysUsbState),
+        VMSTATE_UINT32(ghwcfg4, SynopsysUsbState),
+        VMSTATE_UINT32(dctl, SynopsysUsbState),
+        VMSTATE_UINT32(diepmsk, SynopsysUsbState),
+        VMSTATE_UINT32(doepmsk, SynopsysUsbState),
+        VMSTATE_UINT32(daint, SynopsysUsbState),
+        VMSTATE_UINT32(daintmsk, SynopsysUsbState),
+        VMSTATE_STRUCT_ARRAY(in_eps, SynopsysUsbState, NUM_EP, 1, vmstate_synopsys_usb_ep, SynopsysUsbEpState),
+        VMSTATE_STRUCT_ARRAY(out_eps, SynopsysUsbState, NUM_EP, 1, vmstate_synopsys_usb_ep, SynopsysUsbEpState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static void synopsys_usb_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
     dc->realize = synopsys_usb_realize;
     dc->reset = synopsys_usb_reset;
+    dc->vmsd = &vmstate_synopsys_usb;
     device_class_set_props(dc, synopsys_usb_properties);
 }
 
@@ -18,253 +18,531 @@
  */
 
 #include "qemu/osdep.h"
+#include "exec/address-spaces.h"
 #include "hw/usb.h"
 #include "hw/usb/tcp_usb.h"
+#include "qapi/error.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/log.h"
 #include "qemu/main-loop.h"
 #include "qemu/sockets.h"
-#include "sysemu/sysemu.h"
+#include "sysemu/cpus.h"
+#include "sysemu/dma.h"
 
-void tcp_usb_init(TcpUsbState *s, TcpUsbCallback callback, void *arg)
+// Requests that may be received before their responses are sent, reading stops beyond this
+#define TCP_USB_MAX_INFLIGHT 64
+#define TCP_USB_MAX_LENGTH (16 * 1024 * 1024)
+#define TCP_USB_MAX_IOV 64
+
+// Requests kept for reuse, buffers above the size limit are freed
+#define TCP_USB_POOL_SIZE 16
+#define TCP_USB_POOL_MAX_BUFFER (1024 * 1024)
+
+// Held requests are retried when the device kicks, the poll for devices that do not backs off up to a second
+#define TCP_USB_RETRY_MIN_MS 1
+#define TCP_USB_RETRY_MAX_MS 1000
+
+static void tcp_usb_retry_bh(void *opaque);
+static void tcp_usb_retry_timer(void *opaque);
+
+void tcp_usb_init(TcpUsbState *s, TcpUsbCallback callback, TcpUsbUpdate update, void *arg)
 {
-    s->server_socket = -1;
-    s->client_socket = -1;
+    unsigned int i;
+
+    s->listener = NULL;
+    s->ioc = NULL;
+    s->watch = 0;
+    s->watch_cond = 0;
+    s->version = 1;
+
+    s->rx = NULL;
+    s->rx_count = 0;
+    for (i = 0; i < TCP_USB_NUM_QUEUES; i++) {
+        QTAILQ_INIT(&s->queues[i]);
+    }
+    QTAILQ_INIT(&s->tx);
+    s->tx_count = 0;
+    QTAILQ_INIT(&s->pool);
+    s->pool_size = 0;
+    s->inflight = 0;
+
+    s->retry_bh = qemu_bh_new(tcp_usb_retry_bh, s);
+    s->retry_timer = timer_new_ms(QEMU_CLOCK_REALTIME, tcp_usb_retry_timer, s);
+    s->retry_ms = TCP_USB_RETRY_MIN_MS;
+    s->held = false;
 
     s->callback = callback;
+    s->update = update;
     s->callback_arg = arg;
+    s->dirty = false;
+    s->updating = false;
+}
+
+static TcpUsbRequest *tcp_usb_request_new(TcpUsbState *s)
+{
+    TcpUsbRequest *req = QTAILQ_FIRST(&s->pool);
+
+    if (req) {
+        QTAILQ_REMOVE(&s->pool, req, next);
+        s->pool_size--;
+    } else {
+        req = g_new0(TcpUsbRequest, 1);
+    }
+
+    memset(&req->header, 0, sizeof(req->header));
+    req->payload = 0;
+    s->inflight++;
+    return req;
+}
 
-    s->state = tcp_usb_read;
-    s->count = 0;
-    s->buffer = NULL;
+static void tcp_usb_request_reserve(TcpUsbRequest *req, size_t size)
+{
+    if (size > req->size) {
+        g_free(req->buffer);
+        req->buffer = g_malloc(size);
+        req->size = size;
+    }
+}
+
+static void tcp_usb_request_free(TcpUsbState *s, TcpUsbRequest *req)
+{
+    s->inflight--;
+
+    if (s->pool_size < TCP_USB_POOL_SIZE && req->size <= TCP_USB_POOL_MAX_BUFFER) {
+        QTAILQ_INSERT_HEAD(&s->pool, req, next);
+        s->pool_size++;
+    } else {
+        g_free(req->buffer);
+        g_free(req);
+    }
+}
+
+static void tcp_usb_free_queue(TcpUsbState *s, TcpUsbRequestQueue *q)
+{
+    TcpUsbRequest *req;
+
+    while ((req = QTAILQ_FIRST(q))) {
+        QTAILQ_REMOVE(q, req, next);
+        tcp_usb_request_free(s, req);
+    }
+}
+
+// Held requests wait for the device in real time and count as device work, the clock does not warp past them
+static void tcp_usb_set_held(TcpUsbState *s, bool held)
+{
+    if (!held) {
+        timer_del(s->retry_timer);
+    } else if (!timer_pending(s->retry_timer)) {
+        timer_mod(s->retry_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + s->retry_ms);
+    }
+
+    if (held != s->held) {
+        s->held = held;
+        if (held) {
+            qemu_device_work_begin();
+        } else {
+            qemu_device_work_end();
+        }
+    }
 }
 
 static void tcp_usb_client_cleanup(TcpUsbState *s)
 {
-    if (s->client_socket >= 0) {
-        closesocket(s->client_socket);
-        qemu_set_fd_handler(s->client_socket, NULL, NULL, NULL);
-        s->client_socket = -1;
+    unsigned int i;
+
+    if (s->watch) {
+        g_source_remove(s->watch);
+        s->watch = 0;
     }
 
-    if (s->buffer) {
-        free(s->buffer);
-        s->buffer = NULL;
+    if (s->ioc) {
+        qio_channel_close(s->ioc, NULL);
+        object_unref(OBJECT(s->ioc));
+        s->ioc = NULL;
     }
+
+    if (s->rx) {
+        tcp_usb_request_free(s, s->rx);
+        s->rx = NULL;
+    }
+    for (i = 0; i < TCP_USB_NUM_QUEUES; i++) {
+        tcp_usb_free_queue(s, &s->queues[i]);
+    }
+    tcp_usb_free_queue(s, &s->tx);
+    s->tx_count = 0;
+    tcp_usb_set_held(s, false);
+
+    s->version = 1;
 }
 
 void tcp_usb_cleanup(TcpUsbState *s)
 {
+    TcpUsbRequest *req;
+
     tcp_usb_client_cleanup(s);
 
-    if (s->server_socket >= 0) {
-        closesocket(s->server_socket);
-        qemu_set_fd_handler(s->server_socket, NULL, NULL, NULL);
-        s->server_socket = -1;
+    if (s->listener) {
+        qio_net_listener_disconnect(s->listener);
+        object_unref(OBJECT(s->listener));
+        s->listener = NULL;
+    }
+
+    while ((req = QTAILQ_FIRST(&s->pool))) {
+        QTAILQ_REMOVE(&s->pool, req, next);
+        g_free(req->buffer);
+        g_free(req);
     }
+    s->pool_size = 0;
+
+    qemu_bh_delete(s->retry_bh);
+    timer_free(s->retry_timer);
 
     s->callback = NULL;
+    s->update = NULL;
     s->callback_arg = NULL;
 }
 
-static void tcp_usb_client_closed(TcpUsbState *s)
+static size_t tcp_usb_header_size(TcpUsbState *s)
 {
-    qemu_set_fd_handler(s->client_socket, NULL, NULL, NULL);
-    s->client_socket = -1;
-    tcp_usb_client_cleanup(s);
+    return s->version >= 2 ? sizeof(TcpUsbHeader2) : sizeof(TcpUsbHeader);
+}
+
+static void tcp_usb_update_watch(TcpUsbState *s);
+
+// Queues the response, the header size is that of the version in use when the request completes
+static void tcp_usb_complete(TcpUsbState *s, TcpUsbRequest *req, int ret)
+{
+    TcpUsbHeader *h = &req->header.h;
+
+    req->hlen = tcp_usb_header_size(s);
+    req->payload = (h->ep & USB_DIR_IN) && !(h->flags & tcp_usb_hello) && ret > 0 ? MIN(ret, h->length) : 0;
+    h->length = ret;
+    QTAILQ_INSERT_TAIL(&s->tx, req, next);
+}
+
+static unsigned int tcp_usb_queue_index(uint8_t ep)
+{
+    // The control endpoint has one pipe for both directions
+    return (ep & 0x0f) ? (ep & 0x0f) | ((ep & USB_DIR_IN) >> 3) : 0;
+}
+
+// Completes the requests of a queue that the device no longer wants
+static void tcp_usb_cancel_queue(TcpUsbState *s, TcpUsbRequestQueue *q)
+{
+    TcpUsbRequest *req;
+
+    while ((req = QTAILQ_FIRST(q))) {
+        QTAILQ_REMOVE(q, req, next);
+        tcp_usb_complete(s, req, USB_RET_NAK);
+    }
 }
 
-static void tcp_usb_callback(TcpUsbState *s, int can_read, int can_write)
+/* Returns true if the first request of the queue is held after a NAK */
+static bool tcp_usb_run_queue(TcpUsbState *s, TcpUsbRequestQueue *q)
 {
+    TcpUsbRequest *req;
     int ret;
 
-    switch (s->state) {
-        case tcp_usb_read:
-            if (!can_read) {
-                return;
-            }
+    while ((req = QTAILQ_FIRST(q))) {
+        ret = req->header.h.length;
+        if (s->callback) {
+            ret = s->callback(s->callback_arg, &req->header.h, req->buffer);
+            s->dirty = true;
+        }
 
-            if (s->count < sizeof(s->header)) {
-                ret = recv(s->client_socket,
-                        ((char *) &s->header) + s->count,
-                        sizeof(s->header) - s->count, 0);
-                if (ret == 0) {
-                    tcp_usb_client_closed(s);
-                    return;
-                } else if (ret < 0 && errno == ECONNRESET) {
-                    tcp_usb_client_cleanup(s);
-                    return;
-                } else if (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-                    return;
-                } else if (ret < 0) {
-                    fprintf(stderr, "%s: read error %d.\n", __func__, errno);
-                    return;
-                }
-
-                s->count += ret;
-                if (s->count < sizeof(s->header)) {
-                    return;
-                }
-
-                if (s->header.length > 0) {
-                    s->buffer = malloc(s->header.length);
-                }
-            }
+        if (ret == USB_RET_NAK && s->version >= 2) {
+            return true;
+        }
 
-            if (!(s->header.ep & USB_DIR_IN) && s->header.length > 0) {
-                ret = recv(s->client_socket,
-                        s->buffer + (s->count - sizeof(s->header)),
-                        s->header.length - (s->count - sizeof(s->header)), 0);
-                if (ret == 0) {
-                    tcp_usb_client_closed(s);
-                    return;
-                } else if (ret < 0 && errno == ECONNRESET) {
-                    tcp_usb_client_cleanup(s);
-                    return;
-                } else if (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-                    return;
-                } else if (ret < 0) {
-                    fprintf(stderr, "%s: read error %d.\n", __func__, errno);
-                    return;
-                }
-
-                s->count += ret;
-                if (s->count < sizeof(s->header) + s->header.length) {
-                    return;
-                }
-            }
+        QTAILQ_REMOVE(q, req, next);
+        tcp_usb_complete(s, req, ret);
+    }
+    return false;
+}
 
-            if (s->callback) {
-                s->header.length = s->callback(s->callback_arg, &s->header, s->buffer);
-            }
+static void tcp_usb_submit(TcpUsbState *s, TcpUsbRequest *req)
+{
+    TcpUsbHeader *h = &req->header.h;
+    TcpUsbRequestQueue *q;
+    unsigned int i;
+
+    if (h->flags & tcp_usb_hello) {
+        h->length = MIN(MAX(h->length, 1), TCP_USB_VERSION);
+        tcp_usb_complete(s, req, h->length);
+        s->version = h->length;
+        return;
+    }
 
-            s->state = tcp_usb_write;
-            s->count = 0;
+    if (h->flags & tcp_usb_reset) {
+        for (i = 0; i < TCP_USB_NUM_QUEUES; i++) {
+            tcp_usb_cancel_queue(s, &s->queues[i]);
+        }
+        tcp_usb_set_held(s, false);
+    }
 
-            // fall through
-        case tcp_usb_write:
-            if (!can_write) {
-                return;
-            }
+    q = &s->queues[tcp_usb_queue_index(h->ep)];
+    if (h->flags & tcp_usb_setup) {
+        // A setup packet aborts the pending control transfer
+        tcp_usb_cancel_queue(s, q);
+    }
 
-            if (s->count < sizeof(s->header)) {
-                ret = send(s->client_socket,
-                        ((char *) &s->header) + s->count,
-                        sizeof(s->header) - s->count, 0);
-                if (ret == 0) {
-                    tcp_usb_client_closed(s);
-                    return;
-                } else if (ret < 0 && errno == ECONNRESET) {
-                    tcp_usb_client_cleanup(s);
-                    return;
-                } else if (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-                    return;
-                } else if (ret < 0) {
-                    fprintf(stderr, "%s: write error %d.\n", __func__, errno);
-                    return;
-                }
-
-                s->count += ret;
-                if (s->count < sizeof(s->header)) {
-                    return;
-                }
-            }
+    QTAILQ_INSERT_TAIL(q, req, next);
+    if (QTAILQ_FIRST(q) == req && tcp_usb_run_queue(s, q) && !s->held) {
+        s->retry_ms = TCP_USB_RETRY_MIN_MS;
+        tcp_usb_set_held(s, true);
+    }
+}
 
-            if ((s->header.ep & USB_DIR_IN) && s->header.length > 0) {
-                ret = send(s->client_socket,
-                        s->buffer + (s->count - sizeof(s->header)),
-                        s->header.length - (s->count - sizeof(s->header)), 0);
-                if (ret == 0) {
-                    tcp_usb_client_closed(s);
-                    return;
-                } else if (ret < 0 && errno == ECONNRESET) {
-                    tcp_usb_client_cleanup(s);
-                    return;
-                } else if (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-                    return;
-                } else if (ret < 0) {
-                    fprintf(stderr, "%s: write error %d.\n", __func__, errno);
-                    return;
-                }
-
-                s->count += ret;
-                if (s->count < sizeof(s->header) + s->header.length) {
-                    return;
-                }
-            }
+// Lets the device raise its interrupts once for all the requests it handled since the last call
+static void tcp_usb_update(TcpUsbState *s)
+{
+    if (!s->dirty) {
+        return;
+    }
+    s->dirty = false;
 
-            if (s->buffer) {
-                free(s->buffer);
-                s->buffer = NULL;
-            }
+    if (s->update) {
+        s->updating = true;
+        s->update(s->callback_arg);
+        s->updating = false;
+    }
+}
+
+static void tcp_usb_retry(TcpUsbState *s)
+{
+    unsigned int i;
+    bool held = false;
 
-            s->state = tcp_usb_read;
-            s->count = 0;
+    for (i = 0; i < TCP_USB_NUM_QUEUES; i++) {
+        held |= tcp_usb_run_queue(s, &s->queues[i]);
     }
+
+    tcp_usb_set_held(s, held);
+
+    tcp_usb_update(s);
+    tcp_usb_update_watch(s);
+}
+
+static void tcp_usb_retry_bh(void *opaque)
+{
+    tcp_usb_retry(opaque);
 }
 
-static void tcp_usb_read_callback(void *arg)
+static void tcp_usb_retry_timer(void *opaque)
 {
-    TcpUsbState *s = arg;
-    tcp_usb_callback(s, 1, 0);
+    TcpUsbState *s = opaque;
+
+    // The device did not kick, poll less often while its requests stay NAKed
+    s->retry_ms = MIN(s->retry_ms * 2, TCP_USB_RETRY_MAX_MS);
+    tcp_usb_retry(s);
 }
 
-static void tcp_usb_write_callback(void *arg)
+void tcp_usb_kick(TcpUsbState *s)
 {
-    TcpUsbState *s = arg;
-    tcp_usb_callback(s, 0, 1);
+    // The update after a batch only reflects requests that were just run
+    if (!s->updating && s->held) {
+        qemu_bh_schedule(s->retry_bh);
+    }
 }
 
-static void tcp_usb_accept(void *arg)
+void tcp_usb_dma(const TcpUsbHeader *header, char *buffer, hwaddr addr, size_t count)
 {
-    TcpUsbState *s = arg;
+    DMADirection dir = (header->ep & USB_DIR_IN) ? DMA_DIRECTION_TO_DEVICE : DMA_DIRECTION_FROM_DEVICE;
+
+    if (count && dma_memory_rw(&address_space_memory, addr, buffer, count, dir)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: failed to access 0x%" HWADDR_PRIx " (%zu bytes)\n", __func__, addr, count);
+    }
+}
+
+// Sends as many responses as possible with one sendmsg
+static bool tcp_usb_flush(TcpUsbState *s)
+{
+    struct iovec iov[TCP_USB_MAX_IOV], *v;
+    unsigned int niov;
+    TcpUsbRequest *req;
+    ssize_t ret;
+    size_t sent;
+
+    while (s->ioc && !QTAILQ_EMPTY(&s->tx)) {
+        niov = 0;
+        QTAILQ_FOREACH(req, &s->tx, next) {
+            if (niov + 2 > ARRAY_SIZE(iov)) {
+                break;
+            }
+            iov[niov++] = (struct iovec) { .iov_base = &req->header, .iov_len = req->hlen };
+            if (req->payload) {
+                iov[niov++] = (struct iovec) { .iov_base = req->buffer, .iov_len = req->payload };
+            }
+        }
+
+        v = iov;
+        iov_discard_front(&v, &niov, s->tx_count);
+
+        ret = qio_channel_writev(s->ioc, v, niov, NULL);
+        if (ret == QIO_CHANNEL_ERR_BLOCK) {
+            break;
+        } else if (ret < 0) {
+            tcp_usb_client_cleanup(s);
+            return false;
+        }
+
+        sent = s->tx_count + ret;
+        while ((req = QTAILQ_FIRST(&s->tx)) && sent >= req->hlen + req->payload) {
+            sent -= req->hlen + req->payload;
+            QTAILQ_REMOVE(&s->tx, req, next);
+            tcp_usb_request_free(s, req);
+        }
+        s->tx_count = sent;
+    }
 
-    int ret = qemu_accept(s->server_socket, NULL, NULL);
-    if (ret < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+    return s->ioc != NULL;
+}
+
+// Reads requests until the socket runs dry, the payload of OUT requests goes straight into the request buffer
+static bool tcp_usb_receive(TcpUsbState *s)
+{
+    TcpUsbRequest *req;
+    size_t hlen, len;
+    ssize_t ret;
+
+    while (s->inflight < TCP_USB_MAX_INFLIGHT || s->rx) {
+        if (!s->rx) {
+            s->rx = tcp_usb_request_new(s);
+            s->rx_count = 0;
+        }
+        req = s->rx;
+        hlen = tcp_usb_header_size(s);
+
+        if (s->rx_count < hlen) {
+            ret = qio_channel_read(s->ioc, (char *) &req->header + s->rx_count, hlen - s->rx_count, NULL);
+        } else {
+            ret = qio_channel_read(s->ioc, req->buffer + (s->rx_count - hlen), req->payload - (s->rx_count - hlen), NULL);
+        }
+
+        if (ret == QIO_CHANNEL_ERR_BLOCK) {
+            break;
+        } else if (ret <= 0) {
+            tcp_usb_client_cleanup(s);
+            return false;
+        }
+
+        s->rx_count += ret;
+        if (s->rx_count < hlen) {
+            continue;
+        }
+
+        if (s->rx_count == hlen && !(req->header.h.flags & tcp_usb_hello)) {
+            len = req->header.h.length;
+            if (req->header.h.length < 0 || len > TCP_USB_MAX_LENGTH) {
+                error_report("tcp_usb: invalid request length %d", req->header.h.length);
+                tcp_usb_client_cleanup(s);
+                return false;
+            }
+            tcp_usb_request_reserve(req, len);
+            req->payload = (req->header.h.ep & USB_DIR_IN) ? 0 : len;
+        }
+
+        if (s->rx_count == hlen + req->payload) {
+            s->rx = NULL;
+            tcp_usb_submit(s, req);
+        }
+    }
+
+    return true;
+}
+
+static gboolean tcp_usb_io(QIOChannel *ioc, GIOCondition cond, gpointer opaque)
+{
+    TcpUsbState *s = opaque;
+
+    if ((cond & (G_IO_IN | G_IO_HUP | G_IO_ERR)) && !tcp_usb_receive(s)) {
+        tcp_usb_update(s);
+        return G_SOURCE_REMOVE;
+    }
+
+    tcp_usb_update(s);
+    tcp_usb_update_watch(s);
+    return s->ioc ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+// Wait for requests while there is room for them, and for buffer space while responses are queued
+static void tcp_usb_update_watch(TcpUsbState *s)
+{
+    GIOCondition cond = 0;
+
+    if (!tcp_usb_flush(s)) {
         return;
-    } else if (ret < 0) {
-        fprintf(stderr, "%s: accept error %d.\n", __func__, errno);
+    }
+
+    if (s->inflight < TCP_USB_MAX_INFLIGHT || s->rx) {
+        cond |= G_IO_IN;
+    }
+    if (!QTAILQ_EMPTY(&s->tx)) {
+        cond |= G_IO_OUT;
+    }
+
+    if (s->watch && cond == s->watch_cond) {
         return;
     }
+    if (s->watch) {
+        g_source_remove(s->watch);
+        s->watch = 0;
+    }
+    s->watch_cond = cond;
+    if (cond) {
+        s->watch = qio_channel_add_watch(s->ioc, cond | G_IO_HUP | G_IO_ERR, tcp_usb_io, s, NULL);
+    }
+}
+
+static void tcp_usb_accept(QIONetListener *listener, QIOChannelSocket *sioc, gpointer opaque)
+{
+    TcpUsbState *s = opaque;
 
-    if (s->client_socket >= 0) {
-        closesocket(ret);
+    if (s->ioc) {
+        qio_channel_close(QIO_CHANNEL(sioc), NULL);
         return;
     }
 
-    s->client_socket = ret;
-    s->state = tcp_usb_read;
-    s->count = 0;
+    s->ioc = QIO_CHANNEL(sioc);
+    object_ref(OBJECT(sioc));
+    qio_channel_set_name(s->ioc, "tcp-usb-client");
+    qio_channel_set_blocking(s->ioc, false, NULL);
+    qio_channel_set_delay(s->ioc, false);
+    s->version = 1;
 
-    qemu_set_nonblock(s->client_socket);
-    socket_set_nodelay(s->client_socket);
-    qemu_set_fd_handler(s->client_socket, tcp_usb_read_callback, tcp_usb_write_callback, s);
+    tcp_usb_update_watch(s);
 }
 
-int tcp_usb_serve(TcpUsbState *s, int port)
+int tcp_usb_serve(TcpUsbState *s, const char *addr, int port)
 {
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = INADDR_ANY;
+    SocketAddress *saddr;
+    Error *err = NULL;
+    char *str;
 
-    if (s->server_socket >= 0) {
+    if (s->listener) {
         return 0;
     }
 
-    s->server_socket = qemu_socket(AF_INET, SOCK_STREAM, 0);
-    if (s->server_socket < 0) {
+    str = addr ? g_strdup(addr) : g_strdup_printf("0.0.0.0:%d", port);
+    saddr = socket_parse(str, &err);
+    g_free(str);
+    if (!saddr) {
+        error_report_err(err);
         return -1;
     }
 
-    if (bind(s->server_socket, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    s->listener = qio_net_listener_new();
+    qio_net_listener_set_name(s->listener, "tcp-usb-listener");
+    if (qio_net_listener_open_sync(s->listener, saddr, 1, &err) < 0) {
+        error_report_err(err);
+        object_unref(OBJECT(s->listener));
+        s->listener = NULL;
+        qapi_free_SocketAddress(saddr);
         return -1;
     }
+    qapi_free_SocketAddress(saddr);
 
-    if (listen(s->server_socket, 1) < 0) {
-        return -1;
-    }
-
-    qemu_set_nonblock(s->server_socket);
-    qemu_set_fd_handler(s->server_socket, tcp_usb_accept, NULL, s);
-
+    qio_net_listener_set_client_func(s->listener, tcp_usb_accept, s, NULL);
     return 0;
 }
@@ -0,0 +1,22 @@
+#ifndef HW_ARM_BIONZ_H
+#define HW_ARM_BIONZ_H
+
+#include "hw/boards.h"
+
+#define TYPE_BIONZ_MACHINE MACHINE_TYPE_NAME("bionz")
+#define BIONZ_MACHINE(obj) OBJECT_CHECK(BionzMachineState, (obj), TYPE_BIONZ_MACHINE)
+
+/* Common base of the cxd* machines, holds their machine options */
+typedef struct BionzMachineState {
+    MachineState parent_obj;
+
+    bool skip_vsync;
+    uint32_t vsync_coalesce;
+    bool stop_on_device_error;
+    bool warp_idle;
+    /* Per-instance overlay of a shared NAND dump */
+    char *nand_base;
+    char *nand_overlay;
+} BionzMachineState;
+
+#endif
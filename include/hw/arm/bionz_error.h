@@ -0,0 +1,11 @@
+#ifndef HW_ARM_BIONZ_ERROR_H
+#define HW_ARM_BIONZ_ERROR_H
+
+/*
+ * Reports a command that a BIONZ peripheral cannot execute. The caller
+ * completes the command with an error status instead of aborting; this
+ * logs the error, emits BIONZ_DEVICE_ERROR and pauses the VM if requested.
+ */
+void bionz_error(Object *dev, const char *fmt, ...) GCC_FMT_ATTR(2, 3);
+
+#endif
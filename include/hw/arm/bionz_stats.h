@@ -0,0 +1,36 @@
+#ifndef HW_ARM_BIONZ_STATS_H
+#define HW_ARM_BIONZ_STATS_H
+
+#include "qemu/queue.h"
+#include "qemu/timer.h"
+
+/* Activity counters of a BIONZ peripheral, reported by query-bionz-stats */
+typedef struct BionzStats {
+    Object *owner;
+    uint64_t commands;
+    uint64_t bytes;
+    uint64_t time_ns;
+    QTAILQ_ENTRY(BionzStats) next;
+} BionzStats;
+
+void bionz_stats_register(BionzStats *st, Object *owner);
+
+static inline int64_t bionz_stats_start(void)
+{
+    return get_clock();
+}
+
+/* Account the time since start and the commands completed and bytes moved in it */
+static inline void bionz_stats_add(BionzStats *st, unsigned int commands, int64_t start, uint64_t bytes)
+{
+    st->commands += commands;
+    st->bytes += bytes;
+    st->time_ns += get_clock() - start;
+}
+
+static inline void bionz_stats_end(BionzStats *st, int64_t start, uint64_t bytes)
+{
+    bionz_stats_add(st, 1, start, bytes);
+}
+
+#endif
@@ -145,6 +145,10 @@ typedef struct {
  *    false is returned, an error must be set to show the reason of
  *    the rejection.  If the hook is not provided, all hotplug will be
  *    allowed.
+ * @idle_warp_allowed:
+ *    If the hook is provided and returns true, QEMU_CLOCK_VIRTUAL jumps to
+ *    its next deadline while all vCPUs are halted and no device work is in
+ *    flight, instead of following the host clock.  Ignored with -icount.
  * @default_ram_id:
  *    Specifies inital RAM MemoryRegion name to be used for default backend
  *    creation if user explicitly hasn't specified backend with "memory-backend"
@@ -221,6 +225,7 @@ struct MachineClass {
                                            DeviceState *dev);
     bool (*hotplug_allowed)(MachineState *state, DeviceState *dev,
                             Error **errp);
+    bool (*idle_warp_allowed)(MachineState *state);
     CpuInstanceProperties (*cpu_index_to_instance_props)(MachineState *machine,
                                                          unsigned cpu_index);
     const CPUArchIdList *(*possible_cpu_arch_ids)(MachineState *machine);
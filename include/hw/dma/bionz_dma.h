@@ -0,0 +1,30 @@
+#ifndef HW_DMA_BIONZ_DMA_H
+#define HW_DMA_BIONZ_DMA_H
+
+#include "qom/object.h"
+
+#define TYPE_BIONZ_DMA_PERIPHERAL "bionz-dma-peripheral"
+
+#define BIONZ_DMA_PERIPHERAL_CLASS(klass) \
+     OBJECT_CLASS_CHECK(BionzDmaPeripheralClass, (klass), TYPE_BIONZ_DMA_PERIPHERAL)
+#define BIONZ_DMA_PERIPHERAL_GET_CLASS(obj) \
+    OBJECT_GET_CLASS(BionzDmaPeripheralClass, (obj), TYPE_BIONZ_DMA_PERIPHERAL)
+#define BIONZ_DMA_PERIPHERAL(obj) \
+     INTERFACE_CHECK(BionzDmaPeripheral, (obj), TYPE_BIONZ_DMA_PERIPHERAL)
+
+typedef struct BionzDmaPeripheral BionzDmaPeripheral;
+
+/*
+ * A peripheral linked to a request line of bionz_dma is accessed through these
+ * instead of its fifo registers. Both return the number of bytes transferred;
+ * a short count stalls the channel until the peripheral raises the request line
+ * again.
+ */
+typedef struct BionzDmaPeripheralClass {
+    InterfaceClass parent;
+
+    size_t (*read)(BionzDmaPeripheral *obj, uint8_t *buf, size_t len);
+    size_t (*write)(BionzDmaPeripheral *obj, const uint8_t *buf, size_t len);
+} BionzDmaPeripheralClass;
+
+#endif
@@ -20,16 +20,21 @@
 #ifndef HW_TCP_USB
 #define HW_TCP_USB
 
+#include "exec/hwaddr.h"
+#include "io/channel.h"
+#include "io/net-listener.h"
+#include "qemu/queue.h"
+#include "qemu/timer.h"
+
+#define TCP_USB_VERSION 2
+#define TCP_USB_NUM_QUEUES 32
+
 typedef enum TcpUsbFlagEnum {
     tcp_usb_setup = 1 << 0,
     tcp_usb_reset = 1 << 1,
+    tcp_usb_hello = 1 << 2,
 } TcpUsbFlagEnum;
 
-typedef enum TcpUsbStateEnum {
-    tcp_usb_read,
-    tcp_usb_write,
-} TcpUsbStateEnum;
-
 typedef struct TcpUsbHeader {
     uint8_t flags;
     uint8_t ep;
@@ -38,23 +43,87 @@ typedef struct TcpUsbHeader {
 } TcpUsbHeader;
 QEMU_BUILD_BUG_ON(sizeof(TcpUsbHeader) != 8);
 
+/*
+ * Version 1 clients send one request and wait for its response. A client
+ * selects version 2 by sending a hello header (flags tcp_usb_hello, length
+ * set to the highest version it speaks) as its first request. The response
+ * length is the version used from then on.
+ *
+ * Version 2 headers carry a tag that the response echoes, and requests may
+ * be pipelined. Requests for one endpoint complete in order. A NAKed request
+ * is held and retried when the device changes state instead of being
+ * returned to the client. Setup and reset requests complete the held
+ * requests they supersede with USB_RET_NAK.
+ */
+typedef struct TcpUsbHeader2 {
+    TcpUsbHeader h;
+    uint32_t tag;
+} TcpUsbHeader2;
+QEMU_BUILD_BUG_ON(sizeof(TcpUsbHeader2) != 12);
+
 typedef int (*TcpUsbCallback)(void *arg, const TcpUsbHeader *header, char *buffer);
+typedef void (*TcpUsbUpdate)(void *arg);
 
-typedef struct TcpUsbState {
-    int server_socket;
-    int client_socket;
+typedef struct TcpUsbRequest {
+    TcpUsbHeader2 header;
+    size_t hlen;
+    size_t payload;
 
-    TcpUsbStateEnum state;
-    TcpUsbHeader header;
     char *buffer;
-    size_t count;
+    size_t size;
+
+    QTAILQ_ENTRY(TcpUsbRequest) next;
+} TcpUsbRequest;
+
+typedef QTAILQ_HEAD(, TcpUsbRequest) TcpUsbRequestQueue;
+
+typedef struct TcpUsbState {
+    QIONetListener *listener;
+    QIOChannel *ioc;
+    guint watch;
+    GIOCondition watch_cond;
+    int version;
+
+    // Request being received
+    TcpUsbRequest *rx;
+    size_t rx_count;
+
+    // Received requests per endpoint, the first one may be held after a NAK
+    TcpUsbRequestQueue queues[TCP_USB_NUM_QUEUES];
+    QEMUBH *retry_bh;
+    QEMUTimer *retry_timer;
+    unsigned int retry_ms;
+    // The retry timer is pending as long as requests are held
+    bool held;
+
+    // Completed requests whose response is not sent yet
+    TcpUsbRequestQueue tx;
+    size_t tx_count;
+
+    TcpUsbRequestQueue pool;
+    unsigned int pool_size;
+    unsigned int inflight;
 
     TcpUsbCallback callback;
+    TcpUsbUpdate update;
     void *callback_arg;
+
+    // Requests were passed to the device since its last update
+    bool dirty;
+    bool updating;
 } TcpUsbState;
 
-void tcp_usb_init(TcpUsbState *s, TcpUsbCallback callback, void *arg);
+/*
+ * callback handles one request. update is called once after a batch of
+ * requests, the device raises its interrupts there instead of in callback.
+ */
+void tcp_usb_init(TcpUsbState *s, TcpUsbCallback callback, TcpUsbUpdate update, void *arg);
 void tcp_usb_cleanup(TcpUsbState *s);
-int tcp_usb_serve(TcpUsbState *s, int port);
+/* Listens on addr (a socket address such as unix:/path or host:port) or on TCP port if addr is NULL */
+int tcp_usb_serve(TcpUsbState *s, const char *addr, int port);
+/* Called by the device when its endpoint state changes, retries held requests */
+void tcp_usb_kick(TcpUsbState *s);
+/* Copies count bytes between a request buffer and guest memory at addr, in the direction of the endpoint */
+void tcp_usb_dma(const TcpUsbHeader *header, char *buffer, hwaddr addr, size_t count);
 
 #endif
@@ -1,6 +1,48 @@
 #ifndef __LZ77_H__
 #define __LZ77_H__
 
+#define LZ77_WINDOW_SIZE 0x1000
+#define LZ77_BLOCK_SIZE 0x1000
+
+typedef enum LZ77StreamState {
+    LZ77_STATE_TYPE,
+    LZ77_STATE_RAW_HEADER,
+    LZ77_STATE_RAW,
+    LZ77_STATE_FLAGS,
+    LZ77_STATE_ITEM,
+    LZ77_STATE_CODEWORD,
+    LZ77_STATE_COPY,
+    LZ77_STATE_ERROR,
+} LZ77StreamState;
+
+/*
+ * Resumable decoder. Input can be fed in arbitrary pieces; the output is kept
+ * in a ring buffer the size of the window until it is read.
+ */
+typedef struct LZ77Stream {
+    uint8_t window[LZ77_WINDOW_SIZE];
+    uint32_t wpos;
+    uint32_t rpos;
+
+    uint32_t state;
+    uint32_t flags;
+    uint32_t items;
+    uint32_t code;
+    uint32_t code_len;
+    uint32_t len;
+    uint32_t dist;
+    uint32_t block_out;
+} LZ77Stream;
+
 int lz77_inflate(unsigned char *src, int len, unsigned char *dst, int dst_len, unsigned char **sd);
 
+void lz77_stream_init(LZ77Stream *s);
+/* Returns the number of input bytes consumed (less than len if the output ring is full), or -1 on error */
+int lz77_stream_write(LZ77Stream *s, const unsigned char *src, int len);
+/* Returns the number of output bytes copied to dst */
+int lz77_stream_read(LZ77Stream *s, unsigned char *dst, int len);
+int lz77_stream_avail(LZ77Stream *s);
+/* Checks a decoder state that was loaded from outside, e.g. by migration */
+bool lz77_stream_valid(const LZ77Stream *s);
+
 #endif
@@ -231,6 +231,14 @@ void qemu_clock_enable(QEMUClockType type, bool enabled);
  */
 void qemu_start_warp_timer(void);
 
+/**
+ * qemu_idle_warp:
+ *
+ * Advances QEMU_CLOCK_VIRTUAL to its next deadline if idle warp is
+ * enabled and the guest can only make progress through a timer
+ */
+void qemu_idle_warp(void);
+
 /**
  * qemu_clock_run_timers:
  * @type: clock on which to operate
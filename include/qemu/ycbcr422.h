@@ -0,0 +1,56 @@
+#ifndef __YCBCR422_H__
+#define __YCBCR422_H__
+
+/* Filter weights are fixed point with this many fractional bits */
+#define YCBCR422_WEIGHT_BITS 7
+
+/*
+ * Separable resampling filter. Output sample i is the weighted sum of
+ * taps source samples starting at start[i].
+ */
+typedef struct YCbCr422Filter {
+    unsigned int n;
+    unsigned int taps;
+    int *start;
+    uint8_t *weights;
+
+    /* Weights for SIMD loads of the packed row, NULL when there are too many taps */
+    int16_t *wvec;
+    unsigned int simd_n;
+} YCbCr422Filter;
+
+/*
+ * Resizes images of pixel pairs laid out as Cb Y0 Cr Y1. Positions and
+ * scale factors are in 1/4096 source pixels. Upscaling is bilinear; when
+ * downscaling the filter widens so that every output sample averages its
+ * whole source footprint.
+ */
+typedef struct YCbCr422Scaler {
+    unsigned int src_width;
+    unsigned int src_height;
+    unsigned int dst_width;
+    unsigned int dst_height;
+
+    YCbCr422Filter luma;
+    YCbCr422Filter chroma;
+    YCbCr422Filter vert;
+
+    /* Horizontally scaled source rows as planar Y, Cb and Cr, reused across output rows */
+    unsigned int ring_size;
+    int *ring_row;
+    uint8_t *ring;
+    uint8_t *out;
+} YCbCr422Scaler;
+
+/* Interleave n pairs of planar samples */
+void ycbcr422_pack(uint8_t *dst, const uint8_t *y, const uint8_t *cb, const uint8_t *cr, unsigned int n);
+
+/* All dimensions must be non-zero */
+void ycbcr422_scaler_init(YCbCr422Scaler *sc, unsigned int src_width, unsigned int src_height,
+                          unsigned int dst_width, unsigned int dst_height,
+                          int32_t offset_x, int32_t offset_y, uint32_t scale_x, uint32_t scale_y);
+void ycbcr422_scaler_destroy(YCbCr422Scaler *sc);
+/* src points to row 0 of the source image, both widths are in pixels and must be even */
+void ycbcr422_scale(YCbCr422Scaler *sc, uint8_t *dst, ptrdiff_t dst_stride, const uint8_t *src, ptrdiff_t src_stride);
+
+#endif
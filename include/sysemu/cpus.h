@@ -15,6 +15,14 @@ void configure_icount(QemuOpts *opts, Error **errp);
 extern int use_icount;
 extern int icount_align_option;
 
+/*
+ * Bracket device work that completes outside the vCPUs, such as a bottom
+ * half or a request on a worker thread.  Idle warp waits for it, as the
+ * guest would see it complete in no time.  Called with the BQL held.
+ */
+void qemu_device_work_begin(void);
+void qemu_device_work_end(void);
+
 /* drift information for info jit command */
 extern int64_t max_delay;
 extern int64_t max_advance;
@@ -236,6 +236,7 @@ static MonitorQAPIEventConf monitor_qapi_event_conf[QAPI_EVENT__MAX] = {
     [QAPI_EVENT_QUORUM_FAILURE]    = { 1000 * SCALE_MS },
     [QAPI_EVENT_VSERPORT_CHANGE]   = { 1000 * SCALE_MS },
     [QAPI_EVENT_MEMORY_DEVICE_SIZE_CHANGE] = { 1000 * SCALE_MS },
+    [QAPI_EVENT_BIONZ_DEVICE_ERROR] = { 1000 * SCALE_MS },
 };
 
 /*
@@ -418,6 +419,10 @@ static unsigned int qapi_event_throttle_hash(const void *key)
         hash += g_str_hash(qdict_get_str(evstate->data, "node-name"));
     }
 
+    if (evstate->event == QAPI_EVENT_BIONZ_DEVICE_ERROR) {
+        hash += g_str_hash(qdict_get_str(evstate->data, "path"));
+    }
+
     return hash;
 }
 
@@ -440,6 +445,11 @@ static gboolean qapi_event_throttle_equal(const void *a, const void *b)
                        qdict_get_str(evb->data, "node-name"));
     }
 
+    if (eva->event == QAPI_EVENT_BIONZ_DEVICE_ERROR) {
+        return !strcmp(qdict_get_str(eva->data, "path"),
+                       qdict_get_str(evb->data, "path"));
+    }
+
     return TRUE;
 }
 
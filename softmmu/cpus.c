@@ -171,6 +171,9 @@ typedef struct TimersState {
 static TimersState timers_state;
 bool mttcg_enabled;
 
+/* Device work in flight, see qemu_device_work_begin().  Protected by BQL.  */
+static unsigned int device_work;
+
 
 /* The current number of executed instructions is based on what we
  * originally budgeted minus the current state of the decrementing
@@ -635,6 +638,69 @@ static void qemu_account_warp_timer(void)
     icount_warp_rt();
 }
 
+void qemu_device_work_begin(void)
+{
+    device_work++;
+}
+
+void qemu_device_work_end(void)
+{
+    assert(device_work > 0);
+    device_work--;
+}
+
+static bool idle_warp_allowed(void)
+{
+    MachineClass *mc;
+
+    if (!current_machine) {
+        return false;
+    }
+    mc = MACHINE_GET_CLASS(current_machine);
+    return mc->idle_warp_allowed && mc->idle_warp_allowed(current_machine);
+}
+
+/*
+ * Without icount QEMU_CLOCK_VIRTUAL follows the host clock, so a guest that
+ * waits for a timer in WFI waits just as long in real time.  If the machine
+ * allows idle warp, the clock jumps to the next deadline instead, as soon as
+ * all vCPUs are halted and no device work is in flight.  The vCPUs notify
+ * the main loop when they go idle, and it calls this before running its
+ * timers.
+ */
+void qemu_idle_warp(void)
+{
+    int64_t deadline;
+
+    if (use_icount || qtest_enabled() || !idle_warp_allowed()) {
+        return;
+    }
+
+    if (!runstate_is_running() || !all_cpu_threads_idle()) {
+        return;
+    }
+
+    /* The guest would notice work that completes in no time.  */
+    if (device_work) {
+        return;
+    }
+
+    deadline = qemu_clock_deadline_ns_all(QEMU_CLOCK_VIRTUAL,
+                                          ~QEMU_TIMER_ATTR_EXTERNAL);
+    if (deadline <= 0) {
+        return;
+    }
+
+    seqlock_write_lock(&timers_state.vm_clock_seqlock,
+                       &timers_state.vm_clock_lock);
+    timers_state.cpu_clock_offset += deadline;
+    seqlock_write_unlock(&timers_state.vm_clock_seqlock,
+                         &timers_state.vm_clock_lock);
+
+    /* Also makes the next main loop iteration check again without sleeping */
+    qemu_clock_notify(QEMU_CLOCK_VIRTUAL);
+}
+
 static bool icount_state_needed(void *opaque)
 {
     return use_icount;
@@ -1141,6 +1207,10 @@ static void qemu_wait_io_event(CPUState *cpu)
         if (!slept) {
             slept = true;
             qemu_plugin_vcpu_idle_cb(cpu);
+            /* The last vCPU to halt lets the main loop warp the clock.  */
+            if (idle_warp_allowed() && all_cpu_threads_idle()) {
+                qemu_notify_event();
+            }
         }
         qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
     }
@@ -1486,7 +1556,7 @@ static void *qemu_tcg_rr_cpu_thread_fn(void *arg)
             atomic_mb_set(&cpu->exit_request, 0);
         }
 
-        if (use_icount && all_cpu_threads_idle()) {
+        if ((use_icount || idle_warp_allowed()) && all_cpu_threads_idle()) {
             /*
              * When all cpus are sleeping (e.g in WFI), to avoid a deadlock
              * in the main_loop, wake it up in order to start the warp timer.
@@ -5,3 +5,7 @@ void qemu_start_warp_timer(void)
 {
 }
 
+void qemu_idle_warp(void)
+{
+}
+
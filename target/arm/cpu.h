@@ -2370,7 +2370,8 @@ static inline uint64_t cpreg_to_kvm_id(uint32_t cpregid)
 #define ARM_CP_DC_ZVA            (ARM_CP_SPECIAL | 0x0500)
 #define ARM_CP_DC_GVA            (ARM_CP_SPECIAL | 0x0600)
 #define ARM_CP_DC_GZVA           (ARM_CP_SPECIAL | 0x0700)
-#define ARM_LAST_SPECIAL         ARM_CP_DC_GZVA
+#define ARM_CP_BARRIER           (ARM_CP_SPECIAL | 0x0800)
+#define ARM_LAST_SPECIAL         ARM_CP_BARRIER
 #define ARM_CP_FPU               0x1000
 #define ARM_CP_SVE               0x2000
 #define ARM_CP_NO_GDB            0x4000
@@ -4668,6 +4668,9 @@ static int disas_coproc_insn(DisasContext *s, uint32_t insn)
         switch (ri->type & ~(ARM_CP_FLAG_MASK & ~ARM_CP_SPECIAL)) {
         case ARM_CP_NOP:
             return 0;
+        case ARM_CP_BARRIER:
+            tcg_gen_mb(TCG_MO_ALL | TCG_BAR_SC);
+            return 0;
         case ARM_CP_WFI:
             if (isread) {
                 return 1;
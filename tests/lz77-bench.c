@@ -0,0 +1,247 @@
+/*
+ * Benchmark and differential check for lz77_inflate
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/lz77.h"
+#include "qemu/timer.h"
+
+static const int ref_len_table[] = {
+    3, 4, 5, 6, 7, 8, 9, 10,
+    11, 12, 13, 14, 15, 16,
+    32, 64
+};
+
+static unsigned int duration = 1;
+static unsigned int block_size = 16;
+static unsigned long offset;
+
+static const char commands_string[] =
+    " -d = duration in seconds\n"
+    " -b = log2 of the size each block inflates to (default: 16)\n"
+    " -o = offset of the first compressed block in each file";
+
+static void usage_complete(char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options] FILE...\n", argv[0]);
+    fprintf(stderr, "options:\n%s\n", commands_string);
+}
+
+/* Byte-at-a-time decoder that lz77_inflate has to match exactly */
+static int ref_inflate(unsigned char *src, int src_len, unsigned char *dst, int dst_len, unsigned char **sd)
+{
+    int type, u_i, l, bd;
+    unsigned char *s = src, *d = dst;
+    unsigned char *de = dst + dst_len;
+    unsigned char *se = src + src_len - 1;
+
+    if (!src || src_len < 4 || !dst) {
+        return -1;
+    }
+
+    switch (*s++) {
+        case 0xF0:
+            while (s < se) {
+                u_i = 0;
+                type = *s++;
+
+                while (u_i++ < 8 && s < se) {
+                    if (type & 1) {
+                        l = (s[0] & 0xF0) >> 4;
+                        l = ref_len_table[l];
+                        l = de - d > l ? l : de - d;
+                        bd = ((s[0] & 0x0F) << 8) | s[1];
+                        s += 2;
+
+                        if (bd) {
+                            while (l--) {
+                                *d = *(d - bd);
+                                d++;
+                            }
+                        } else {
+                            goto inflate_end;
+                        }
+                    } else {
+                        *d++ = *s++;
+                    }
+
+                    type >>= 1;
+                }
+            }
+            break;
+
+        case 0x0F:
+            l = s[1] | (s[2] << 8);
+            l = dst_len > l ? l : dst_len;
+            s += 3;
+            memcpy(d, s, l);
+            d += l;
+            s += l;
+            break;
+
+        default:
+            return -1;
+    }
+
+inflate_end:
+    if (sd) {
+        *sd = s;
+    }
+
+    return d - dst;
+}
+
+typedef int (*InflateFunc)(unsigned char *, int, unsigned char *, int, unsigned char **);
+
+/*
+ * Inflate one block the way bionz_meno does, until either buffer is exhausted.
+ * Returns the number of bytes written and advances *src.
+ */
+static size_t inflate_block(InflateFunc fn, unsigned char **src, unsigned char *src_end, unsigned char *dst, size_t dst_size)
+{
+    unsigned char *d = dst;
+    int res;
+
+    while (*src < src_end && d < dst + dst_size) {
+        res = fn(*src, src_end - *src, d, dst + dst_size - d, src);
+        if (res < 0) {
+            break;
+        }
+        d += res;
+    }
+
+    return d - dst;
+}
+
+static bool check(unsigned char *src, size_t src_size, unsigned char *ref, unsigned char *dst, size_t dst_size,
+                  size_t *out_size)
+{
+    unsigned char *ref_src = src, *dst_src = src;
+    size_t ref_len, dst_len;
+
+    *out_size = 0;
+    while (ref_src < src + src_size) {
+        ref_len = inflate_block(ref_inflate, &ref_src, src + src_size, ref, dst_size);
+        dst_len = inflate_block(lz77_inflate, &dst_src, src + src_size, dst, dst_size);
+        if (ref_len != dst_len || ref_src != dst_src || memcmp(ref, dst, dst_len)) {
+            return false;
+        }
+        if (!ref_len) {
+            break;
+        }
+        *out_size += dst_len;
+    }
+
+    return true;
+}
+
+static double run_bench(InflateFunc fn, unsigned char *src, size_t src_size, unsigned char *dst, size_t dst_size)
+{
+    int64_t start, end, deadline;
+    uint64_t bytes = 0;
+    unsigned char *s;
+    size_t len;
+
+    start = get_clock();
+    deadline = start + duration * NANOSECONDS_PER_SECOND;
+    do {
+        s = src;
+        do {
+            len = inflate_block(fn, &s, src + src_size, dst, dst_size);
+            bytes += len;
+        } while (len && s < src + src_size);
+        end = get_clock();
+    } while (end < deadline);
+
+    return (double) bytes / (end - start) * NANOSECONDS_PER_SECOND / MiB;
+}
+
+static int run_file(const char *path)
+{
+    GError *err = NULL;
+    gchar *contents;
+    gsize len;
+    unsigned char *src, *ref, *dst;
+    size_t dst_size = (size_t) 1 << block_size;
+    size_t out_size;
+    int ret = 0;
+
+    if (!g_file_get_contents(path, &contents, &len, &err)) {
+        fprintf(stderr, "%s: %s\n", path, err->message);
+        g_error_free(err);
+        return 1;
+    }
+    if (offset >= len) {
+        fprintf(stderr, "%s: offset beyond end of file\n", path);
+        g_free(contents);
+        return 1;
+    }
+
+    /*
+     * The reference decoder does not bound literals against the end of the
+     * output, give it one block of slack.
+     */
+    ref = g_malloc0(dst_size + LZ77_BLOCK_SIZE);
+    dst = g_malloc0(dst_size + LZ77_BLOCK_SIZE);
+
+    src = (unsigned char *) contents + offset;
+    if (!check(src, len - offset, ref, dst, dst_size, &out_size)) {
+        fprintf(stderr, "%s: output differs from the reference decoder\n", path);
+        ret = 1;
+    } else {
+        printf("%s: %zu -> %zu bytes\n", path, len - offset, out_size);
+        printf(" reference: %.2f MB/s\n", run_bench(ref_inflate, src, len - offset, ref, dst_size));
+        printf(" lz77_inflate: %.2f MB/s\n", run_bench(lz77_inflate, src, len - offset, dst, dst_size));
+    }
+
+    g_free(ref);
+    g_free(dst);
+    g_free(contents);
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int c, i, ret = 0;
+
+    for (;;) {
+        c = getopt(argc, argv, "hd:b:o:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'h':
+            usage_complete(argv);
+            return 0;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'b':
+            block_size = atoi(optarg);
+            if (block_size > 30) {
+                fprintf(stderr, "block size too large\n");
+                return 1;
+            }
+            break;
+        case 'o':
+            offset = strtoul(optarg, NULL, 0);
+            break;
+        case '?':
+            usage_complete(argv);
+            return 1;
+        }
+    }
+
+    if (optind == argc) {
+        usage_complete(argv);
+        return 1;
+    }
+
+    for (i = optind; i < argc; i++) {
+        ret |= run_file(argv[i]);
+    }
+
+    return ret;
+}
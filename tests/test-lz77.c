@@ -0,0 +1,154 @@
+/*
+ * LZ77Stream unit-tests.
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/lz77.h"
+
+#define NUM_BLOCKS 32
+#define MAX_CHUNK 0x2000
+
+static const int len_table[] = {
+    3, 4, 5, 6, 7, 8, 9, 10,
+    11, 12, 13, 14, 15, 16,
+    32, 64
+};
+
+/* Letters from a small alphabet, so that the output also compresses */
+static uint8_t rand_byte(void)
+{
+    return 'a' + g_test_rand_int_range(0, 4);
+}
+
+static void put_byte(GByteArray *src, uint8_t b)
+{
+    g_byte_array_append(src, &b, 1);
+}
+
+/* Appends a compressed block, returns the number of bytes it inflates to */
+static size_t gen_compressed(GByteArray *src, size_t produced)
+{
+    size_t out = 0;
+    unsigned int i, flags_pos, idx, dist;
+
+    put_byte(src, 0xF0);
+    for (;;) {
+        flags_pos = src->len;
+        put_byte(src, 0);
+
+        for (i = 0; i < 8; i++) {
+            if (out + len_table[ARRAY_SIZE(len_table) - 1] > LZ77_BLOCK_SIZE || !g_test_rand_int_range(0, 256)) {
+                // End of block
+                src->data[flags_pos] |= 1 << i;
+                put_byte(src, 0);
+                put_byte(src, 0);
+                return out;
+            } else if (produced + out && g_test_rand_bit()) {
+                idx = g_test_rand_int_range(0, ARRAY_SIZE(len_table));
+                dist = g_test_rand_int_range(1, MIN(produced + out, LZ77_WINDOW_SIZE - 1) + 1);
+                src->data[flags_pos] |= 1 << i;
+                put_byte(src, (idx << 4) | (dist >> 8));
+                put_byte(src, dist & 0xff);
+                out += len_table[idx];
+            } else {
+                put_byte(src, rand_byte());
+                out++;
+            }
+        }
+    }
+}
+
+/* Appends a raw block, returns its length */
+static size_t gen_raw(GByteArray *src)
+{
+    size_t i, len = g_test_rand_int_range(0, LZ77_BLOCK_SIZE + 1);
+
+    put_byte(src, 0x0F);
+    put_byte(src, 0);
+    put_byte(src, len & 0xff);
+    put_byte(src, len >> 8);
+    for (i = 0; i < len; i++) {
+        put_byte(src, rand_byte());
+    }
+    return len;
+}
+
+/* Inflates the blocks one after the other, like bionz_meno */
+static size_t inflate_all(GByteArray *src, uint8_t *dst)
+{
+    unsigned char *s = src->data, *end = src->data + src->len;
+    size_t out = 0;
+    int res;
+
+    while (s < end) {
+        res = lz77_inflate(s, end - s, dst + out, LZ77_BLOCK_SIZE, &s);
+        g_assert_cmpint(res, >=, 0);
+        out += res;
+    }
+    return out;
+}
+
+static void test_lz77_stream_chunks(void)
+{
+    GByteArray *src = g_byte_array_new();
+    LZ77Stream *stream = g_new(LZ77Stream, 1);
+    uint8_t *ref, *dst;
+    size_t produced = 0, pos = 0, out = 0, ref_len;
+    unsigned int i;
+    int chunk, n, r;
+
+    for (i = 0; i < NUM_BLOCKS; i++) {
+        produced += g_test_rand_int_range(0, 4) ? gen_compressed(src, produced) : gen_raw(src);
+    }
+
+    // lz77_inflate may write a few bytes past the end of a block
+    ref = g_malloc0(produced + LZ77_BLOCK_SIZE);
+    dst = g_malloc0(produced + MAX_CHUNK);
+    ref_len = inflate_all(src, ref);
+    g_assert_cmpuint(ref_len, ==, produced);
+
+    lz77_stream_init(stream);
+    while (pos < src->len || stream->state != LZ77_STATE_TYPE || lz77_stream_avail(stream)) {
+        chunk = g_test_rand_int_range(0, MAX_CHUNK);
+        n = lz77_stream_write(stream, src->data + pos, MIN(chunk, src->len - pos));
+        g_assert_cmpint(n, >=, 0);
+        pos += n;
+        g_assert(lz77_stream_valid(stream));
+
+        chunk = g_test_rand_int_range(0, MAX_CHUNK);
+        r = lz77_stream_read(stream, dst + out, chunk);
+        out += r;
+        g_assert_cmpuint(out, <=, ref_len);
+    }
+
+    g_assert_cmpuint(out, ==, ref_len);
+    g_assert_cmpmem(dst, out, ref, ref_len);
+
+    g_free(dst);
+    g_free(ref);
+    g_free(stream);
+    g_byte_array_free(src, true);
+}
+
+static void test_lz77_stream_invalid(void)
+{
+    LZ77Stream *stream = g_new(LZ77Stream, 1);
+    static const unsigned char src[] = { 0x55, 0x00, 0x00, 0x00 };
+
+    lz77_stream_init(stream);
+    g_assert_cmpint(lz77_stream_write(stream, src, sizeof(src)), ==, -1);
+    g_assert(!lz77_stream_valid(stream));
+
+    g_free(stream);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/lz77/stream/chunks", test_lz77_stream_chunks);
+    g_test_add_func("/lz77/stream/invalid", test_lz77_stream_invalid);
+    return g_test_run();
+}
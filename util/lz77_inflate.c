@@ -22,6 +22,8 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
 #include "qemu/lz77.h"
 
 static const int len_table[] = {
@@ -30,10 +32,23 @@ static const int len_table[] = {
     32, 64
 };
 
+/*
+ * Copies up to 7 bytes more than requested, callers must leave room for it
+ * in both the source and destination buffers.
+ */
+static inline void lz77_copy_wide(unsigned char *d, const unsigned char *s, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i += 8) {
+        stq_he_p(d + i, ldq_he_p(s + i));
+    }
+}
+
 int lz77_inflate(unsigned char *src, int src_len, unsigned char *dst, int dst_len, unsigned char **sd)
 {
-    int type, u_i, l, bd;
-    unsigned char *s = src, *d = dst;
+    int type, u_i, l, bd, n;
+    unsigned char *s = src, *d = dst, *m;
     unsigned char *de = dst + dst_len;
     unsigned char *se = src + src_len - 1;
 
@@ -47,7 +62,7 @@ int lz77_inflate(unsigned char *src, int src_len, unsigned char *dst, int dst_le
                 u_i = 0;
                 type = *s++;
 
-                while (u_i++ < 8 && s < se) {
+                while (u_i < 8 && s < se) {
                     if (type & 1) {// codeword
                         l = (s[0] & 0xF0) >> 4;
                         l = len_table[l];
@@ -55,19 +70,46 @@ int lz77_inflate(unsigned char *src, int src_len, unsigned char *dst, int dst_le
                         bd = ((s[0] & 0x0F) << 8) | s[1];
                         s += 2;
 
-                        if (bd) {
-                            while (l--) {
-                                *d = *(d - bd);
-                                d++;
+                        if (!bd) {
+                            goto inflate_end;
+                        } else if (bd >= 8 && de - d >= l + 8) {
+                            lz77_copy_wide(d, d - bd, l);
+                            d += l;
+                        } else if (bd >= l) {
+                            memcpy(d, d - bd, l);
+                            d += l;
+                        } else if (bd == 1) {
+                            memset(d, d[-1], l);
+                            d += l;
+                        } else {
+                            // Overlapping match: the source pattern doubles with every copy
+                            m = d - bd;
+                            while (l) {
+                                n = MIN(l, d - m);
+                                memcpy(d, m, n);
+                                d += n;
+                                l -= n;
                             }
+                        }
+
+                        type >>= 1;
+                        u_i++;
+                    } else {// run of literals
+                        n = ctz32(type | (1 << (8 - u_i)));
+                        n = MIN(n, se - s);
+                        if (se - s >= 8 && de - d >= 8) {
+                            lz77_copy_wide(d, s, 1);
+                            d += n;
                         } else {
-                            goto inflate_end;
+                            // Literals beyond the end of the output are skipped
+                            memcpy(d, s, MIN(n, de - d));
+                            d += MIN(n, de - d);
                         }
-                    } else {
-                        *d++ = *s++;
-                    }
+                        s += n;
 
-                    type >>= 1;
+                        type >>= n;
+                        u_i += n;
+                    }
                 }
             }
             break;
@@ -92,3 +134,196 @@ inflate_end:
 
     return d - dst;
 }
+
+void lz77_stream_init(LZ77Stream *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->state = LZ77_STATE_TYPE;
+}
+
+int lz77_stream_avail(LZ77Stream *s)
+{
+    return s->wpos - s->rpos;
+}
+
+bool lz77_stream_valid(const LZ77Stream *s)
+{
+    if (s->wpos - s->rpos > LZ77_WINDOW_SIZE || s->items > 8) {
+        return false;
+    }
+
+    switch (s->state) {
+        case LZ77_STATE_TYPE:
+        case LZ77_STATE_FLAGS:
+        case LZ77_STATE_ITEM:
+            return true;
+
+        case LZ77_STATE_RAW_HEADER:
+            return s->code_len < 3;
+
+        case LZ77_STATE_RAW:
+            return s->len <= LZ77_BLOCK_SIZE;
+
+        case LZ77_STATE_CODEWORD:
+            // The length table is indexed with the top bits of the complete codeword
+            return s->code_len < 2 && !(s->code >> (8 * s->code_len));
+
+        case LZ77_STATE_COPY:
+            return s->dist && s->dist < LZ77_WINDOW_SIZE && s->len <= len_table[ARRAY_SIZE(len_table) - 1];
+
+        default:
+            return false;
+    }
+}
+
+static inline int lz77_stream_space(LZ77Stream *s)
+{
+    return LZ77_WINDOW_SIZE - lz77_stream_avail(s);
+}
+
+static inline void lz77_stream_put(LZ77Stream *s, unsigned char c)
+{
+    s->window[s->wpos++ % LZ77_WINDOW_SIZE] = c;
+    s->block_out++;
+}
+
+int lz77_stream_write(LZ77Stream *s, const unsigned char *src, int len)
+{
+    const unsigned char *p = src, *pe = src + len;
+    int n;
+
+    for (;;) {
+        switch (s->state) {
+            case LZ77_STATE_TYPE:
+                if (p == pe) {
+                    goto out;
+                }
+                switch (*p++) {
+                    case 0xF0:// compressed
+                        s->state = LZ77_STATE_FLAGS;
+                        break;
+
+                    case 0x0F:// raw
+                        s->code = 0;
+                        s->code_len = 0;
+                        s->state = LZ77_STATE_RAW_HEADER;
+                        break;
+
+                    default:
+                        s->state = LZ77_STATE_ERROR;
+                        return -1;
+                }
+                s->block_out = 0;
+                break;
+
+            case LZ77_STATE_RAW_HEADER:// one ignored byte, 16 bit length
+                if (p == pe) {
+                    goto out;
+                }
+                s->code |= *p++ << (8 * s->code_len++);
+                if (s->code_len == 3) {
+                    s->len = MIN(s->code >> 8, LZ77_BLOCK_SIZE);
+                    s->state = LZ77_STATE_RAW;
+                }
+                break;
+
+            case LZ77_STATE_RAW:
+                if (!s->len) {
+                    s->state = LZ77_STATE_TYPE;
+                    break;
+                }
+                n = MIN(MIN(s->len, pe - p), lz77_stream_space(s));
+                if (!n) {
+                    goto out;
+                }
+                s->len -= n;
+                while (n--) {
+                    lz77_stream_put(s, *p++);
+                }
+                break;
+
+            case LZ77_STATE_FLAGS:
+                if (p == pe) {
+                    goto out;
+                }
+                s->flags = *p++;
+                s->items = 8;
+                s->state = LZ77_STATE_ITEM;
+                break;
+
+            case LZ77_STATE_ITEM:
+                if (!s->items) {
+                    s->state = LZ77_STATE_FLAGS;
+                } else if (s->flags & 1) {// codeword
+                    s->code = 0;
+                    s->code_len = 0;
+                    s->state = LZ77_STATE_CODEWORD;
+                } else {
+                    if (p == pe || !lz77_stream_space(s)) {
+                        goto out;
+                    }
+                    lz77_stream_put(s, *p++);
+                    s->flags >>= 1;
+                    s->items--;
+                }
+                break;
+
+            case LZ77_STATE_CODEWORD:
+                if (p == pe) {
+                    goto out;
+                }
+                s->code = (s->code << 8) | *p++;
+                if (++s->code_len < 2) {
+                    break;
+                }
+                s->flags >>= 1;
+                s->items--;
+                s->dist = s->code & 0xfff;
+                if (!s->dist) {// end of block
+                    s->state = LZ77_STATE_TYPE;
+                    break;
+                }
+                s->len = s->block_out < LZ77_BLOCK_SIZE ? MIN(len_table[s->code >> 12], LZ77_BLOCK_SIZE - s->block_out) : 0;
+                s->state = LZ77_STATE_COPY;
+                break;
+
+            case LZ77_STATE_COPY:
+                if (!s->len) {
+                    s->state = LZ77_STATE_ITEM;
+                    break;
+                }
+                n = MIN(s->len, lz77_stream_space(s));
+                if (!n) {
+                    goto out;
+                }
+                s->len -= n;
+                while (n--) {
+                    lz77_stream_put(s, s->window[(s->wpos - s->dist) % LZ77_WINDOW_SIZE]);
+                }
+                break;
+
+            default:
+                return -1;
+        }
+    }
+
+out:
+    return p - src;
+}
+
+int lz77_stream_read(LZ77Stream *s, unsigned char *dst, int len)
+{
+    int n, chunk;
+
+    n = MIN(len, lz77_stream_avail(s));
+    len = n;
+    while (len) {
+        chunk = MIN(len, LZ77_WINDOW_SIZE - s->rpos % LZ77_WINDOW_SIZE);
+        memcpy(dst, &s->window[s->rpos % LZ77_WINDOW_SIZE], chunk);
+        s->rpos += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+
+    return n;
+}
@@ -520,6 +520,7 @@ void main_loop_wait(int nonblocking)
     /* CPU thread can infinitely wait for event after
        missing the warp */
     qemu_start_warp_timer();
+    qemu_idle_warp();
     qemu_clock_run_all_timers();
 }
 
@@ -0,0 +1,393 @@
+/*
+ * YCbCr 4:2:2 packing and scaling
+ *
+ * License: GNU GPL, version 2 or later.
+ *   See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/ycbcr422.h"
+#include <math.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#define WEIGHT_ONE (1 << YCBCR422_WEIGHT_BITS)
+
+/* Larger downscale factors still average over this many source samples at most */
+#define MAX_RADIUS 64
+
+void ycbcr422_pack(uint8_t *dst, const uint8_t *y, const uint8_t *cb, const uint8_t *cr, unsigned int n)
+{
+    unsigned int x = 0;
+
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi16(0xff);
+
+    for (; x + 16 <= n; x += 16) {
+        __m128i y0 = _mm_loadu_si128((const __m128i *) &y[x*2]);
+        __m128i y1 = _mm_loadu_si128((const __m128i *) &y[x*2+16]);
+        __m128i ye = _mm_packus_epi16(_mm_and_si128(y0, mask), _mm_and_si128(y1, mask));
+        __m128i yo = _mm_packus_epi16(_mm_srli_epi16(y0, 8), _mm_srli_epi16(y1, 8));
+        __m128i u = _mm_loadu_si128((const __m128i *) &cb[x]);
+        __m128i v = _mm_loadu_si128((const __m128i *) &cr[x]);
+        __m128i ulo = _mm_unpacklo_epi8(u, ye);
+        __m128i uhi = _mm_unpackhi_epi8(u, ye);
+        __m128i vlo = _mm_unpacklo_epi8(v, yo);
+        __m128i vhi = _mm_unpackhi_epi8(v, yo);
+
+        _mm_storeu_si128((__m128i *) &dst[x*4], _mm_unpacklo_epi16(ulo, vlo));
+        _mm_storeu_si128((__m128i *) &dst[x*4+16], _mm_unpackhi_epi16(ulo, vlo));
+        _mm_storeu_si128((__m128i *) &dst[x*4+32], _mm_unpacklo_epi16(uhi, vhi));
+        _mm_storeu_si128((__m128i *) &dst[x*4+48], _mm_unpackhi_epi16(uhi, vhi));
+    }
+#elif defined(__ARM_NEON)
+    for (; x + 16 <= n; x += 16) {
+        uint8x16x2_t yy = vld2q_u8(&y[x*2]);
+        uint8x16x4_t out = {{vld1q_u8(&cb[x]), yy.val[0], vld1q_u8(&cr[x]), yy.val[1]}};
+
+        vst4q_u8(&dst[x*4], out);
+    }
+#endif
+
+    for (; x < n; x++) {
+        dst[x*4] = cb[x];
+        dst[x*4+1] = y[x*2];
+        dst[x*4+2] = cr[x];
+        dst[x*4+3] = y[x*2+1];
+    }
+}
+
+/*
+ * Tent filter centered on each output sample. Its radius is one source
+ * sample when upscaling (bilinear) and the scale factor when downscaling.
+ * Taps that fall outside the source are folded onto the edge samples.
+ */
+static void ycbcr422_filter_init(YCbCr422Filter *f, unsigned int n, unsigned int n_src, int32_t offset, uint32_t scale)
+{
+    double ratio = scale / 4096.0;
+    double radius = MIN(MAX(ratio, 1.0), MAX_RADIUS);
+    unsigned int raw_taps = ceil(2 * radius);
+    unsigned int i, t, j, best, taps;
+    int s0, total;
+    double c, sum;
+    double *w = g_new(double, raw_taps);
+    int *iw;
+    bool trailing;
+
+    f->n = n;
+    f->taps = MIN(raw_taps, n_src);
+    f->start = g_new(int, n);
+    f->weights = g_new(uint8_t, n * f->taps);
+    iw = g_new(int, f->taps);
+
+    for (i = 0; i < n; i++) {
+        c = (offset + (int64_t) i * scale) / 4096.0 + (radius - 1) / 2;
+        s0 = floor(c - radius) + 1;
+
+        sum = 0;
+        for (t = 0; t < raw_taps; t++) {
+            w[t] = MAX(1 - fabs(s0 + (int) t - c) / radius, 0);
+            sum += w[t];
+        }
+
+        f->start[i] = MIN(MAX(s0, 0), (int) (n_src - f->taps));
+        memset(iw, 0, f->taps * sizeof(int));
+        for (t = 0; t < raw_taps; t++) {
+            j = MIN(MAX(s0 + (int) t, 0), (int) n_src - 1) - f->start[i];
+            iw[j] += lround(w[t] * WEIGHT_ONE / sum);
+        }
+
+        total = 0;
+        best = 0;
+        for (t = 0; t < f->taps; t++) {
+            total += iw[t];
+            if (iw[t] > iw[best]) {
+                best = t;
+            }
+        }
+        iw[best] += WEIGHT_ONE - total;
+
+        for (t = 0; t < f->taps; t++) {
+            f->weights[i * f->taps + t] = iw[t];
+        }
+    }
+
+    // Drop trailing taps that are zero for every output sample
+    for (taps = f->taps; taps > 1; taps--) {
+        trailing = false;
+        for (i = 0; i < n && !trailing; i++) {
+            trailing = f->weights[i * f->taps + taps - 1];
+        }
+        if (trailing) {
+            break;
+        }
+    }
+    if (taps != f->taps) {
+        for (i = 0; i < n; i++) {
+            memmove(&f->weights[i * taps], &f->weights[i * f->taps], taps);
+        }
+        f->taps = taps;
+    }
+
+    g_free(iw);
+    g_free(w);
+}
+
+/*
+ * Lay the weights out to line up with a 16 byte load of a packed row that
+ * is row_size bytes long, with samples lane_step 16-bit lanes apart.
+ */
+static void ycbcr422_filter_simd_init(YCbCr422Filter *f, unsigned int lane_step, unsigned int step, size_t row_size)
+{
+    unsigned int i, t;
+
+    f->wvec = NULL;
+    f->simd_n = 0;
+    if (f->taps * lane_step > 8) {
+        return;
+    }
+
+    f->wvec = g_new0(int16_t, f->n * 8);
+    for (i = 0; i < f->n; i++) {
+        for (t = 0; t < f->taps; t++) {
+            f->wvec[i * 8 + t * lane_step] = f->weights[i * f->taps + t];
+        }
+        // The loads must not run past the row, start only moves forward
+        if (f->start[i] * step + 16 <= row_size) {
+            f->simd_n = i + 1;
+        }
+    }
+}
+
+static void ycbcr422_filter_destroy(YCbCr422Filter *f)
+{
+    g_free(f->start);
+    g_free(f->weights);
+    g_free(f->wvec);
+}
+
+static inline void ycbcr422_filter_row_taps(const YCbCr422Filter *f, unsigned int i, uint8_t *dst, const uint8_t *src,
+                                            unsigned int step, unsigned int taps)
+{
+    unsigned int t, acc;
+    const uint8_t *s, *w;
+
+    for (; i < f->n; i++) {
+        s = src + f->start[i] * step;
+        w = &f->weights[i * taps];
+        acc = WEIGHT_ONE / 2;
+        for (t = 0; t < taps; t++) {
+            acc += w[t] * s[t * step];
+        }
+        dst[i] = acc >> YCBCR422_WEIGHT_BITS;
+    }
+}
+
+#if defined(__SSE2__)
+/* Four outputs at a time, each one a single load and multiply-add. Returns the number of outputs done. */
+static unsigned int ycbcr422_filter_row_sse2(const YCbCr422Filter *f, uint8_t *dst, const uint8_t *src, unsigned int step, unsigned int off)
+{
+    const __m128i round = _mm_set1_epi32(WEIGHT_ONE / 2);
+    const __m128i mask = _mm_set1_epi32(0xff);
+    __m128i v[4], a, b;
+    unsigned int i, k;
+    uint32_t out;
+
+    for (i = 0; i + 4 <= f->simd_n; i += 4) {
+        for (k = 0; k < 4; k++) {
+            __m128i x = _mm_loadu_si128((const __m128i *) &src[f->start[i + k] * step]);
+            if (step == 2) {
+                x = _mm_srli_epi16(x, 8);
+            } else {
+                x = _mm_and_si128(off ? _mm_srli_epi32(x, 16) : x, mask);
+            }
+            v[k] = _mm_madd_epi16(x, _mm_loadu_si128((const __m128i *) &f->wvec[(i + k) * 8]));
+        }
+
+        a = _mm_add_epi32(_mm_unpacklo_epi32(v[0], v[1]), _mm_unpackhi_epi32(v[0], v[1]));
+        b = _mm_add_epi32(_mm_unpacklo_epi32(v[2], v[3]), _mm_unpackhi_epi32(v[2], v[3]));
+        a = _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b)), round);
+        a = _mm_srli_epi32(a, YCBCR422_WEIGHT_BITS);
+        a = _mm_packs_epi32(a, a);
+        out = _mm_cvtsi128_si32(_mm_packus_epi16(a, a));
+        memcpy(&dst[i], &out, sizeof(out));
+    }
+    return i;
+}
+#endif
+
+/*
+ * Horizontal pass over one plane of a packed row, output i reads the samples at
+ * src + (start[i] + t) * step + off. Common tap counts get their own unrolled loop.
+ */
+static void ycbcr422_filter_row(const YCbCr422Filter *f, uint8_t *dst, const uint8_t *src, unsigned int step, unsigned int off)
+{
+    unsigned int i = 0;
+
+#if defined(__SSE2__)
+    if (f->wvec) {
+        i = ycbcr422_filter_row_sse2(f, dst, src, step, off);
+    }
+#endif
+
+    switch (f->taps) {
+        case 1:
+            ycbcr422_filter_row_taps(f, i, dst, src + off, step, 1);
+            break;
+
+        case 2:
+            ycbcr422_filter_row_taps(f, i, dst, src + off, step, 2);
+            break;
+
+        case 3:
+            ycbcr422_filter_row_taps(f, i, dst, src + off, step, 3);
+            break;
+
+        case 4:
+            ycbcr422_filter_row_taps(f, i, dst, src + off, step, 4);
+            break;
+
+        default:
+            ycbcr422_filter_row_taps(f, i, dst, src + off, step, f->taps);
+    }
+}
+
+/* Vertical pass over n bytes, the weights sum to WEIGHT_ONE so the accumulators fit in 16 bits */
+static void ycbcr422_filter_col(uint8_t *dst, const uint8_t **rows, const uint8_t *w, unsigned int taps, unsigned int n)
+{
+    unsigned int x = 0, t, acc;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; x + 16 <= n; x += 16) {
+        __m128i lo = _mm_set1_epi16(WEIGHT_ONE / 2);
+        __m128i hi = lo;
+
+        for (t = 0; t < taps; t++) {
+            __m128i v = _mm_loadu_si128((const __m128i *) &rows[t][x]);
+            __m128i wt = _mm_set1_epi16(w[t]);
+            lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), wt));
+            hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), wt));
+        }
+
+        _mm_storeu_si128((__m128i *) &dst[x], _mm_packus_epi16(_mm_srli_epi16(lo, YCBCR422_WEIGHT_BITS), _mm_srli_epi16(hi, YCBCR422_WEIGHT_BITS)));
+    }
+#elif defined(__ARM_NEON)
+    for (; x + 16 <= n; x += 16) {
+        uint16x8_t lo = vdupq_n_u16(WEIGHT_ONE / 2);
+        uint16x8_t hi = lo;
+
+        for (t = 0; t < taps; t++) {
+            uint8x16_t v = vld1q_u8(&rows[t][x]);
+            uint8x8_t wt = vdup_n_u8(w[t]);
+            lo = vmlal_u8(lo, vget_low_u8(v), wt);
+            hi = vmlal_u8(hi, vget_high_u8(v), wt);
+        }
+
+        vst1q_u8(&dst[x], vcombine_u8(vshrn_n_u16(lo, YCBCR422_WEIGHT_BITS), vshrn_n_u16(hi, YCBCR422_WEIGHT_BITS)));
+    }
+#endif
+
+    for (; x < n; x++) {
+        acc = WEIGHT_ONE / 2;
+        for (t = 0; t < taps; t++) {
+            acc += w[t] * rows[t][x];
+        }
+        dst[x] = acc >> YCBCR422_WEIGHT_BITS;
+    }
+}
+
+void ycbcr422_scaler_init(YCbCr422Scaler *sc, unsigned int src_width, unsigned int src_height,
+                          unsigned int dst_width, unsigned int dst_height,
+                          int32_t offset_x, int32_t offset_y, uint32_t scale_x, uint32_t scale_y)
+{
+    unsigned int i;
+
+    sc->src_width = src_width;
+    sc->src_height = src_height;
+    sc->dst_width = dst_width;
+    sc->dst_height = dst_height;
+
+    ycbcr422_filter_init(&sc->luma, dst_width, src_width, offset_x, scale_x);
+    ycbcr422_filter_init(&sc->chroma, dst_width / 2, src_width / 2, offset_x / 2, scale_x);
+    ycbcr422_filter_init(&sc->vert, dst_height, src_height, offset_y, scale_y);
+    ycbcr422_filter_simd_init(&sc->luma, 1, 2, src_width * 2);
+    ycbcr422_filter_simd_init(&sc->chroma, 2, 4, src_width * 2);
+    sc->vert.wvec = NULL;
+
+    // When downscaling vertically the ring only holds one vertically filtered source row
+    sc->ring_size = sc->vert.taps;
+    sc->ring_row = g_new(int, sc->ring_size);
+    for (i = 0; i < sc->ring_size; i++) {
+        sc->ring_row[i] = -1;
+    }
+    sc->ring = g_new(uint8_t, MAX(sc->ring_size * dst_width, src_width) * 2);
+    sc->out = g_new(uint8_t, dst_width * 2);
+}
+
+void ycbcr422_scaler_destroy(YCbCr422Scaler *sc)
+{
+    ycbcr422_filter_destroy(&sc->luma);
+    ycbcr422_filter_destroy(&sc->chroma);
+    ycbcr422_filter_destroy(&sc->vert);
+    g_free(sc->ring_row);
+    g_free(sc->ring);
+    g_free(sc->out);
+}
+
+void ycbcr422_scale(YCbCr422Scaler *sc, uint8_t *dst, ptrdiff_t dst_stride, const uint8_t *src, ptrdiff_t src_stride)
+{
+    unsigned int y, t, slot, row;
+    unsigned int pairs = sc->dst_width / 2;
+    const uint8_t **rows = g_newa(const uint8_t *, sc->vert.taps);
+    const uint8_t *w, *in, *out;
+    uint8_t *hrow;
+
+    for (y = 0; y < sc->dst_height; y++) {
+        w = &sc->vert.weights[y * sc->vert.taps];
+
+        if (sc->dst_height <= sc->src_height) {
+            // Fewer output rows, filter vertically first so that only those go through the horizontal pass
+            for (t = 0; t < sc->vert.taps; t++) {
+                rows[t] = src + (sc->vert.start[y] + t) * src_stride;
+            }
+            if (sc->vert.taps == 1) {
+                in = rows[0];
+            } else {
+                ycbcr422_filter_col(sc->ring, rows, w, sc->vert.taps, sc->src_width * 2);
+                in = sc->ring;
+            }
+            ycbcr422_filter_row(&sc->luma, sc->out, in, 2, 1);
+            ycbcr422_filter_row(&sc->chroma, sc->out + sc->dst_width, in, 4, 0);
+            ycbcr422_filter_row(&sc->chroma, sc->out + sc->dst_width + pairs, in, 4, 2);
+            out = sc->out;
+        } else {
+            // Source rows only go through the horizontal pass once, the vertical window moves forward
+            for (t = 0; t < sc->vert.taps; t++) {
+                row = sc->vert.start[y] + t;
+                slot = row % sc->ring_size;
+                hrow = sc->ring + slot * sc->dst_width * 2;
+                if (sc->ring_row[slot] != (int) row) {
+                    ycbcr422_filter_row(&sc->luma, hrow, src + row * src_stride, 2, 1);
+                    ycbcr422_filter_row(&sc->chroma, hrow + sc->dst_width, src + row * src_stride, 4, 0);
+                    ycbcr422_filter_row(&sc->chroma, hrow + sc->dst_width + pairs, src + row * src_stride, 4, 2);
+                    sc->ring_row[slot] = row;
+                }
+                rows[t] = hrow;
+            }
+
+            if (sc->vert.taps == 1) {
+                out = rows[0];
+            } else {
+                ycbcr422_filter_col(sc->out, rows, w, sc->vert.taps, sc->dst_width * 2);
+                out = sc->out;
+            }
+        }
+
+        ycbcr422_pack(dst + y * dst_stride, out, out + sc->dst_width, out + sc->dst_width + pairs, pairs);
+    }
+}